@@ -0,0 +1,617 @@
+/* cluster_index.c: persistent indexes over cluster files, shared by the
+ * nodescf and yamlfile modules.
+ *
+ * A section index maps every value of one section (CLUSTER, ALL, or
+ * whatever has() asks about) to the clusters whose section contains
+ * it. Each cluster's entry remembers the generation of every cluster
+ * file its expansion read, so when a file changes only the clusters
+ * built from it are expanded again. Nothing is checked at all while
+ * libcrange_data_version stays put.
+ *
+ * A member index goes the other way for a single cluster: every host
+ * in any of its sections -> those sections. It's kept with the same
+ * bookkeeping, one entry per cluster.
+ *
+ * The cluster listing itself is kept the same way: an entry whose
+ * values are the sorted cluster names and whose files are the cluster
+ * directory and whatever else the module looked at to decide what's a
+ * cluster.
+ *
+ * Each kind lives in a cache of its own ("<module>:cluster_index",
+ * ":member_index" and ":all_clusters"), charged for its entries, so
+ * evicting one throws it away and it's built again on next use. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <apr_strings.h>
+#include <apr_tables.h>
+
+#include "set.h"
+#include "libcrange.h"
+#include "range.h"
+#include "range_request.h"
+#include "cluster_index.h"
+
+typedef struct dep
+{
+    const char* path;
+    long gen;
+} dep;
+
+/* one cluster's values and the files they came from */
+typedef struct indexed_cluster
+{
+    apr_pool_t* pool;
+    const char* name;
+    const char** values;
+    apr_array_header_t* deps; /* dep */
+    int uses_index; /* built from another index: rebuild on every check */
+    struct indexed_cluster* outer; /* while recording */
+    set* members;   /* member index: host -> apr_array_header_t */
+    long version;   /* member index: libcrange_data_version when checked */
+    size_t bytes;   /* charged to the cache */
+} indexed_cluster;
+
+typedef struct section_index
+{
+    const char* section;
+    apr_pool_t* cache_pool; /* the cache's: the clusters' pools */
+    apr_pool_t* pool;  /* the sets below and the arrays in values */
+    set* clusters;     /* name -> indexed_cluster */
+    set* values;       /* value -> apr_array_header_t of cluster names */
+    long version;      /* libcrange_data_version when last checked */
+    int garbage;       /* dead entries in pool */
+    int updating;
+} section_index;
+
+typedef struct cluster_listing
+{
+    apr_pool_t* pool;         /* the cache's */
+    indexed_cluster* current;
+    indexed_cluster* retired; /* may still be in a caller's hands */
+} cluster_listing;
+
+/* the entries being built, innermost first: cluster_index_depends adds
+ * to all of them. Modules run with the libcrange lock held, and keep it
+ * while cluster_index_busy, so nobody else touches this */
+static indexed_cluster* recording = NULL;
+/* section indexes being updated, half built meanwhile */
+static int updating = 0;
+
+int cluster_index_busy(void)
+{
+    return recording || updating;
+}
+
+void cluster_index_depends(libcrange* lr, const char* path, long gen)
+{
+    indexed_cluster* ic;
+
+    for (ic = recording; ic; ic = ic->outer) {
+        dep* d;
+        int i;
+
+        for (i = 0; i < ic->deps->nelts; i++)
+            if (strcmp(((dep*)ic->deps->elts)[i].path, path) == 0)
+                break;
+        if (i < ic->deps->nelts)
+            continue;
+        d = apr_array_push(ic->deps);
+        d->path = apr_pstrdup(ic->pool, path);
+        d->gen = gen;
+    }
+}
+
+static int deps_fresh(libcrange* lr, const indexed_cluster* ic)
+{
+    int i;
+
+    if (ic->uses_index)
+        return 0;
+    for (i = 0; i < ic->deps->nelts; i++) {
+        const dep* d = &((dep*)ic->deps->elts)[i];
+        if (libcrange_file_generation(lr, d->path) != d->gen)
+            return 0;
+    }
+    return 1;
+}
+
+/* the cache src keeps what in, in buf */
+static const char* cache_name(char* buf, size_t len,
+                              const cluster_source* src, const char* what)
+{
+    snprintf(buf, len, "%s:%s", src->name, what);
+    return buf;
+}
+
+/* the pool of the cache what, or with caching off pool, the request's */
+static apr_pool_t* cache_pool(libcrange* lr, const cluster_source* src,
+                              const char* what, apr_pool_t* pool)
+{
+    char name[256];
+    apr_pool_t* p = libcrange_cache_pool(lr, cache_name(name, sizeof name,
+                                                        src, what));
+    return p ? p : pool;
+}
+
+/* charge the cache what for ic at bytes; 0 when it goes */
+static void charge(libcrange* lr, const cluster_source* src,
+                   const char* what, indexed_cluster* ic, size_t bytes)
+{
+    char name[256];
+
+    libcrange_cache_charge(lr, cache_name(name, sizeof name, src, what),
+                           (long)bytes - (long)ic->bytes);
+    ic->bytes = bytes;
+}
+
+/* what ic costs: its values also go into the section index's sets */
+static size_t cluster_bytes(const indexed_cluster* ic)
+{
+    size_t bytes = sizeof(*ic) + strlen(ic->name) + 1;
+    const char** value;
+    int i;
+
+    for (i = 0; i < ic->deps->nelts; i++)
+        bytes += sizeof(dep) + strlen(((dep*)ic->deps->elts)[i].path) + 1;
+    if (ic->values)
+        for (value = ic->values; *value; value++)
+            bytes += 2 * (strlen(*value) + 1 + sizeof(char*)) +
+                sizeof(set_element);
+    if (ic->members)
+        bytes += set_bytes(ic->members) +
+            ic->members->members * (sizeof(apr_array_header_t) +
+                                    2 * sizeof(char*));
+    return bytes;
+}
+
+/* add ic->name to the list of each of its values, keeping it sorted */
+static void link_cluster(section_index* idx, indexed_cluster* ic)
+{
+    const char** value;
+
+    for (value = ic->values; *value; value++) {
+        apr_array_header_t* clusters = set_get_data(idx->values, *value);
+        const char** names;
+        int i;
+
+        if (!clusters) {
+            clusters = apr_array_make(idx->pool, 1, sizeof(char*));
+            set_add(idx->values, *value, clusters);
+        }
+        apr_array_push(clusters);
+        names = (const char**)clusters->elts;
+        for (i = clusters->nelts - 1;
+             i > 0 && strcmp(names[i - 1], ic->name) > 0; i--)
+            names[i] = names[i - 1];
+        names[i] = ic->name;
+    }
+}
+
+static void unlink_cluster(section_index* idx, indexed_cluster* ic)
+{
+    const char** value;
+
+    for (value = ic->values; *value; value++) {
+        apr_array_header_t* clusters = set_get_data(idx->values, *value);
+        const char** names;
+        int i, j;
+
+        if (!clusters)
+            continue;
+        names = (const char**)clusters->elts;
+        for (i = j = 0; i < clusters->nelts; i++)
+            if (names[i] != ic->name)
+                names[j++] = names[i];
+        clusters->nelts = j;
+        if (!j) {
+            set_remove(idx->values, *value);
+            idx->garbage++;
+        }
+    }
+}
+
+static void index_reset(section_index* idx)
+{
+    apr_pool_create(&idx->pool, idx->cache_pool);
+    idx->clusters = set_new(idx->pool, 0);
+    idx->values = set_new(idx->pool, 0);
+    idx->garbage = 0;
+}
+
+/* rebuild the sets once enough of them is dead */
+static void index_compact(section_index* idx)
+{
+    apr_pool_t* old_pool = idx->pool;
+    set* old_clusters = idx->clusters;
+    set_iter it;
+    set_element* elt;
+
+    if (idx->garbage < 1000 || idx->garbage < idx->values->members)
+        return;
+
+    index_reset(idx);
+    for (set_iter_init(&it, old_clusters); (elt = set_iter_next(&it)); ) {
+        set_add(idx->clusters, elt->name, elt->data);
+        link_cluster(idx, elt->data);
+    }
+    apr_pool_destroy(old_pool);
+}
+
+/* the index for section, created empty and out of date if need be (in
+ * pool, with caching off) */
+static section_index* index_find(libcrange* lr, const cluster_source* src,
+                                 const char* section, apr_pool_t* pool)
+{
+    char name[256];
+    set* indexes;
+    section_index* idx;
+
+    cache_name(name, sizeof name, src, "cluster_index");
+    if (!(indexes = libcrange_get_cache(lr, name))) {
+        indexes = set_new(cache_pool(lr, src, "cluster_index", pool), 0);
+        libcrange_set_cache(lr, name, indexes);
+    }
+    if ((idx = set_get_data(indexes, section)))
+        return idx;
+
+    idx = apr_pcalloc(indexes->pool, sizeof(*idx));
+    idx->section = apr_pstrdup(indexes->pool, section);
+    idx->version = libcrange_data_version(lr) - 1;
+    idx->cache_pool = indexes->pool;
+    index_reset(idx);
+    set_add(indexes, section, idx);
+    return idx;
+}
+
+/* a new entry with a pool of its own, under its cache's */
+static indexed_cluster* indexed_cluster_new(apr_pool_t* parent,
+                                            const char* name)
+{
+    apr_pool_t* pool;
+    indexed_cluster* ic;
+
+    apr_pool_create(&pool, parent);
+    ic = apr_pcalloc(pool, sizeof(*ic));
+    ic->pool = pool;
+    ic->name = apr_pstrdup(pool, name);
+    ic->deps = apr_array_make(pool, 2, sizeof(dep));
+    return ic;
+}
+
+static void index_put(libcrange* lr, const cluster_source* src,
+                      section_index* idx, indexed_cluster* ic)
+{
+    indexed_cluster* old = set_get_data(idx->clusters, ic->name);
+    if (old) {
+        unlink_cluster(idx, old);
+        charge(lr, src, "cluster_index", old, 0);
+        apr_pool_destroy(old->pool);
+    }
+    set_add(idx->clusters, ic->name, ic);
+    link_cluster(idx, ic);
+    charge(lr, src, "cluster_index", ic, cluster_bytes(ic));
+}
+
+/* expand the section of cluster into a new entry */
+static void index_cluster(range_request* rr, const cluster_source* src,
+                          section_index* idx, const char* cluster)
+{
+    libcrange* lr = range_request_lr(rr);
+    apr_pool_t* tmp;
+    range_request* sub;
+    indexed_cluster* ic = indexed_cluster_new(idx->cache_pool, cluster);
+    range* r;
+    set_iter it;
+    set_element* elt;
+    int i;
+
+    /* a request of our own: its warnings and garbage go away with it */
+    apr_pool_create(&tmp, range_request_pool(rr));
+    sub = range_request_new(lr, tmp);
+    range_request_disable_warns(sub);
+
+    ic->outer = recording;
+    recording = ic;
+    r = src->expand(sub, cluster, idx->section);
+    recording = ic->outer;
+    ic->outer = NULL;
+
+    /* the names as they are, the way has() always compared them */
+    ic->values = apr_palloc(ic->pool, sizeof(char*) * (range_members(r) + 1));
+    i = 0;
+    for (set_iter_init(&it, r->nodes); (elt = set_iter_next(&it)); )
+        ic->values[i++] = apr_pstrdup(ic->pool, elt->name);
+    ic->values[i] = NULL;
+    apr_pool_destroy(tmp);
+
+    index_put(lr, src, idx, ic);
+}
+
+static section_index* index_get(range_request* rr, const cluster_source* src,
+                                const char* section)
+{
+    libcrange* lr = range_request_lr(rr);
+    apr_pool_t* pool = range_request_pool(rr);
+    section_index* idx = index_find(lr, src, section, pool);
+    long version = libcrange_data_version(lr);
+    indexed_cluster* ic;
+    const char** clusters;
+    set* current;
+    apr_array_header_t* gone;
+    set_iter it;
+    set_element* elt;
+    int i;
+
+    /* whatever is being expanded now depends on all of this index */
+    for (ic = recording; ic; ic = ic->outer)
+        ic->uses_index = 1;
+
+    /* up to date, or one of its own clusters asking for it while we
+     * update: use what we have */
+    if (idx->version == version || idx->updating)
+        return idx;
+
+    idx->updating = 1;
+    updating++;
+    idx->version = version;
+    current = set_new(pool, 0);
+    clusters = cluster_index_all(rr, src);
+    for (; clusters && *clusters; clusters++) {
+        ic = set_get_data(idx->clusters, *clusters);
+        set_add(current, *clusters, NULL);
+        if (!ic || !deps_fresh(lr, ic))
+            index_cluster(rr, src, idx, *clusters);
+    }
+
+    /* clusters that are gone */
+    gone = apr_array_make(pool, 1, sizeof(indexed_cluster*));
+    for (set_iter_init(&it, idx->clusters); (elt = set_iter_next(&it)); )
+        if (!set_get(current, elt->name))
+            *(indexed_cluster**)apr_array_push(gone) = elt->data;
+    for (i = 0; i < gone->nelts; i++) {
+        ic = ((indexed_cluster**)gone->elts)[i];
+        unlink_cluster(idx, ic);
+        set_remove(idx->clusters, ic->name);
+        charge(lr, src, "cluster_index", ic, 0);
+        apr_pool_destroy(ic->pool);
+        idx->garbage++;
+    }
+
+    index_compact(idx);
+    idx->updating = 0;
+    updating--;
+    return idx;
+}
+
+const apr_array_header_t* cluster_index_lookup(range_request* rr,
+                                               const cluster_source* src,
+                                               const char* section,
+                                               const char* value)
+{
+    section_index* idx = index_get(rr, src, section);
+    return set_get_data(idx->values, value);
+}
+
+static int compare_names(const void* a, const void* b)
+{
+    return strcmp(*(const char* const*)a, *(const char* const*)b);
+}
+
+const char** cluster_index_all(range_request* rr, const cluster_source* src)
+{
+    char name[256];
+    libcrange* lr = range_request_lr(rr);
+    long version = libcrange_data_version(lr);
+    cluster_listing* l;
+    indexed_cluster* ic;
+    const char** names;
+    int i, n;
+
+    cache_name(name, sizeof name, src, "all_clusters");
+    if (!(l = libcrange_get_cache(lr, name))) {
+        apr_pool_t* pool = cache_pool(lr, src, "all_clusters",
+                                      range_request_pool(rr));
+        l = apr_pcalloc(pool, sizeof(*l));
+        l->pool = pool;
+        libcrange_set_cache(lr, name, l);
+    }
+
+    /* whatever is being expanded now depends on the listing */
+    for (ic = recording; ic; ic = ic->outer)
+        ic->uses_index = 1;
+
+    ic = l->current;
+    if (ic && (ic->version == version || deps_fresh(lr, ic))) {
+        ic->version = version;
+        return ic->values;
+    }
+
+    ic = indexed_cluster_new(l->pool, src->name);
+    ic->outer = recording;
+    recording = ic;
+    names = src->all_clusters(rr);
+    recording = ic->outer;
+    ic->outer = NULL;
+    if (!names) {
+        /* not cached: the next call warns again */
+        apr_pool_destroy(ic->pool);
+        return NULL;
+    }
+
+    for (n = 0; names[n]; n++)
+        ;
+    ic->values = apr_palloc(ic->pool, sizeof(char*) * (n + 1));
+    for (i = 0; i < n; i++)
+        ic->values[i] = apr_pstrdup(ic->pool, names[i]);
+    ic->values[n] = NULL;
+    qsort(ic->values, n, sizeof(char*), compare_names);
+    ic->version = version;
+    charge(lr, src, "all_clusters", ic, cluster_bytes(ic));
+
+    if (l->retired) {
+        charge(lr, src, "all_clusters", l->retired, 0);
+        apr_pool_destroy(l->retired->pool);
+    }
+    l->retired = l->current;
+    l->current = ic;
+    return ic->values;
+}
+
+/* expand every section of cluster into a new member index entry */
+static indexed_cluster* index_members(range_request* rr,
+                                      const cluster_source* src,
+                                      apr_pool_t* pool, const char* cluster)
+{
+    libcrange* lr = range_request_lr(rr);
+    apr_pool_t* tmp;
+    range_request* sub;
+    indexed_cluster* ic = indexed_cluster_new(pool, cluster);
+    const char** sections;
+    int i;
+
+    apr_pool_create(&tmp, range_request_pool(rr));
+    sub = range_request_new(lr, tmp);
+    range_request_disable_warns(sub);
+    ic->members = set_new(ic->pool, 0);
+
+    ic->outer = recording;
+    recording = ic;
+    sections = range_get_hostnames(tmp, src->expand(sub, cluster, "KEYS"));
+    for (i = 0; sections[i]; i++) {
+        const char* section = apr_pstrdup(ic->pool, sections[i]);
+        range* r = src->expand(sub, cluster, section);
+        set_iter it;
+        set_element* elt;
+
+        for (set_iter_init(&it, r->nodes); (elt = set_iter_next(&it)); ) {
+            apr_array_header_t* in = set_get_data(ic->members, elt->name);
+            if (!in) {
+                in = apr_array_make(ic->pool, 2, sizeof(char*));
+                set_add(ic->members, elt->name, in);
+            }
+            *(const char**)apr_array_push(in) = section;
+        }
+    }
+    recording = ic->outer;
+    ic->outer = NULL;
+    apr_pool_destroy(tmp);
+
+    return ic;
+}
+
+const apr_array_header_t* cluster_index_sections(range_request* rr,
+                                                 const cluster_source* src,
+                                                 const char* cluster,
+                                                 const char* host)
+{
+    char name[256];
+    libcrange* lr = range_request_lr(rr);
+    long version = libcrange_data_version(lr);
+    set* entries;
+    indexed_cluster* ic;
+
+    cache_name(name, sizeof name, src, "member_index");
+    if (!(entries = libcrange_get_cache(lr, name))) {
+        entries = set_new(cache_pool(lr, src, "member_index",
+                                     range_request_pool(rr)), 0);
+        libcrange_set_cache(lr, name, entries);
+    }
+
+    ic = set_get_data(entries, cluster);
+    if (!ic || (ic->version != version && !deps_fresh(lr, ic))) {
+        indexed_cluster* old = ic;
+        ic = index_members(rr, src, entries->pool, cluster);
+        set_add(entries, cluster, ic);
+        charge(lr, src, "member_index", ic, cluster_bytes(ic));
+        if (old) {
+            charge(lr, src, "member_index", old, 0);
+            apr_pool_destroy(old->pool);
+        }
+    }
+    ic->version = version;
+
+    return set_get_data(ic->members, host);
+}
+
+/* an entry per indexed cluster, "index:<cluster>:<section>" */
+void cluster_index_snapshot_save(libcrange* lr, const cluster_source* src,
+                                 range_snapshot* s)
+{
+    char key[8192];
+    set* indexes;
+    set_iter iit;
+    set_element* ielt;
+
+    if (!(indexes = libcrange_get_cache(lr, cache_name(key, sizeof key, src,
+                                                       "cluster_index"))))
+        return;
+
+    for (set_iter_init(&iit, indexes); (ielt = set_iter_next(&iit)); ) {
+        section_index* idx = ielt->data;
+        set_iter it;
+        set_element* elt;
+
+        for (set_iter_init(&it, idx->clusters);
+             (elt = set_iter_next(&it)); ) {
+            indexed_cluster* ic = elt->data;
+            const char** value;
+            int i;
+
+            if (ic->uses_index)
+                continue;
+            snprintf(key, sizeof key, "index:%s:%s", ic->name,
+                     idx->section);
+            range_snapshot_entry(s, key);
+            for (i = 0; i < ic->deps->nelts; i++)
+                range_snapshot_depends(s, ((dep*)ic->deps->elts)[i].path);
+            for (i = 0; i < ic->deps->nelts; i++)
+                range_snapshot_put(s, "dep", ((dep*)ic->deps->elts)[i].path);
+            for (value = ic->values; *value; value++)
+                range_snapshot_put(s, "value", *value);
+        }
+    }
+}
+
+int cluster_index_snapshot_entry(libcrange* lr, const cluster_source* src,
+                                 range_snapshot* s, const char* key)
+{
+    char cluster[8192];
+    const char* colon;
+    const char* name;
+    const char* value;
+    section_index* idx;
+    indexed_cluster* ic;
+    apr_array_header_t* values;
+
+    if (strncmp(key, "index:", 6) != 0)
+        return 0;
+    key += 6;
+    if (!(colon = strchr(key, ':')) || colon - key >= sizeof cluster)
+        return 1;
+    memcpy(cluster, key, colon - key);
+    cluster[colon - key] = '\0';
+
+    idx = index_find(lr, src, colon + 1, NULL);
+    if (set_get(idx->clusters, cluster))
+        return 1;
+
+    /* values stay in the mapped snapshot */
+    ic = indexed_cluster_new(idx->cache_pool, cluster);
+    values = apr_array_make(ic->pool, 16, sizeof(char*));
+    while (range_snapshot_get(s, &name, &value)) {
+        if (strcmp(name, "dep") == 0) {
+            dep* d = apr_array_push(ic->deps);
+            d->path = value;
+            d->gen = libcrange_file_generation(lr, value);
+        }
+        else if (strcmp(name, "value") == 0)
+            *(const char**)apr_array_push(values) = value;
+    }
+    *(const char**)apr_array_push(values) = NULL;
+    ic->values = (const char**)values->elts;
+
+    index_put(lr, src, idx, ic);
+    return 1;
+}
@@ -0,0 +1,63 @@
+#ifndef CLUSTER_INDEX_H
+#define CLUSTER_INDEX_H
+
+#include <apr_tables.h>
+#include "libcrange.h"
+#include "range.h"
+#include "range_request.h"
+
+/* cluster_index: indexes over the parsed cluster files of nodescf and
+ * yamlfile, kept in the libcrange cache across requests */
+
+/* what the index needs from the module */
+typedef struct cluster_source
+{
+    const char* name;    /* cache names start with this */
+    const char* section; /* the section listing a cluster's hosts */
+    /* read the cluster directory, calling cluster_index_depends for
+     * everything that decides what's a cluster */
+    const char** (*all_clusters)(range_request* rr);
+    range* (*expand)(range_request* rr, const char* cluster,
+                     const char* section);
+} cluster_source;
+
+/* the module's _expand_cluster calls this for every cluster file it
+ * looks at (gen -1 if it's missing), so that index entries know which
+ * files they were built from */
+void cluster_index_depends(libcrange* lr, const char* path, long gen);
+
+/* nonzero while an index is being built or updated. Other threads would
+ * find it half done, so the module must not suspend the libcrange lock
+ * (to parse a file, say) until it's finished */
+int cluster_index_busy(void);
+
+/* every cluster, sorted. The listing is read on first use and again
+ * only when one of the files it depends on changes */
+const char** cluster_index_all(range_request* rr, const cluster_source* src);
+
+/* the clusters whose section contains value, sorted by name, or NULL.
+ * The index for a section is built on first use, then updated one
+ * cluster at a time as files change */
+const apr_array_header_t* cluster_index_lookup(range_request* rr,
+                                               const cluster_source* src,
+                                               const char* section,
+                                               const char* value);
+
+/* the sections of cluster that contain host, or NULL. Each cluster's
+ * host -> sections map is built on first use and rebuilt when one of
+ * its files changes */
+const apr_array_header_t* cluster_index_sections(range_request* rr,
+                                                 const cluster_source* src,
+                                                 const char* cluster,
+                                                 const char* host);
+
+/* the index in warm-start snapshots: the module's snapshot_save calls
+ * cluster_index_snapshot_save, and its snapshot_load hands each entry
+ * to cluster_index_snapshot_entry, which returns 0 if the entry isn't
+ * one of ours */
+void cluster_index_snapshot_save(libcrange* lr, const cluster_source* src,
+                                 range_snapshot* s);
+int cluster_index_snapshot_entry(libcrange* lr, const cluster_source* src,
+                                 range_snapshot* s, const char* key);
+
+#endif
@@ -3,76 +3,347 @@
 #include <string.h>
 #include <stdlib.h>
 #include <mysql/mysql.h>
+#include <mysql/errmsg.h>
 #include <apr_strings.h>
+#include <apr_tables.h>
 
 #include "set.h"
 #include "libcrange.h"
 #include "range.h"
 
-const char** functions_provided(libcrange* lr)
+#define DEFAULT_MYSQL_HOST "docking"
+#define ALL_SQL "select name from nodes"
+/* followed by one ? per group */
+#define TAGS_SQL "select name, `range` from tags where name in ("
+
+/* the connection and its prepared statements: one for ALL, and one for
+ * each size of IN list. Lists are padded to a power of two so there
+ * are only a handful of those */
+typedef struct mysql_db
+{
+    apr_pool_t* pool;
+    apr_pool_t* stmt_pool;
+    MYSQL* conn;
+    set* stmts;
+    unsigned err;       /* why the last prepare failed */
+} mysql_db;
+
+static void close_db(mysql_db* db)
+{
+    set_iter it;
+    set_element* e;
+
+    if (!db->conn)
+        return;
+    for (set_iter_init(&it, db->stmts); (e = set_iter_next(&it)); )
+        mysql_stmt_close(e->data);
+    apr_pool_destroy(db->stmt_pool);
+    mysql_close(db->conn);
+    db->conn = NULL;
+}
+
+static apr_status_t cleanup_db(void* data)
+{
+    close_db(data);
+    return APR_SUCCESS;
+}
+
+static int open_db(range_request* rr, mysql_db* db)
+{
+    libcrange* lr = range_request_lr(rr);
+    const char* mysql_user = libcrange_getcfg(lr, "mysqluser");
+    const char* mysql_db = libcrange_getcfg(lr, "mysqldb");
+    const char* mysql_passwd = libcrange_getcfg(lr, "mysqlpasswd");
+    const char* mysql_host = libcrange_getcfg(lr, "mysqlhost");
+    const char* mysql_port = libcrange_getcfg(lr, "mysqlport");
+
+    if (!mysql_host)
+        mysql_host = DEFAULT_MYSQL_HOST;
+
+    db->conn = mysql_init(NULL);
+    if (!mysql_real_connect(db->conn, mysql_host, mysql_user, mysql_passwd,
+                            mysql_db, mysql_port ? atoi(mysql_port) : 0,
+                            NULL, 0)) {
+        range_request_warn(rr, "mysql %s: %s", mysql_host,
+                           mysql_error(db->conn));
+        mysql_close(db->conn);
+        db->conn = NULL;
+        return 0;
+    }
+    apr_pool_create(&db->stmt_pool, db->pool);
+    db->stmts = set_new(db->stmt_pool, 0);
+    return 1;
+}
+
+/* the connection, opened if need be */
+static mysql_db* get_db(range_request* rr)
+{
+    libcrange* lr = range_request_lr(rr);
+    apr_pool_t* pool;
+    mysql_db* db;
+
+    if ((db = libcrange_get_cache(lr, "mysql:nodes")))
+        return db->conn || open_db(rr, db) ? db : NULL;
+
+    /* with caching off the connection goes with the request */
+    apr_pool_create(&pool, lr->want_caching ? libcrange_get_pool(lr) :
+                    range_request_pool(rr));
+    db = apr_pcalloc(pool, sizeof(*db));
+    db->pool = pool;
+    apr_pool_cleanup_register(pool, db, cleanup_db, apr_pool_cleanup_null);
+    libcrange_set_cache(lr, "mysql:nodes", db);
+
+    return open_db(rr, db) ? db : NULL;
+}
+
+static MYSQL_STMT* db_stmt(range_request* rr, mysql_db* db, const char* sql)
 {
-    static const char* functions[] = {"group", 0};
-    return functions;
+    MYSQL_STMT* stmt;
+
+    if ((stmt = set_get_data(db->stmts, sql)))
+        return stmt;
+
+    stmt = mysql_stmt_init(db->conn);
+    if (!stmt || mysql_stmt_prepare(stmt, sql, strlen(sql))) {
+        range_request_warn(rr, "%s: %s", sql, stmt ? mysql_stmt_error(stmt) :
+                           mysql_error(db->conn));
+        db->err = stmt ? mysql_stmt_errno(stmt) : mysql_errno(db->conn);
+        if (stmt)
+            mysql_stmt_close(stmt);
+        return NULL;
+    }
+    set_add(db->stmts, sql, stmt);
+    return stmt;
 }
 
+/* run stmt with names as its parameters and copy out every row. The
+ * rows are expanded only once we're done with the statement: the
+ * expansion may well come back here */
+static int run(range_request* rr, MYSQL_STMT* stmt, const char** names,
+               int nnames, int ncols, apr_array_header_t* rows)
+{
+    apr_pool_t* pool = range_request_pool(rr);
+    MYSQL_BIND* params = NULL;
+    MYSQL_BIND cols[2];
+    unsigned long len[2];
+    char buf[2][512];
+    int i, c, err;
+
+    if (nnames) {
+        params = apr_pcalloc(pool, nnames * sizeof(MYSQL_BIND));
+        for (i = 0; i < nnames; i++) {
+            params[i].buffer_type = MYSQL_TYPE_STRING;
+            params[i].buffer = (char*)names[i];
+            params[i].buffer_length = strlen(names[i]);
+        }
+    }
+    memset(cols, 0, sizeof cols);
+    for (c = 0; c < ncols; c++) {
+        cols[c].buffer_type = MYSQL_TYPE_STRING;
+        cols[c].buffer = buf[c];
+        cols[c].buffer_length = sizeof buf[c];
+        cols[c].length = &len[c];
+    }
+
+    if ((params && mysql_stmt_bind_param(stmt, params)) ||
+        mysql_stmt_execute(stmt) || mysql_stmt_bind_result(stmt, cols) ||
+        mysql_stmt_store_result(stmt))
+        return 0;
+
+    while ((err = mysql_stmt_fetch(stmt)) == 0 ||
+           err == MYSQL_DATA_TRUNCATED) {
+        const char** row = apr_palloc(pool, ncols * sizeof(char*));
+        for (c = 0; c < ncols; c++) {
+            if (len[c] < sizeof buf[c])
+                row[c] = apr_pstrmemdup(pool, buf[c], len[c]);
+            else {
+                /* too long for buf: fetch the whole column */
+                MYSQL_BIND big = cols[c];
+                char* value = apr_palloc(pool, len[c] + 1);
+                big.buffer = value;
+                big.buffer_length = len[c] + 1;
+                big.length = NULL;
+                mysql_stmt_fetch_column(stmt, &big, c, 0);
+                value[len[c]] = '\0';
+                row[c] = value;
+            }
+        }
+        *(const char***)apr_array_push(rows) = row;
+    }
+    mysql_stmt_free_result(stmt);
+    return err == MYSQL_NO_DATA;
+}
+
+/* 0, or the error that stopped us */
+static unsigned query(range_request* rr, mysql_db* db,
+                      apr_array_header_t* groups, int all,
+                      apr_array_header_t* tags, apr_array_header_t* nodes)
+{
+    apr_pool_t* pool = range_request_pool(rr);
+    MYSQL_STMT* stmt;
+
+    if (groups->nelts) {
+        const char** names;
+        char* sql;
+        int n, i;
+
+        for (n = 1; n < groups->nelts; n <<= 1)
+            ;
+        names = apr_palloc(pool, n * sizeof(char*));
+        sql = apr_palloc(pool, sizeof TAGS_SQL + 2 * n);
+        strcpy(sql, TAGS_SQL);
+        for (i = 0; i < n; i++) {
+            names[i] = ((const char**)groups->elts)
+                [i < groups->nelts ? i : groups->nelts - 1];
+            strcat(sql, i ? ",?" : "?");
+        }
+        strcat(sql, ")");
+        if (!(stmt = db_stmt(rr, db, sql)))
+            return db->err ? db->err : 1;
+        if (!run(rr, stmt, names, n, 2, tags))
+            goto failed;
+    }
+    if (all) {
+        if (!(stmt = db_stmt(rr, db, ALL_SQL)))
+            return db->err ? db->err : 1;
+        if (!run(rr, stmt, NULL, 0, 1, nodes))
+            goto failed;
+    }
+    return 0;
+
+  failed:
+    range_request_warn(rr, "mysql_group: %s", mysql_stmt_error(stmt));
+    return mysql_stmt_errno(stmt) ? mysql_stmt_errno(stmt) : 1;
+}
+
+/* what a group's cache entry holds: the node names for ALL, the tag
+ * ranges for any other group. The ranges are expanded afresh by every
+ * request, since what they refer to may have changed */
+static void add_values(range* r, set* ranges, const char* group,
+                       const char** values)
+{
+    int all = strcmp(group, "ALL") == 0;
+
+    for (; *values; values++) {
+        if (all)
+            range_add(r, *values);
+        else
+            set_add(ranges, *values, NULL);
+    }
+}
+
+/* groups are kept in the "mysql" result cache: mysql_cache_ttl and
+ * friends in range.conf */
 range* rangefunc_group(range_request* rr, range** r)
 {
     range *ret;
     const char **members;
-    int i;
-    MYSQL *conn;
-    MYSQL_ROW row;
-    MYSQL_RES *res;
+    const char** values;
+    int i, all = 0;
+    unsigned err;
+    mysql_db* db;
+    range_cache* cache;
+    set* stale;
+    set* ranges;
+    set* fetched;
+    set_iter it;
+    set_element* e;
+    apr_array_header_t* wanted;
+    apr_array_header_t* tags;
+    apr_array_header_t* nodes;
     apr_pool_t* pool = range_request_pool(rr);
     libcrange* lr = range_request_lr(rr);
-    
+
     ret = range_new(rr);
     members = range_get_hostnames(pool, r[0]);
 
-    if(!(conn = (MYSQL *)libcrange_get_cache(lr, "mysql:nodes"))) {
-	const char* mysql_user = libcrange_getcfg(lr, "mysqluser");
-	const char* mysql_db = libcrange_getcfg(lr, "mysqldb");
-	const char* mysql_passwd = libcrange_getcfg(lr, "mysqlpasswd");
+    /* what we still have, and what we need to ask for */
+    cache = libcrange_result_cache(lr, "mysql");
+    stale = set_new(pool, 0);
+    ranges = set_new(pool, 0);
+    wanted = apr_array_make(pool, 8, sizeof(char*));
+    for (i = 0; members[i]; i++) { /* for each gemgroup */
+        switch (range_cache_get(cache, members[i], pool, &values)) {
+        case RANGE_CACHE_HIT:
+            add_values(ret, ranges, members[i], values);
+            continue;
+        case RANGE_CACHE_STALE:
+            /* in case the database doesn't answer */
+            set_add(stale, members[i], values);
+            break;
+        }
+        if (strcmp(members[i], "ALL") == 0)
+            all = 1;
+        else
+            *(const char**)apr_array_push(wanted) = members[i];
+    }
+    if (!all && !wanted->nelts)
+        goto expand;
 
-	conn = mysql_init(NULL);
-	mysql_real_connect(conn, "docking", mysql_user, mysql_passwd,
-			   mysql_db, 0, NULL, 0);
-	libcrange_set_cache(lr, "mysql:nodes", conn);
+    tags = apr_array_make(pool, 16, sizeof(char**));
+    nodes = apr_array_make(pool, 16, sizeof(char**));
+    if (!(db = get_db(rr)))
+        goto failed;
+    if ((err = query(rr, db, wanted, all, tags, nodes))) {
+        /* once more, in case the server had closed the connection */
+        if (err != CR_SERVER_GONE_ERROR && err != CR_SERVER_LOST)
+            goto failed;
+        close_db(db);
+        apr_array_clear(tags);
+        apr_array_clear(nodes);
+        if (!(db = get_db(rr)) || query(rr, db, wanted, all, tags, nodes))
+            goto failed;
     }
-    for(i = 0; members[i]; i++) { /* for each gemgroup */
-        int all = strcmp(members[i], "ALL") == 0;
-
-	if (all) {
-	    const char* query = "select name from nodes";
-	    if (mysql_query(conn, query)) {
-		fprintf(stderr, "query: %s failed: %s\n",
-                        query, mysql_error(conn));
-                return range_new(rr);
-	    }
-	} else {
-	    const char* query = apr_psprintf(pool,
-                                             "select range from tags where name='%s'",
-                                             members[i]);
-	    if (mysql_query(conn, query)) {
-		fprintf(stderr, "query: %s failed: %s\n",
-                        query, mysql_error(conn));
-                return range_new(rr);
-	    }
-	}
-	res = mysql_store_result(conn);
-	assert(res);
-	while ((row = mysql_fetch_row(res)) != NULL) {
-            range* this_group;
-	    const char* result = row[0];
-            if (all) {
-                range_add(ret, result);
-            } else {
-                this_group = do_range_expand(rr, result);
-                set_union_inplace(ret->nodes, this_group->nodes);
-            }
-	}
-        mysql_free_result(res);
+
+    /* each group's ranges, or for ALL its nodes, NULL terminated */
+    fetched = set_new(pool, 0);
+    for (i = 0; i < wanted->nelts; i++)
+        set_add(fetched, ((const char**)wanted->elts)[i],
+                apr_array_make(pool, 2, sizeof(char*)));
+    for (i = 0; i < tags->nelts; i++) {
+        const char** row = ((const char***)tags->elts)[i];
+        apr_array_header_t* group = set_get_data(fetched, row[0]);
+        if (group)
+            *(const char**)apr_array_push(group) = row[1];
     }
+    if (all) {
+        apr_array_header_t* all_nodes = apr_array_make(pool, nodes->nelts + 1,
+                                                       sizeof(char*));
+        for (i = 0; i < nodes->nelts; i++)
+            *(const char**)apr_array_push(all_nodes) =
+                ((const char***)nodes->elts)[i][0];
+        set_add(fetched, "ALL", all_nodes);
+    }
+
+    for (set_iter_init(&it, fetched); (e = set_iter_next(&it)); ) {
+        apr_array_header_t* group = e->data;
+        *(const char**)apr_array_push(group) = NULL;
+        values = (const char**)group->elts;
+        range_cache_put(cache, e->name, values);
+        add_values(ret, ranges, e->name, values);
+    }
+    goto expand;
+
+  failed:
+    for (set_iter_init(&it, stale); (e = set_iter_next(&it)); )
+        add_values(ret, ranges, e->name, e->data);
 
+  expand:
+    /* groups tagged with the same range share its expansion */
+    for (set_iter_init(&it, ranges); (e = set_iter_next(&it)); ) {
+        range* this_group = do_range_expand(rr, e->name);
+        set_union_inplace(ret->nodes, this_group->nodes);
+    }
     return ret;
 }
+
+/* the database changes under us, with no generation to check: past the
+ * request, the "mysql" result cache is all the caching there is */
+static const range_function_desc functions[] = {
+    { "group", rangefunc_group, 1, RANGE_FUNC_PURE },
+    { NULL }
+};
+
+const range_module_desc range_module = {
+    LIBCRANGE_MODULE_ABI, "group-mysql", functions
+};
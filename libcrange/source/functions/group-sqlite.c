@@ -2,86 +2,111 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
-#include <sqlite3.h>
+#include <apr_strings.h>
+#include <apr_tables.h>
 
 #include "set.h"
 #include "libcrange.h"
 #include "range.h"
+#include "sqlite_db.h"
 
-const char** functions_provided(libcrange* lr)
+static const char* db_files[3];
+
+static int _init(libcrange* lr)
 {
-    static const char* functions[] = {"group", 0};
-    return functions;
+    sqlite_db_files(lr, db_files);
+    return 0;
+}
+
+static const char** _depends(libcrange* lr)
+{
+    return db_files;
 }
 
 #define ALL_NODES_SQL "select name from nodes"
 #define RANGE_FROM_TAGS "select range from tags where name=?"
 
+/* the tag ranges of each group are kept in the "sqlite_group" result
+ * cache (sqlite_group_cache_ttl in range.conf), under the database
+ * generation so that a change to the data is never served stale */
 range* rangefunc_group(range_request* rr, range** r)
 {
     range* ret;
     const char** members;
-    int i, err;
-    sqlite3* db;
+    const char** values;
+    int i;
+    long gen;
+    range_cache* cache;
     sqlite3_stmt* tag_stmt;
     sqlite3_stmt* all_nodes_stmt;
+    apr_array_header_t* ranges;
     apr_pool_t* pool = range_request_pool(rr);
-    libcrange* lr = range_request_lr(rr);
     
     ret = range_new(rr);
     members = range_get_hostnames(pool, r[0]);
 
-    if (!(db = libcrange_get_cache(lr, "sqlite:nodes"))) {
-	const char* sqlite_db_path = libcrange_getcfg(lr, "sqlitedb");
-	if (!sqlite_db_path) sqlite_db_path = DEFAULT_SQLITE_DB;
-
-	err = sqlite3_open(sqlite_db_path, &db);
-	if (err != SQLITE_OK) {
-	    fprintf(stderr, "%s: %s\n", sqlite_db_path, sqlite3_errmsg(db));
-	    return ret;
-	}
-
-	libcrange_set_cache(lr, "sqlite:nodes", db);
-    }
-
-
-    /* prepare our selects */
-    err = sqlite3_prepare(db, ALL_NODES_SQL, strlen(ALL_NODES_SQL),
-                          &all_nodes_stmt, NULL);
-    if (err != SQLITE_OK) {
-        fprintf(stderr, "%s: %s\n", ALL_NODES_SQL, sqlite3_errmsg(db));
-        abort();
-    }
-
-    err = sqlite3_prepare(db, RANGE_FROM_TAGS, strlen(RANGE_FROM_TAGS),
-                          &tag_stmt, NULL);
-    assert(err == SQLITE_OK);
+    /* first: a new database file closes the connection, and with it
+     * any statements we'd have got already */
+    gen = sqlite_db_generation(rr);
+    /* the statements are kept across calls */
+    if (!(all_nodes_stmt = sqlite_db_stmt(rr, ALL_NODES_SQL)) ||
+        !(tag_stmt = sqlite_db_stmt(rr, RANGE_FROM_TAGS)))
+        return ret;
+    cache = libcrange_result_cache(range_request_lr(rr), "sqlite_group");
 
-    /* for each group */
+    /* for each group. The tag ranges are expanded once we're done with
+     * the statement: they may call group() again */
+    ranges = apr_array_make(pool, 4, sizeof(char*));
     for (i = 0; members[i]; ++i) {
         sqlite3_stmt* stmt;
-        if (strcmp(members[i], "ALL") == 0) {
-            stmt = all_nodes_stmt;
-        } else {
-            stmt = tag_stmt;
-            /* bind the current group name */
-            sqlite3_bind_text(tag_stmt, 1, members[i], strlen(members[i]), SQLITE_STATIC);
-        }
+        const char* key = apr_psprintf(pool, "%ld:%s", gen, members[i]);
+        int all = strcmp(members[i], "ALL") == 0;
+        apr_array_header_t* rows;
 
-        while (sqlite3_step(stmt) == SQLITE_ROW) {
-            range* this_group;
-            const char* result = (const char*)sqlite3_column_text(stmt, 0);
-            if (stmt == all_nodes_stmt) {
-                range_add(ret, result);
+        /* stale entries are no use: a new generation has a new key */
+        if (range_cache_get(cache, key, pool, &values) != RANGE_CACHE_HIT) {
+            if (all) {
+                stmt = all_nodes_stmt;
             } else {
-                this_group = do_range_expand(rr, result);
-                set_union_inplace(ret->nodes, this_group->nodes);
+                stmt = tag_stmt;
+                /* bind the current group name */
+                sqlite3_bind_text(tag_stmt, 1, members[i], strlen(members[i]), SQLITE_STATIC);
             }
+
+            rows = apr_array_make(pool, 16, sizeof(char*));
+            while (sqlite3_step(stmt) == SQLITE_ROW) {
+                const char* result = (const char*)sqlite3_column_text(stmt, 0);
+                *(char**)apr_array_push(rows) = apr_pstrdup(pool, result);
+            }
+            sqlite3_reset(stmt);
+            *(char**)apr_array_push(rows) = NULL;
+            values = (const char**)rows->elts;
+            range_cache_put(cache, key, values);
+        }
+
+        /* node names for ALL, tag ranges for the rest */
+        for (; *values; values++) {
+            if (all)
+                range_add(ret, *values);
+            else
+                *(const char**)apr_array_push(ranges) = *values;
         }
-        sqlite3_reset(stmt);
     }
-    sqlite3_finalize(all_nodes_stmt);
-    sqlite3_finalize(tag_stmt);
+
+    for (i = 0; i < ranges->nelts; ++i) {
+        range* this_group = do_range_expand(rr, ((char**)ranges->elts)[i]);
+        set_union_inplace(ret->nodes, this_group->nodes);
+    }
 
     return ret;
 }
+
+static const range_function_desc functions[] = {
+    { "group", rangefunc_group, 1, RANGE_FUNC_PURE | RANGE_FUNC_CACHEABLE | RANGE_FUNC_READS_FILES },
+    { NULL }
+};
+
+const range_module_desc range_module = {
+    LIBCRANGE_MODULE_ABI, "group-sqlite", functions,
+    _init, NULL, _depends
+};
@@ -9,15 +9,18 @@
 #define HOSTS_DC_CACHE "yst-ip-list:hosts_dc"
 #define DC_HOSTS_CACHE "yst-ip-list:dc_hosts"
 #define NETBLOCK_HOSTS_CACHE "yst-ip-list:netblocks_hosts"
+#define IP_DATA_POOL_CACHE "yst-ip-list:pool"
 
-static void init_caches(libcrange* lr)
+/* build the host -> netblock, netblock -> hosts, dc -> hosts and
+ * host -> dc sets into pool */
+static void build_caches(libcrange* lr, apr_pool_t* pool,
+                         ip_host** all_hosts, const set* netblocks,
+                         set** caches)
 {
     const char* default_domain;
-    apr_pool_t* pool = libcrange_get_pool(lr);
     range_request* rr;
     
     /* Create a netblock -> hosts mapping */
-    ip_host** all_hosts = tinydns_all_ip_hosts(lr, pool);
     set* hn = set_new(pool, 100000); /* hosts networks */
     set* hd = set_new(pool, 100000); /* hosts datacenter */
     set* nh = set_new(pool, 1500) ;  /* network hosts */
@@ -35,7 +38,7 @@ static void init_caches(libcrange* lr)
         ip_host* iph = *all_hosts++;
 
         const netblock* block;
-        const net_colo* nc = netcolo_for_ip(lr, iph->ip);
+        const net_colo* nc = netcolo_lookup(netblocks, iph->ip);
         if (!nc) continue;
 
         strncpy(short_hostname, iph->hostname, sizeof short_hostname);
@@ -79,10 +82,67 @@ static void init_caches(libcrange* lr)
             r = elt->data;
         range_add(r, short_hostname);
     }
-    libcrange_set_cache(lr, HOSTS_NETBLOCK_CACHE, hn);
-    libcrange_set_cache(lr, NETBLOCK_HOSTS_CACHE, nh);
-    libcrange_set_cache(lr, DC_HOSTS_CACHE, dh);
-    libcrange_set_cache(lr, HOSTS_DC_CACHE, hd);
+    caches[0] = hn;
+    caches[1] = nh;
+    caches[2] = dh;
+    caches[3] = hd;
+}
+
+static void set_caches(libcrange* lr, set** caches)
+{
+    libcrange_set_cache(lr, HOSTS_NETBLOCK_CACHE, caches[0]);
+    libcrange_set_cache(lr, NETBLOCK_HOSTS_CACHE, caches[1]);
+    libcrange_set_cache(lr, DC_HOSTS_CACHE, caches[2]);
+    libcrange_set_cache(lr, HOSTS_DC_CACHE, caches[3]);
+}
+
+static void init_caches(libcrange* lr)
+{
+    apr_pool_t* pool = libcrange_get_pool(lr);
+    ip_host** all_hosts = tinydns_all_ip_hosts(lr, pool);
+    set* caches[4];
+
+    build_caches(lr, pool, all_hosts, read_netblocks(lr), caches);
+    set_caches(lr, caches);
+}
+
+void hosts_netblocks_reload(libcrange* lr)
+{
+    apr_pool_t* pool;
+    apr_pool_t* old_pool;
+    ip_host** all_hosts;
+    set* netblocks;
+    set* colo_nets;
+    set* caches[4];
+    int loaded;
+
+    libcrange_lock(lr);
+    loaded = libcrange_get_cache(lr, HOSTS_NETBLOCK_CACHE) != NULL;
+    libcrange_unlock(lr);
+    if (!loaded)
+        return; /* not used yet: it'll be read on first use */
+
+    /* parse everything into a new pool without holding the lock... */
+    pool = libcrange_pool_new(lr);
+    netblocks = netblocks_read(lr, pool, &colo_nets);
+    if (!netblocks) {
+        /* keep serving what we have */
+        libcrange_pool_destroy(lr, pool);
+        return;
+    }
+    all_hosts = tinydns_read_ip_hosts(lr, pool);
+    build_caches(lr, pool, all_hosts, netblocks, caches);
+
+    /* ...and only lock to swap it in */
+    libcrange_lock(lr);
+    old_pool = libcrange_get_cache(lr, IP_DATA_POOL_CACHE);
+    netblocks_set_caches(lr, netblocks, colo_nets);
+    set_caches(lr, caches);
+    libcrange_set_cache(lr, IP_DATA_POOL_CACHE, pool);
+    libcrange_unlock(lr);
+
+    if (old_pool)
+        libcrange_pool_destroy(lr, old_pool);
 }
 
 static set* hosts_netblocks(libcrange* lr)
@@ -9,5 +9,8 @@ range* hosts_in_netblock(range_request* rr, const char* netblock_key);
 const netblock* netblock_for_host(range_request* rr, const char* host);
 range* hosts_in_dc(range_request* rr, const char* dc);
 const char* dc_for_host(range_request* rr, const char* host);
+/* rebuild the netblock and host caches from the current data files
+ * and swap them in. Safe to call without the lock */
+void hosts_netblocks_reload(libcrange* lr);
 
 #endif
@@ -2,12 +2,6 @@
 #include "range.h"
 #include "tinydns_ip.h"
 
-const char** functions_provided(libcrange* lr)
-{
-    static const char* functions[] = {"ip", 0};
-    return functions;
-}
-
 range* rangefunc_ip(range_request* rr, range** r)
 {
     range* ret;
@@ -27,3 +21,14 @@ range* rangefunc_ip(range_request* rr, range** r)
     }
     return ret;
 }
+
+/* resolved through DNS: the same within a request, but nothing to
+ * promise beyond that */
+static const range_function_desc functions[] = {
+    { "ip", rangefunc_ip, 1, RANGE_FUNC_PURE },
+    { NULL }
+};
+
+const range_module_desc range_module = {
+    LIBCRANGE_MODULE_ABI, "ip", functions
+};
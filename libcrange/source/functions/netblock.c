@@ -20,7 +20,7 @@ static pcre* netmask_re = 0;
 static pcre* ip_re = 0;
 static pcre* two_fields_re = 0;
 
-static void compile_regexes()
+void netblock_init(void)
 {
     if (!netmask_re) {
         int err_offset;
@@ -36,7 +36,7 @@ static void compile_regexes()
     }
 }
 
-static set* read_netblocks(libcrange* lr)
+set* netblocks_read(libcrange* lr, apr_pool_t* pool, set** colo_nets_out)
 {
     set* result;
     set* colo_nets;
@@ -44,24 +44,19 @@ static set* read_netblocks(libcrange* lr)
     FILE* fp;
     char line[4096];
     int line_no;
-    apr_pool_t* pool;
     range_request* rr;
     const char* yst_ip_list = libcrange_getcfg(lr, "yst_ip_list");
     if (!yst_ip_list) yst_ip_list = YST_IP_LIST;
-    
-    if ((result = libcrange_get_cache(lr, NET_COLO_CACHE)) != 0)
-        return result;
 
-    pool = libcrange_get_pool(lr);
-    compile_regexes();
+    netblock_init();
     result = set_new(pool, 0);
-    colo_nets = set_new(pool, 0);
+    colo_nets = *colo_nets_out = set_new(pool, 0);
 
     fp = fopen(yst_ip_list, "r");
     if (!fp) {
         fprintf(stderr, "%s: %s", yst_ip_list,
                 strerror(errno));
-        return set_new(pool, 0);
+        return NULL;
     }
 
     line_no = 0;
@@ -88,7 +83,7 @@ static set* read_netblocks(libcrange* lr)
             fprintf(stderr, "%s: line %d is too long.\n",
                     yst_ip_list, line_no);
             fclose(fp);
-            return set_new(pool, 0);
+            return NULL;
         }
         count = pcre_exec(two_fields_re, NULL, p, n,
                           0, 0, ovector, 30);
@@ -117,21 +112,44 @@ static set* read_netblocks(libcrange* lr)
         range_add(r, net->str);
     }
     fclose(fp);
+    return result;
+}
 
+void netblocks_set_caches(libcrange* lr, set* netblocks, set* colo_nets)
+{
     libcrange_set_cache(lr, COLO_NET_CACHE, colo_nets);
-    libcrange_set_cache(lr, NET_COLO_CACHE, result);
+    libcrange_set_cache(lr, NET_COLO_CACHE, netblocks);
+}
+
+set* read_netblocks(libcrange* lr)
+{
+    set* result;
+    set* colo_nets;
+    apr_pool_t* pool;
+
+    if ((result = libcrange_get_cache(lr, NET_COLO_CACHE)) != 0)
+        return result;
+
+    pool = libcrange_get_pool(lr);
+    result = netblocks_read(lr, pool, &colo_nets);
+    if (!result)
+        return set_new(pool, 0);
+    netblocks_set_caches(lr, result, colo_nets);
     return result;
 }
 
 net_colo* netcolo_for_ip(libcrange* lr, const ip* node_ip)
+{
+    assert(lr);
+    return netcolo_lookup(read_netblocks(lr), node_ip);
+}
+
+net_colo* netcolo_lookup(const set* netblocks, const ip* node_ip)
 {
     int bits;
-    set* netblocks;
     unsigned bin_ip;
 
-    assert(lr);
     assert(node_ip);
-    netblocks = read_netblocks(lr);
     bin_ip = node_ip->binary;
     for (bits=32; bits > 0; --bits) {
         char netmask[32];
@@ -167,7 +185,7 @@ netblock* netblock_from_string(apr_pool_t* pool, const char* netmask)
     int len = strlen(netmask);
     netblock* result = apr_palloc(pool, sizeof(netblock));
 
-    compile_regexes();
+    netblock_init();
     count = pcre_exec(netmask_re, NULL, netmask, len,
                       0, 0, ovector, 30);
     if (count > 0) {
@@ -211,7 +229,7 @@ range* netblocks_for_dc(range_request* rr, const char* dc)
     read_netblocks(lr); /* make sure the caches are up-to-date */
 
     colo_nets = libcrange_get_cache(lr, COLO_NET_CACHE);
-    elt = set_get(colo_nets, dc);
+    elt = colo_nets ? set_get(colo_nets, dc) : NULL;
     if (elt)
         return elt->data;
     else {
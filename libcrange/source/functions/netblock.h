@@ -4,6 +4,7 @@
 #include "libcrange.h"
 #include "range.h"
 #include "tinydns_ip.h"
+#include "set.h"
 
 #define YST_IP_LIST "/etc/yst-ip-list"
 
@@ -21,6 +22,17 @@ typedef struct net_colo
 } net_colo;
 
 net_colo* netcolo_for_ip(libcrange* lr, const ip* node_ip);
+net_colo* netcolo_lookup(const set* netblocks, const ip* node_ip);
+/* parse the yst_ip_list file into pool: returns the netkey -> net_colo
+ * set, or NULL if the file can't be read, and stores the colo ->
+ * netblocks set in *colo_nets. The caches are left alone so this can
+ * run without the lock */
+set* netblocks_read(libcrange* lr, apr_pool_t* pool, set** colo_nets);
+/* the cached netkey -> net_colo set, loading it on first use */
+set* read_netblocks(libcrange* lr);
+void netblocks_set_caches(libcrange* lr, set* netblocks, set* colo_nets);
+/* compile the regexes up front, before any threads use them */
+void netblock_init(void);
 const char* netblock_to_str(const netblock* block);
 netblock* netblock_from_string(apr_pool_t* pool, const char* netmask);
 char* netblock_key(const netblock* block, char* buf, size_t n);
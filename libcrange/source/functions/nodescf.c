@@ -9,15 +9,24 @@
 #include <apr_tables.h>
 #include "libcrange.h"
 #include "range.h"
+#include "range_request.h"
+#include "cluster_index.h"
 
 static const char* nodescf_path = "/etc/range";
 
-const char** functions_provided(libcrange* lr)
-{
-    static const char* functions[] = {"mem", "cluster", "clusters",
-                                      "group", "get_admin", "get_cluster",
-                                      "get_groups", "has", "allclusters", 0 };
+#define INCLUDE_RE "^\\s+INCLUDE\\s+(.+)"
+#define EXCLUDE_RE "^\\s+EXCLUDE\\s+(.+)"
+#define VIPS_RE "^(\\S+)\\s+(\\S+)\\s+(\\S+)\\s*$"
+
+static pcre* include_re = NULL;
+static pcre* exclude_re = NULL;
+static pcre* vips_re = NULL;
+
+static void _reload_nodescf(libcrange* lr, const char* path, void* data);
+static const char** _all_clusters(range_request* rr);
 
+static int _init(libcrange* lr)
+{
     /* initialize our path to the nodes database */
 
     /* First try env variable */
@@ -31,17 +40,90 @@ const char** functions_provided(libcrange* lr)
     if (altpath)
         nodescf_path = altpath;
 
-    return functions;
+    /* compiled here rather than on first use: the watcher thread parses
+     * files without holding the lock */
+    if (!include_re) {
+        const char* error;
+        int erroffset;
+        include_re = pcre_compile(INCLUDE_RE, 0, &error, &erroffset, NULL);
+        assert(include_re);
+        exclude_re = pcre_compile(EXCLUDE_RE, 0, &error, &erroffset, NULL);
+        assert(exclude_re);
+        vips_re = pcre_compile(VIPS_RE, 0, &error, &erroffset, NULL);
+        assert(vips_re);
+    }
+
+    libcrange_watch(lr, nodescf_path, _reload_nodescf, NULL);
+
+    return 0;
 }
 
+static const char** _depends(libcrange* lr)
+{
+    static const char* files[2];
+    files[0] = nodescf_path;
+    return files;
+}
+
+
+/* the parsed nodes.cf and vips.cf files, by path. Each set and its
+ * entries live in the cache's pool, each entry's data in a pool of its
+ * own, which the cache's pool destroys when it goes */
+#define KEYS_CACHE "nodescf:cluster_keys"
+#define VIPS_CACHE "nodescf:cluster_vips"
 
 typedef struct cache_entry
 {
-    time_t mtime;
+    long gen;
     apr_pool_t* pool;
     set* sections;
+    size_t bytes;  /* charged to the cache */
 } cache_entry;
 
+static apr_status_t _destroy_entries(void* data)
+{
+    set_iter it;
+    set_element* file;
+
+    for (set_iter_init(&it, data); (file = set_iter_next(&it)); )
+        apr_pool_destroy(((cache_entry*)file->data)->pool);
+    return APR_SUCCESS;
+}
+
+/* the cache name, whose entries destroy cleans up after. With caching
+ * off it's an empty one in pool, the request's, and the entries put in
+ * it go when the request does */
+static set* _get_cache(libcrange* lr, const char* name,
+                       apr_status_t (*destroy)(void*), apr_pool_t* pool)
+{
+    set* cache = libcrange_get_cache(lr, name);
+    apr_pool_t* cache_pool;
+
+    if (!cache) {
+        if (!(cache_pool = libcrange_cache_pool(lr, name)))
+            cache_pool = pool;
+        cache = set_new(cache_pool, 0);
+        apr_pool_cleanup_register(cache_pool, cache, destroy,
+                                  apr_pool_cleanup_null);
+        libcrange_set_cache(lr, name, cache);
+    }
+    return cache;
+}
+
+/* charge the cache for e as it is now */
+static void _account(libcrange* lr, cache_entry* e)
+{
+    size_t bytes = sizeof(*e) + set_bytes(e->sections);
+    set_iter it;
+    set_element* section;
+
+    for (set_iter_init(&it, e->sections); (section = set_iter_next(&it)); )
+        if (section->data) /* KEYS with no keys, UP with no CLUSTER */
+            bytes += strlen(section->data) + 1;
+    libcrange_cache_charge(lr, KEYS_CACHE, (long)bytes - (long)e->bytes);
+    e->bytes = bytes;
+}
+
 static set* _get_ignore_set(range_request* rr)
 {
     char line[32768];
@@ -83,23 +165,25 @@ static set* _get_ignore_set(range_request* rr)
     return ret;
 }
 
-#define INCLUDE_RE "^\\s+INCLUDE\\s+(.+)"
-#define EXCLUDE_RE "^\\s+EXCLUDE\\s+(.+)"
-
-static pcre* include_re = NULL;
-static pcre* exclude_re = NULL;
-
 static char* _substitute_dollars(apr_pool_t* pool,
                                  const char* cluster, const char* line)
 {
-    static char buf[262144];
-    char* dst = buf;
+    char* buf;
+    char* dst;
     int len = strlen(cluster);
     int in_regex = 0;
+    int ndollars = 0;
+    const char* p;
     char c;
     assert(line);
     assert(cluster);
 
+    for (p = line; *p; p++)
+        if (*p == '$') ndollars++;
+    /* each $ becomes cluster(<cluster>:...) */
+    dst = buf = apr_palloc(pool, strlen(line) +
+                           ndollars * (len + sizeof("cluster(:)")) + 1);
+
     while ((c = *line) != '\0') {
         if (!in_regex && c == '$') {
             strcpy(dst, "cluster(");
@@ -155,16 +239,33 @@ char* _join_elements(apr_pool_t* pool, char sep, set* the_set)
     return result;
 }
 
-static pcre* vips_re = NULL;
-
 typedef struct vips 
 {
-    time_t mtime;
+    long gen;
     apr_pool_t* pool;
     set* vips;
     set* viphosts;
+    size_t bytes;  /* charged to the cache */
 } vips;
 
+static apr_status_t _destroy_vips(void* data)
+{
+    set_iter it;
+    set_element* file;
+
+    for (set_iter_init(&it, data); (file = set_iter_next(&it)); )
+        apr_pool_destroy(((vips*)file->data)->pool);
+    return APR_SUCCESS;
+}
+
+static void _account_vips(libcrange* lr, vips* v)
+{
+    size_t bytes = sizeof(*v) + set_bytes(v->vips) + set_bytes(v->viphosts);
+
+    libcrange_cache_charge(lr, VIPS_CACHE, (long)bytes - (long)v->bytes);
+    v->bytes = bytes;
+}
+
 static vips* _empty_vips(range_request* rr)
 {
     apr_pool_t* pool = range_request_pool(rr);
@@ -173,65 +274,17 @@ static vips* _empty_vips(range_request* rr)
     return v;
 }
 
-static vips* _parse_cluster_vips(range_request* rr, const char* cluster)
+/* read vips_path into v->vips and v->viphosts. Returns 0 if the file
+ * can't be opened */
+static int _read_vips(vips* v, const char* vips_path)
 {
-    struct stat st;
     int ovector[30];
     char line[32768];
     int line_no;
-    FILE* fp;
-    apr_pool_t* req_pool = range_request_pool(rr);
-    apr_pool_t* lr_pool = range_request_lr_pool(rr);
-    libcrange* lr = range_request_lr(rr);
-    set* cache = libcrange_get_cache(lr, "nodescf:cluster_vips");
-    const char* vips_path = apr_psprintf(req_pool, "%s/%s/vips.cf",
-                                         nodescf_path, cluster);
-    vips* v;
-    
-    if (!cache) {
-        cache = set_new(lr_pool, 0);
-        libcrange_set_cache(lr, "nodescf:cluster_vips", cache);
-    }
-
-    if (stat(vips_path, &st) == -1) {
-        range_request_warn_type(rr, "NOVIPS", cluster);
-        return _empty_vips(rr);
-    }
+    FILE* fp = fopen(vips_path, "r");
 
-    v = set_get_data(cache, vips_path);
-    if (!v) {
-        v = apr_palloc(lr_pool, sizeof(struct vips));
-        apr_pool_create(&v->pool, lr_pool);
-        v->vips = set_new(v->pool, 0);
-        v->viphosts = set_new(v->pool, 0);
-        v->mtime = st.st_mtime;
-        set_add(cache, vips_path, v);
-    }
-    else {
-        time_t cached_mtime = v->mtime;
-        if (cached_mtime != st.st_mtime) {
-            apr_pool_clear(v->pool);
-            v->vips = set_new(v->pool, 0);
-            v->viphosts = set_new(v->pool, 0);
-            v->mtime = st.st_mtime;
-        }
-        else /* current cached copy is good */
-            return v;
-    }
-
-    /* create / update the current cached copy */
-    fp = fopen(vips_path, "r");
-    if (!fp) {
-        range_request_warn_type(rr, "NOVIPS", cluster);
-        return _empty_vips(rr);
-    }
-
-    if (!vips_re) {
-        const char* error;
-        vips_re = pcre_compile("^(\\S+)\\s+(\\S+)\\s+(\\S+)\\s*$", 0, &error,
-                               ovector, NULL);
-        assert(vips_re);
-    }
+    if (!fp)
+        return 0;
 
     line_no = 0;
     while (fgets(line, sizeof line, fp)) {
@@ -278,19 +331,70 @@ static vips* _parse_cluster_vips(range_request* rr, const char* cluster)
     }
 
     fclose(fp);
+    return 1;
+}
+
+static vips* _parse_cluster_vips(range_request* rr, const char* cluster)
+{
+    long gen;
+    apr_pool_t* req_pool = range_request_pool(rr);
+    libcrange* lr = range_request_lr(rr);
+    set* cache = _get_cache(lr, VIPS_CACHE, _destroy_vips, req_pool);
+    const char* vips_path = apr_psprintf(req_pool, "%s/%s/vips.cf",
+                                         nodescf_path, cluster);
+    vips* v;
+    
+
+    gen = libcrange_file_generation(lr, vips_path);
+    if (gen < 0) {
+        range_request_warn_type(rr, "NOVIPS", cluster);
+        return _empty_vips(rr);
+    }
+
+    v = set_get_data(cache, vips_path);
+    if (!v) {
+        v = apr_pcalloc(cache->pool, sizeof(struct vips));
+        v->pool = libcrange_pool_new(lr);
+        v->vips = set_new(v->pool, 0);
+        v->viphosts = set_new(v->pool, 0);
+        v->gen = gen;
+        set_add(cache, vips_path, v);
+    }
+    else {
+        if (v->gen != gen) {
+            apr_pool_clear(v->pool);
+            v->vips = set_new(v->pool, 0);
+            v->viphosts = set_new(v->pool, 0);
+            v->gen = gen;
+        }
+        else /* current cached copy is good */
+            return v;
+    }
+
+    /* create / update the current cached copy */
+    if (!_read_vips(v, vips_path)) {
+        range_request_warn_type(rr, "NOVIPS", cluster);
+        return _empty_vips(rr);
+    }
+    _account_vips(lr, v);
     return v;
 }
 
 static range* _cluster_vips(range_request* rr, const char* cluster)
 {
     vips* v = _parse_cluster_vips(rr, cluster);
-    return range_from_set(rr, v->vips);
+    /* copy: the cached set is replaced when vips.cf is reloaded */
+    range* r = range_new(rr);
+    set_union_inplace(r->nodes, v->vips);
+    return r;
 }
 
 static range* _cluster_viphosts(range_request* rr, const char* cluster)
 {
     vips* v = _parse_cluster_vips(rr, cluster);
-    return range_from_set(rr, v->viphosts);
+    range* r = range_new(rr);
+    set_union_inplace(r->nodes, v->viphosts);
+    return r;
 }
 
 static set* _cluster_keys(range_request* rr, apr_pool_t* pool,
@@ -312,15 +416,6 @@ static set* _cluster_keys(range_request* rr, apr_pool_t* pool,
         return set_new(pool, 0);
     }
 
-    if (!include_re) {
-        const char* error;
-        include_re = pcre_compile(INCLUDE_RE, 0, &error, ovector, NULL);
-        assert(include_re);
-
-        exclude_re = pcre_compile(EXCLUDE_RE, 0, &error, ovector, NULL);
-        assert(exclude_re);
-    }
-
     sections = set_new(pool, 0);
     section = cur_section = NULL;
 
@@ -404,15 +499,49 @@ static set* _cluster_keys(range_request* rr, apr_pool_t* pool,
     return sections;
 }
 
+/* parse cluster_file with the lock suspended, so requests for other
+ * clusters go on meanwhile, and put it in the cache. An index build
+ * keeps the lock: see cluster_index_busy */
+static cache_entry* _read_entry(range_request* rr, const char* cluster,
+                                const char* cluster_file, long gen)
+{
+    libcrange* lr = range_request_lr(rr);
+    apr_pool_t* pool = libcrange_pool_new(lr);
+    int suspended = !cluster_index_busy() && libcrange_lock_suspend(lr);
+    set* sections = _cluster_keys(rr, pool, cluster, cluster_file);
+    set* cache;
+    cache_entry* e;
+
+    libcrange_lock_resume(lr, suspended);
+    /* cleared, evicted or reloaded while we parsed */
+    cache = _get_cache(lr, KEYS_CACHE, _destroy_entries,
+                       range_request_pool(rr));
+    e = set_get_data(cache, cluster_file);
+    if (e && e->gen >= gen) {
+        libcrange_pool_destroy(lr, pool);
+        return e;
+    }
+    if (!e) {
+        e = apr_pcalloc(cache->pool, sizeof(struct cache_entry));
+        set_add(cache, cluster_file, e);
+    }
+    else
+        libcrange_pool_destroy(lr, e->pool);
+    e->pool = pool;
+    e->sections = sections;
+    e->gen = gen;
+    _account(lr, e);
+    return e;
+}
+
 static range* _expand_cluster(range_request* rr,
                               const char* cluster, const char* section)
 {
-    struct stat st;
+    long gen;
     const char* res;
     libcrange* lr = range_request_lr(rr);
-    set* cache = libcrange_get_cache(lr, "nodescf:cluster_keys");
+    set* cache;
     apr_pool_t* req_pool = range_request_pool(rr);
-    apr_pool_t* lr_pool = range_request_lr_pool(rr);
 
     const char* cluster_file;
     cache_entry* e;
@@ -424,31 +553,27 @@ static range* _expand_cluster(range_request* rr,
         return _cluster_viphosts(rr, cluster);
     
     cluster_file = apr_psprintf(req_pool, "%s/%s/nodes.cf", nodescf_path, cluster);
-    if (!cache) {
-        cache = set_new(lr_pool, 0);
-        libcrange_set_cache(lr, "nodescf:cluster_keys", cache);
-    }
 
-    if (stat(cluster_file, &st) == -1) {
+    gen = libcrange_file_generation(lr, cluster_file);
+    cluster_index_depends(lr, cluster_file, gen);
+    if (gen < 0) {
         range_request_warn_type(rr, "NOCLUSTERDEF", cluster);
         return range_new(rr);
     }
     
-    e = set_get_data(cache, cluster_file);
-    if (!e) {
-        e = apr_palloc(lr_pool, sizeof(struct cache_entry));
-        apr_pool_create(&e->pool, lr_pool);
-        e->sections = _cluster_keys(rr, e->pool, cluster, cluster_file);
-        e->mtime = st.st_mtime;
-        set_add(cache, cluster_file, e);
-    }
-    else {
-        time_t cached_mtime = e->mtime;
-        if (cached_mtime != st.st_mtime) {
-            apr_pool_clear(e->pool);
-            e->sections = _cluster_keys(rr, e->pool, cluster, cluster_file);
-            e->mtime = st.st_mtime;
-        } 
+    for (;;) {
+        libcrange_flight* f;
+
+        cache = libcrange_get_cache(lr, KEYS_CACHE);
+        e = cache ? set_get_data(cache, cluster_file) : NULL;
+        if (e && e->gen == gen)
+            break;
+        /* one request parses it, any others for it wait */
+        if ((f = libcrange_flight_begin(lr, cluster_file))) {
+            e = _read_entry(rr, cluster, cluster_file, gen);
+            libcrange_flight_end(lr, f);
+            break;
+        }
     }
 
     res = set_get_data(e->sections, section);
@@ -463,18 +588,222 @@ static range* _expand_cluster(range_request* rr,
     return do_range_expand(rr, res);
 }
 
+/* called from the watcher thread when something under nodescf_path
+ * changes: parse the new file without the lock, then swap it in */
+static void _reload_nodescf(libcrange* lr, const char* path, void* data)
+{
+    long gen;
+    set* cache;
+    apr_pool_t* pool = NULL;
+    apr_pool_t* old_pool;
+    const char* slash = strrchr(path, '/');
+    const char* name = slash ? slash + 1 : path;
+    const char* cluster;
+    int have_file;
+    int is_vips;
+
+    if (strcmp(name, "nodes.cf") == 0)
+        is_vips = 0;
+    else if (strcmp(name, "vips.cf") == 0)
+        is_vips = 1;
+    else
+        return;
+
+    libcrange_lock(lr);
+    cache = libcrange_get_cache(lr, is_vips ? VIPS_CACHE :
+                                KEYS_CACHE);
+    data = cache ? set_get_data(cache, path) : NULL;
+    libcrange_unlock(lr);
+    if (!data)
+        return; /* not loaded yet: it'll be read on first use */
+
+    have_file = access(path, R_OK) == 0;
+    if (have_file) {
+        const char* start;
+        pool = libcrange_pool_new(lr);
+        /* <nodescf_path>/<cluster>/nodes.cf */
+        for (start = slash; start > path && start[-1] != '/'; start--)
+            ;
+        cluster = apr_pstrndup(pool, start, slash - start);
+
+        if (is_vips) {
+            vips* v = apr_palloc(pool, sizeof(*v));
+            v->pool = pool;
+            v->vips = set_new(pool, 0);
+            v->viphosts = set_new(pool, 0);
+            have_file = _read_vips(v, path);
+            data = v;
+        }
+        else {
+            cache_entry* e = apr_palloc(pool, sizeof(*e));
+            e->pool = pool;
+            e->sections = _cluster_keys(range_request_new(lr, pool), pool,
+                                        cluster, path);
+            data = e;
+        }
+    }
+
+    libcrange_lock(lr);
+    gen = libcrange_file_refresh(lr, path);
+    if (gen < 0)
+        have_file = 0;
+    /* the cache may have been cleared or evicted while we parsed */
+    cache = libcrange_get_cache(lr, is_vips ? VIPS_CACHE : KEYS_CACHE);
+    if (!cache || !set_get(cache, path)) {
+        libcrange_unlock(lr);
+        if (pool)
+            libcrange_pool_destroy(lr, pool);
+        return;
+    }
+    if (is_vips) {
+        vips* old = set_get_data(cache, path);
+        old_pool = old->pool;
+        if (have_file) {
+            vips* v = data;
+            old->pool = v->pool;
+            old->vips = v->vips;
+            old->viphosts = v->viphosts;
+            old->gen = gen;
+            _account_vips(lr, old);
+        }
+        else
+            libcrange_cache_charge(lr, VIPS_CACHE, -(long)old->bytes);
+    }
+    else {
+        cache_entry* old = set_get_data(cache, path);
+        old_pool = old->pool;
+        if (have_file) {
+            old->pool = ((cache_entry*)data)->pool;
+            old->sections = ((cache_entry*)data)->sections;
+            old->gen = gen;
+            _account(lr, old);
+        }
+        else
+            libcrange_cache_charge(lr, KEYS_CACHE, -(long)old->bytes);
+    }
+    if (!have_file)
+        set_remove(cache, path);
+    libcrange_unlock(lr);
+
+    libcrange_pool_destroy(lr, old_pool);
+    if (pool && !have_file)
+        libcrange_pool_destroy(lr, pool);
+}
+
+static const cluster_source source = {
+    "nodescf", "ALL", _all_clusters, _expand_cluster
+};
+
+/* warm start: the parsed nodes.cf and vips.cf files (a vips entry is
+ * told apart by its "vip"/"viphost" pairs) and the host index */
+void snapshot_save(libcrange* lr, range_snapshot* s)
+{
+    set_iter it;
+    set_iter sit;
+    set_element* file;
+    set_element* elt;
+    set* cache = libcrange_get_cache(lr, KEYS_CACHE);
+
+    if (cache)
+        for (set_iter_init(&it, cache); (file = set_iter_next(&it)); ) {
+            cache_entry* e = file->data;
+            range_snapshot_entry(s, file->name);
+            range_snapshot_depends(s, file->name);
+            for (set_iter_init(&sit, e->sections);
+                 (elt = set_iter_next(&sit)); )
+                range_snapshot_put(s, elt->name, elt->data);
+        }
+
+    cache = libcrange_get_cache(lr, VIPS_CACHE);
+    if (cache)
+        for (set_iter_init(&it, cache); (file = set_iter_next(&it)); ) {
+            vips* v = file->data;
+            range_snapshot_entry(s, file->name);
+            range_snapshot_depends(s, file->name);
+            for (set_iter_init(&sit, v->vips); (elt = set_iter_next(&sit)); )
+                range_snapshot_put(s, "vip", elt->name);
+            for (set_iter_init(&sit, v->viphosts);
+                 (elt = set_iter_next(&sit)); )
+                range_snapshot_put(s, "viphost", elt->name);
+        }
+
+    cluster_index_snapshot_save(lr, &source, s);
+}
+
+void snapshot_load(libcrange* lr, range_snapshot* s)
+{
+    const char* path;
+    const char* name;
+    const char* value;
+    set* keys;
+    set* vips_cache;
+
+    if (!lr->want_caching)
+        return;
+    keys = _get_cache(lr, KEYS_CACHE, _destroy_entries, NULL);
+    vips_cache = _get_cache(lr, VIPS_CACHE, _destroy_vips, NULL);
+
+    while (range_snapshot_next_entry(s, &path)) {
+        const char* slash = strrchr(path, '/');
+        long gen;
+
+        if (cluster_index_snapshot_entry(lr, &source, s, path))
+            continue;
+        gen = libcrange_file_generation(lr, path);
+        if (gen < 0 || !slash)
+            continue;
+
+        /* names and values stay in the mapped snapshot */
+        if (strcmp(slash + 1, "vips.cf") == 0) {
+            vips* v;
+            if (set_get_data(vips_cache, path))
+                continue;
+            v = apr_pcalloc(vips_cache->pool, sizeof(struct vips));
+            v->pool = libcrange_pool_new(lr);
+            v->vips = set_new(v->pool, 0);
+            v->viphosts = set_new(v->pool, 0);
+            v->gen = gen;
+            while (range_snapshot_get(s, &name, &value))
+                set_add_nocopy(strcmp(name, "vip") == 0 ?
+                               v->vips : v->viphosts, value, 0);
+            set_add(vips_cache, path, v);
+            _account_vips(lr, v);
+        }
+        else {
+            cache_entry* e;
+            if (set_get_data(keys, path))
+                continue;
+            e = apr_pcalloc(keys->pool, sizeof(struct cache_entry));
+            e->pool = libcrange_pool_new(lr);
+            e->sections = set_new(e->pool, 0);
+            e->gen = gen;
+            while (range_snapshot_get(s, &name, &value))
+                set_add_nocopy(e->sections, name, (void*)value);
+            set_add(keys, path, e);
+            _account(lr, e);
+        }
+    }
+}
+
 static const char** _all_clusters(range_request* rr)
 {
     DIR* dir;
     struct dirent* dir_entry;
+    libcrange* lr = range_request_lr(rr);
     apr_pool_t* pool = range_request_pool(rr);
     set* res = set_new(pool, 0);
     set* ignore = _get_ignore_set(rr);
+    const char* ignore_path = apr_psprintf(pool, "%s/all/IGNORE", nodescf_path);
     char nodes_cf_buf[8192];
     set_element** elts;
     const char** table;
     int i, n;
 
+    cluster_index_depends(lr, nodescf_path,
+                          libcrange_file_generation(lr, nodescf_path));
+    cluster_index_depends(lr, ignore_path,
+                          libcrange_file_generation(lr, ignore_path));
+
     dir = opendir(nodescf_path);
     if (!dir) {
         range_request_warn(rr, "%s: can't opendir", nodescf_path);
@@ -483,12 +812,17 @@ static const char** _all_clusters(range_request* rr)
 
     while ( (dir_entry = readdir(dir)) != NULL) {
         const char* cluster = dir_entry->d_name;
+        long gen;
         if (set_get(ignore, cluster) != NULL) continue;
+        if (!strcmp(cluster, ".") || !strcmp(cluster, "..")) continue;
 
         snprintf(nodes_cf_buf, sizeof nodes_cf_buf, "%s/%s/nodes.cf",
                  nodescf_path, cluster);
         nodes_cf_buf[sizeof nodes_cf_buf - 1] = '\0';
-        if (access(nodes_cf_buf, R_OK) == 0)
+        /* a nodes.cf showing up later doesn't touch nodescf_path */
+        gen = libcrange_file_generation(lr, nodes_cf_buf);
+        cluster_index_depends(lr, nodes_cf_buf, gen);
+        if (gen >= 0 && access(nodes_cf_buf, R_OK) == 0)
             set_add(res, cluster, 0);
     }
 
@@ -512,7 +846,7 @@ range* rangefunc_allclusters(range_request* rr, range** r)
     range* ret = range_new(rr);
 
 
-    const char** all_clusters = _all_clusters(rr);
+    const char** all_clusters = cluster_index_all(rr, &source);
     const char** cluster = all_clusters;
     int warn_enabled = range_request_warn_enabled(rr);
 
@@ -541,21 +875,12 @@ range* rangefunc_has(range_request* rr, range** r)
     const char* tag_name = tag_names[0];
     const char* tag_value = tag_values[0];
 
-    const char** all_clusters = _all_clusters(rr);
-    const char** cluster = all_clusters;
-    int warn_enabled = range_request_warn_enabled(rr);
-
-    if (!cluster) return ret;
+    const apr_array_header_t* clusters =
+        cluster_index_lookup(rr, &source, tag_name, tag_value);
+    int i;
 
-    range_request_disable_warns(rr);
-    while (*cluster) {
-        range* vals = _expand_cluster(rr, *cluster, tag_name);
-        if (set_get(vals->nodes, tag_value) != NULL) {
-            range_add(ret, *cluster);
-        }
-        cluster++;
-    }
-    if (warn_enabled) range_request_enable_warns(rr);
+    for (i = 0; clusters && i < clusters->nelts; ++i)
+        range_add(ret, ((const char**)clusters->elts)[i]);
 
     return ret;
 }
@@ -571,23 +896,14 @@ range* rangefunc_mem(range_request* rr, range** r)
     const char** clusters = range_get_hostnames(pool, r[0]);
     const char* cluster = clusters[0];
     const char** wanted = range_get_hostnames(pool, r[1]);
-    
-    range* keys = _expand_cluster(rr, cluster, "KEYS");
-    const char** all_sections = range_get_hostnames(pool, keys);
-    const char** p_section = all_sections;
-
-  SECTION:
-    while (*p_section) {
-        range* r_s = _expand_cluster(rr, cluster, *p_section);
-        const char** p_wanted = wanted;
-        while (*p_wanted) {
-            if (set_get(r_s->nodes, *p_wanted) != NULL) {
-                range_add(ret, *p_section++);
-                goto SECTION;
-            }
-            ++p_wanted;
-        }
-        ++p_section;
+
+    while (*wanted) {
+        const apr_array_header_t* sections =
+            cluster_index_sections(rr, &source, cluster, *wanted);
+        int i;
+        for (i = 0; sections && i < sections->nelts; ++i)
+            range_add(ret, ((const char**)sections->elts)[i]);
+        ++wanted;
     }
 
     return ret;
@@ -666,30 +982,15 @@ range* rangefunc_get_admin(range_request* rr, range** r)
     apr_pool_t* pool = range_request_pool(rr);
     const char** in_nodes = range_get_hostnames(pool, n);
 
-    set* node_admin = set_new(pool, 40000);
-    range* admins_r = _expand_cluster(rr, "HOSTS", "KEYS");
-    const char** admins = range_get_hostnames(pool, admins_r);
-    const char** p_admin = admins;
-
-    while (*p_admin) {
-        range* nodes_r = _expand_cluster(rr, "HOSTS", *p_admin);
-        const char** nodes = range_get_hostnames(pool, nodes_r);
-        const char** p_nodes = nodes;
-
-        while (*p_nodes) {
-            set_add(node_admin, *p_nodes, (void*)*p_admin);
-            ++p_nodes;
-        }
-        ++p_admin;
-    }
-
     while (*in_nodes) {
-        const char* admin = set_get_data(node_admin, *in_nodes);
-        if (!admin) {
+        const apr_array_header_t* admins =
+            cluster_index_sections(rr, &source, "HOSTS", *in_nodes);
+        if (!admins) {
             range_request_warn_type(rr, "NO_ADMIN", *in_nodes);
         }
         else {
-            range_add(ret, admin);
+            /* just get one */
+            range_add(ret, ((const char**)admins->elts)[0]);
         }
         in_nodes++;
     }
@@ -697,39 +998,6 @@ range* rangefunc_get_admin(range_request* rr, range** r)
     return ret;
 }
 
-static set* _get_clusters(range_request* rr)
-{
-    const char** all_clusters = _all_clusters(rr);
-    const char** p_cl = all_clusters;
-    apr_pool_t* pool = range_request_pool(rr);
-    set* node_cluster = set_new(pool, 40000);
-    
-    if(p_cl == NULL) {
-        return node_cluster;
-    }
-    
-    while (*p_cl) {
-        range* nodes_r = _expand_cluster(rr, *p_cl, "ALL");
-        const char** nodes = range_get_hostnames(pool, nodes_r);
-        const char** p_nodes = nodes;
-
-        while (*p_nodes) {
-            apr_array_header_t* clusters = set_get_data(node_cluster, *p_nodes);
-
-            if (!clusters) {
-                clusters = apr_array_make(pool, 1, sizeof(char*));
-                set_add(node_cluster, *p_nodes, clusters);
-            }
-
-            *(const char**)apr_array_push(clusters) = *p_cl;
-            ++p_nodes;
-        }
-        ++p_cl;
-    }
-
-    return node_cluster;
-}
-
 range* rangefunc_get_cluster(range_request* rr, range** r)
 {
     range* ret = range_new(rr);
@@ -737,13 +1005,13 @@ range* rangefunc_get_cluster(range_request* rr, range** r)
         return ret;
     }
 
-    apr_pool_t* pool = range_request_lr_pool(rr);
+    apr_pool_t* pool = range_request_pool(rr);
     const char** nodes = range_get_hostnames(pool, r[0]);
     const char** p_nodes = nodes;
-    set* node_cluster = _get_clusters(rr);
-    
+
     while (*p_nodes) {
-        apr_array_header_t* clusters = set_get_data(node_cluster, *p_nodes);
+        const apr_array_header_t* clusters =
+            cluster_index_lookup(rr, &source, source.section, *p_nodes);
         if (!clusters)
             range_request_warn_type(rr, "NO_CLUSTER", *p_nodes);
         else {
@@ -767,10 +1035,10 @@ range* rangefunc_clusters(range_request* rr, range** r)
     apr_pool_t* pool = range_request_pool(rr);
     const char** nodes = range_get_hostnames(pool, r[0]);
     const char** p_nodes = nodes;
-    set* node_cluster = _get_clusters(rr);
-    
+
     while (*p_nodes) {
-        apr_array_header_t* clusters = set_get_data(node_cluster, *p_nodes);
+        const apr_array_header_t* clusters =
+            cluster_index_lookup(rr, &source, source.section, *p_nodes);
         if (!clusters)
             range_request_warn_type(rr, "NO_CLUSTER", *p_nodes);
         else {
@@ -797,30 +1065,9 @@ range* rangefunc_get_groups(range_request* rr, range** r)
     apr_pool_t* pool = range_request_pool(rr);
     const char** in_nodes = range_get_hostnames(pool, n);
 
-    set* node_group = set_new(pool, 40000);
-    range* groups_r = _expand_cluster(rr, "GROUPS", "KEYS");
-    const char** groups = range_get_hostnames(pool, groups_r);
-    const char** p_group = groups;
-
-    while (*p_group) {
-        range* nodes_r = _expand_cluster(rr, "GROUPS", *p_group);
-        const char** nodes = range_get_hostnames(pool, nodes_r);
-        const char** p_nodes = nodes;
-
-        while (*p_nodes) {
-            apr_array_header_t* my_groups = set_get_data(node_group, *p_nodes);
-            if (!my_groups) {
-                my_groups = apr_array_make(pool, 4, sizeof(char*));
-                set_add(node_group, *p_nodes, my_groups);
-            }
-            *(const char**)apr_array_push(my_groups) = *p_group;
-            ++p_nodes;
-        }
-        ++p_group;
-    }
-
     while (*in_nodes) {
-        apr_array_header_t* my_groups = set_get_data(node_group, *in_nodes);
+        const apr_array_header_t* my_groups =
+            cluster_index_sections(rr, &source, "GROUPS", *in_nodes);
         if (!my_groups) 
             range_request_warn_type(rr, "NO_GROUPS", *in_nodes);
         else {
@@ -833,3 +1080,24 @@ range* rangefunc_get_groups(range_request* rr, range** r)
 
     return ret;
 }
+
+#define CLUSTER_DATA (RANGE_FUNC_PURE | RANGE_FUNC_CACHEABLE | RANGE_FUNC_READS_FILES)
+
+static const range_function_desc functions[] = {
+    { "mem", rangefunc_mem, 2, CLUSTER_DATA },
+    { "cluster", rangefunc_cluster, 1, CLUSTER_DATA },
+    { "clusters", rangefunc_clusters, 1, CLUSTER_DATA },
+    { "group", rangefunc_group, 1, CLUSTER_DATA },
+    { "get_admin", rangefunc_get_admin, 1, CLUSTER_DATA },
+    { "get_cluster", rangefunc_get_cluster, 1, CLUSTER_DATA },
+    { "get_groups", rangefunc_get_groups, 1, CLUSTER_DATA },
+    { "has", rangefunc_has, 2, CLUSTER_DATA },
+    { "allclusters", rangefunc_allclusters, 0, CLUSTER_DATA },
+    { NULL }
+};
+
+const range_module_desc range_module = {
+    LIBCRANGE_MODULE_ABI, "nodescf", functions,
+    _init, NULL, _depends,
+    NULL, snapshot_save, snapshot_load
+};
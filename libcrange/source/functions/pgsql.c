@@ -4,124 +4,334 @@
 #include <stdlib.h>
 #include <libpq-fe.h>
 #include <apr_strings.h>
+#include <apr_tables.h>
 
 #include "set.h"
 #include "libcrange.h"
 #include "range.h"
 
-const char** functions_provided(libcrange* lr)
+/* prepared once per session: all the groups asked for come back from
+ * one query */
+#define GROUP_STMT "range_group"
+#define GROUP_SQL "select groupname, element from velementgroups " \
+    "where namespace=$1 and groupname = any($2::text[])"
+#define ALL_STMT "range_group_all"
+#define ALL_SQL "select distinct element from velementgroups " \
+    "where namespace=$1"
+
+static int _prepare(range_request* rr, PGconn* conn)
 {
-    static const char* functions[] = {"group", 0};
-    return functions;
+    PGresult* result;
+    int ok;
+
+    result = PQprepare(conn, GROUP_STMT, GROUP_SQL, 2, NULL);
+    ok = PQresultStatus(result) == PGRES_COMMAND_OK;
+    PQclear(result);
+    if (ok) {
+        result = PQprepare(conn, ALL_STMT, ALL_SQL, 1, NULL);
+        ok = PQresultStatus(result) == PGRES_COMMAND_OK;
+        PQclear(result);
+    }
+    if (!ok)
+        range_request_warn(rr, "pgsql_group: %s", PQerrorMessage(conn));
+    return ok;
 }
 
-range* rangefunc_group(range_request* rr, range** r)
+static PGconn* _connect(range_request* rr)
 {
-    range* ret;
-    const char** members;
-    int i;
     PGconn *conn;
     int errors = 0;
-
     apr_pool_t* pool = range_request_pool(rr);
     libcrange* lr = range_request_lr(rr);
+    const char* pgsql_user = libcrange_getcfg(lr, "pgsql_user");
+    const char* pgsql_db = libcrange_getcfg(lr, "pgsql_db");
+    const char* pgsql_passwd = libcrange_getcfg(lr, "pgsql_passwd");
+    const char* pgsql_host = libcrange_getcfg(lr, "pgsql_host");
+    const char* pgsql_port = libcrange_getcfg(lr, "pgsql_port");
+    char* conninfo;
 
-    ret = range_new(rr);
-    members = range_get_hostnames(pool, r[0]);
+    if (!pgsql_user) {
+        range_request_warn(rr, "pgsql no user specified");
+        errors++;
+    }
 
-    const char* default_namespace = libcrange_getcfg(lr, "default_namespace");
-    if (!default_namespace)
-        default_namespace = "yst";
-    
-    if (!(conn = (PGconn *)libcrange_get_cache(lr, "pgsql:conn"))) {
-        const char* pgsql_user = libcrange_getcfg(lr, "pgsql_user");
-        const char* pgsql_db = libcrange_getcfg(lr, "pgsql_db");
-        const char* pgsql_passwd = libcrange_getcfg(lr, "pgsql_passwd");
-        const char* pgsql_host = libcrange_getcfg(lr, "pgsql_host");
-        const char* pgsql_port = libcrange_getcfg(lr, "pgsql_port");
-
-        if (!pgsql_user) {
-            range_request_warn(rr, "pgsql no user specified");
-            errors++;
-        }
+    if (!pgsql_db) {
+        range_request_warn(rr, "pgsql no db specified");
+        errors++;
+    }
 
-        if (!pgsql_db) {
-            range_request_warn(rr, "pgsql no db specified");
-            errors++;
-        }
+    if (!pgsql_passwd) {
+        range_request_warn(rr, "pgsql no passwd specified");
+        errors++;
+    }
 
-        if (!pgsql_passwd) {
-            range_request_warn(rr, "pgsql no passwd specified");
-            errors++;
-        }
+    if (!pgsql_host)
+        pgsql_host = "localhost";
 
-        if (!pgsql_host)
-            pgsql_host = "localhost";
+    if (!pgsql_port)
+        pgsql_port = "5432";
 
-        if (!pgsql_port)
-            pgsql_port = "5432";
+    if (errors)
+        return NULL;
 
-        if (errors)
-            return ret;
+    conninfo = apr_psprintf
+        (pool, "host=%s port=%s user=%s password=%s dbname=%s",
+         pgsql_host, pgsql_port, pgsql_user, pgsql_passwd,
+         pgsql_db);
 
-        char* conninfo = apr_psprintf
-            (pool, "host=%s port=%s user=%s password=%s dbname=%s",
-             pgsql_host, pgsql_port, pgsql_user, pgsql_passwd,
-             pgsql_db);
+    if (!(conn = PQconnectdb(conninfo))) {
+        range_request_warn(rr, "pgsql dbname=%s: can't connect",
+                           pgsql_db);
+        return NULL;
+    }
+
+    if (PQstatus(conn) != CONNECTION_OK) {
+        range_request_warn(rr, "pgsql connection: %s",
+                           PQerrorMessage(conn));
+        PQfinish(conn);
+        return NULL;
+    }
+
+    if (!_prepare(rr, conn)) {
+        PQfinish(conn);
+        return NULL;
+    }
+
+    libcrange_set_cache(lr, "pgsql:conn", conn);
+    return conn;
+}
+
+/* the cached connection, reconnected if the server went away */
+static PGconn* _get_conn(range_request* rr, int reset)
+{
+    libcrange* lr = range_request_lr(rr);
+    PGconn* conn = libcrange_get_cache(lr, "pgsql:conn");
 
-        if (!(conn = PQconnectdb(conninfo))) {
-            range_request_warn(rr, "pgsql dbname=%s: can't connect",
-                               pgsql_db);
-            return ret;
+    if (!conn)
+        return _connect(rr);
+    if (!reset && PQstatus(conn) == CONNECTION_OK)
+        return conn;
+
+    /* same parameters, new session: the statements need preparing
+     * again */
+    PQreset(conn);
+    if (PQstatus(conn) != CONNECTION_OK) {
+        range_request_warn(rr, "pgsql connection: %s",
+                           PQerrorMessage(conn));
+        return NULL;
+    }
+    return _prepare(rr, conn) ? conn : NULL;
+}
+
+/* groups as a text[] literal: {"a","b"} */
+static const char* _text_array(apr_pool_t* pool,
+                               const apr_array_header_t* groups)
+{
+    size_t len = 3;
+    char* buf;
+    char* p;
+    int i;
+
+    for (i = 0; i < groups->nelts; i++)
+        len += 2 * strlen(((const char**)groups->elts)[i]) + 3;
+    p = buf = apr_palloc(pool, len);
+    *p++ = '{';
+    for (i = 0; i < groups->nelts; i++) {
+        const char* s = ((const char**)groups->elts)[i];
+        if (i)
+            *p++ = ',';
+        *p++ = '"';
+        for (; *s; s++) {
+            if (*s == '"' || *s == '\\')
+                *p++ = '\\';
+            *p++ = *s;
         }
+        *p++ = '"';
+    }
+    *p++ = '}';
+    *p = '\0';
+    return buf;
+}
 
-        if (PQstatus(conn) != CONNECTION_OK) {
-            range_request_warn(rr, "pgsql connection: %s",
-                               PQerrorMessage(conn));
-            return ret;
+static int _result_ok(range_request* rr, PGconn* conn, PGresult* result)
+{
+    if (result && PQresultStatus(result) == PGRES_TUPLES_OK)
+        return 1;
+    range_request_warn(rr, "pgsql_group: %s", PQerrorMessage(conn));
+    return 0;
+}
+
+/* run the queries we need; results[0] for the groups, results[1] for
+ * ALL. With both, they go out together in a pipeline where libpq has
+ * one */
+static int _query(range_request* rr, PGconn* conn, const char* namespace,
+                  const char* groups, int all, PGresult** results)
+{
+    const char* params[2];
+    int ok = 1;
+
+    params[0] = namespace;
+    params[1] = groups;
+    results[0] = results[1] = NULL;
+
+#ifdef LIBPQ_HAS_PIPELINING
+    if (groups && all && PQenterPipelineMode(conn)) {
+        int i;
+        PGresult* r;
+
+        ok = PQsendQueryPrepared(conn, GROUP_STMT, 2, params,
+                                 NULL, NULL, 0) &&
+            PQsendQueryPrepared(conn, ALL_STMT, 1, params, NULL, NULL, 0) &&
+            PQpipelineSync(conn);
+        for (i = 0; ok && i < 2; i++) {
+            results[i] = PQgetResult(conn);
+            /* each query's results end with a NULL */
+            while ((r = PQgetResult(conn)))
+                PQclear(r);
+        }
+        /* up to the sync */
+        while ((r = PQgetResult(conn))) {
+            int sync = PQresultStatus(r) == PGRES_PIPELINE_SYNC;
+            PQclear(r);
+            if (sync)
+                break;
         }
+        PQexitPipelineMode(conn);
+    }
+    else
+#endif
+    {
+        if (groups)
+            results[0] = PQexecPrepared(conn, GROUP_STMT, 2, params,
+                                        NULL, NULL, 0);
+        if (all)
+            results[1] = PQexecPrepared(conn, ALL_STMT, 1, params,
+                                        NULL, NULL, 0);
+    }
 
-        libcrange_set_cache(lr, "pgsql:conn", conn);
+    if (groups && !_result_ok(rr, conn, results[0]))
+        ok = 0;
+    if (all && !_result_ok(rr, conn, results[1]))
+        ok = 0;
+    if (!ok) {
+        PQclear(results[0]);
+        PQclear(results[1]);
+        results[0] = results[1] = NULL;
     }
+    return ok;
+}
 
+static void _add_names(range* r, const char** names)
+{
+    for (; *names; names++)
+        range_add(r, *names);
+}
+
+/* groups are kept in the "pgsql" result cache: pgsql_cache_ttl and
+ * friends in range.conf */
+range* rangefunc_group(range_request* rr, range** r)
+{
+    range* ret;
+    const char** members;
+    const char** values;
+    int i, row, rows;
+    int all = 0;
+    PGconn *conn;
+    PGresult* results[2];
+    range_cache* cache;
+    set* stale;
+    set* fetched;
+    set_iter it;
+    set_element* e;
+    apr_array_header_t* wanted;
+    const char* groups;
+
+    apr_pool_t* pool = range_request_pool(rr);
+    libcrange* lr = range_request_lr(rr);
+
+    ret = range_new(rr);
+    members = range_get_hostnames(pool, r[0]);
+
+    const char* default_namespace = libcrange_getcfg(lr, "default_namespace");
+    if (!default_namespace)
+        default_namespace = "yst";
+
+    /* what we still have, and what we need to ask for */
+    cache = libcrange_result_cache(lr, "pgsql");
+    stale = set_new(pool, 0);
+    wanted = apr_array_make(pool, 8, sizeof(char*));
     for (i = 0; members[i]; i++) { /* for each gemgroup */
-        int all = strcmp(members[i], "ALL") == 0;
-        PGresult* result;
-        int row, rows;
-        const char* query;
-        
-        if (all) 
-            query = apr_psprintf(pool, "select distinct element "
-                                "from velementgroups where namespace='%s'",
-                                default_namespace);
-        else 
-            query = apr_psprintf(pool, "select element from velementgroups "
-                                "where namespace='%s' and groupname='%s'",
-                                default_namespace, members[i]);
-
-        result = PQexec(conn, query);
-        if (!result) {
-            range_request_warn(rr, "pgsql_group: %s",
-                               PQerrorMessage(conn));
-            return ret;
+        switch (range_cache_get(cache, members[i], pool, &values)) {
+        case RANGE_CACHE_HIT:
+            _add_names(ret, values);
+            continue;
+        case RANGE_CACHE_STALE:
+            /* in case the database doesn't answer */
+            set_add(stale, members[i], values);
+            break;
         }
+        if (strcmp(members[i], "ALL") == 0)
+            all = 1;
+        else
+            *(const char**)apr_array_push(wanted) = members[i];
+    }
+    if (!all && !wanted->nelts)
+        return ret;
 
-        if (( PQresultStatus(result) != PGRES_COMMAND_OK ) &&
-            ( PQresultStatus(result) != PGRES_TUPLES_OK ))
-        {
-            range_request_warn(rr, "pgsql_group: %s",
-                               PQerrorMessage(conn));
-            return ret;
-        }
+    groups = wanted->nelts ? _text_array(pool, wanted) : NULL;
+    if (!(conn = _get_conn(rr, 0)))
+        goto failed;
+    if (!_query(rr, conn, default_namespace, groups, all, results)) {
+        /* once more, in case the connection had dropped */
+        if (PQstatus(conn) != CONNECTION_BAD ||
+            !(conn = _get_conn(rr, 1)) ||
+            !_query(rr, conn, default_namespace, groups, all, results))
+            goto failed;
+    }
 
-        rows = PQntuples(result);
-        for (row=0; row < rows; ++row) {
-            const char* element = PQgetvalue(result, row, 0);
-            range_add(ret, element);
+    /* groups without any elements are worth remembering too */
+    fetched = set_new(pool, 0);
+    for (i = 0; i < wanted->nelts; i++)
+        set_add(fetched, ((const char**)wanted->elts)[i], range_new(rr));
+    if (results[0]) {
+        rows = PQntuples(results[0]);
+        for (row = 0; row < rows; ++row) {
+            range* group = set_get_data(fetched,
+                                        PQgetvalue(results[0], row, 0));
+            if (group)
+                range_add(group, PQgetvalue(results[0], row, 1));
         }
-        
-        PQclear(result);
+        PQclear(results[0]);
+    }
+    if (results[1]) {
+        range* group = range_new(rr);
+        rows = PQntuples(results[1]);
+        for (row = 0; row < rows; ++row)
+            range_add(group, PQgetvalue(results[1], row, 0));
+        set_add(fetched, "ALL", group);
+        PQclear(results[1]);
     }
 
+    for (set_iter_init(&it, fetched); (e = set_iter_next(&it)); ) {
+        range* group = e->data;
+        set_union_inplace(ret->nodes, group->nodes);
+        range_cache_put(cache, e->name, range_get_hostnames(pool, group));
+    }
+    return ret;
+
+  failed:
+    for (set_iter_init(&it, stale); (e = set_iter_next(&it)); )
+        _add_names(ret, e->data);
     return ret;
 }
+
+/* the database changes under us, with no generation to check: past the
+ * request, the "pgsql" result cache is all the caching there is */
+static const range_function_desc functions[] = {
+    { "group", rangefunc_group, 1, RANGE_FUNC_PURE },
+    { NULL }
+};
+
+const range_module_desc range_module = {
+    LIBCRANGE_MODULE_ABI, "pgsql", functions
+};
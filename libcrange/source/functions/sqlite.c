@@ -2,66 +2,44 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
-#include <sqlite3.h>
 #include <apr_strings.h>
 #include <apr_tables.h>
-#include <sys/stat.h>
 
 #include "set.h"
 #include "libcrange.h"
 #include "range.h"
+#include "sqlite_db.h"
 char* _join_elements(apr_pool_t* pool, char sep, set* the_set);
 
+static const char* db_files[3];
 
-const char** functions_provided(libcrange* lr)
+static int _init(libcrange* lr)
 {
-    static const char* functions[] = {"mem", "cluster", "clusters",
-                                      "get_cluster", "get_groups",
-                                      "has", "allclusters", 0};
-    return functions;
+    sqlite_db_files(lr, db_files);
+    return 0;
 }
 
-#define KEYVALUE_SQL "select key, value from clusters where cluster=?"
-#define HAS_SQL "select cluster from clusters where key=? and value=?"
-#define ALLCLUSTER_SQL "select distinct cluster from clusters"
-
-sqlite3* _open_db(range_request* rr) 
+static const char** _depends(libcrange* lr)
 {
-    sqlite3* db;
-    libcrange* lr = range_request_lr(rr);
-    int err;
-    
-    /* open the db */
-    if (!(db = libcrange_get_cache(lr, "sqlite:nodes"))) {
-        const char* sqlite_db_path = libcrange_getcfg(lr, "sqlitedb");
-        if (!sqlite_db_path) sqlite_db_path = DEFAULT_SQLITE_DB;
-        
-        err = sqlite3_open(sqlite_db_path, &db);
-        assert(err == SQLITE_OK);
-        libcrange_set_cache(lr, "sqlite:nodes", db);
-    }
-
-    return db;
+    return db_files;
 }
 
+#define CACHE_NAME "sqlite:cluster_keys"
+
+#define KEYVALUE_SQL "select key, value from clusters where cluster=?"
+#define ALL_SQL "select cluster, key, value from clusters order by cluster"
 
 static set* _cluster_keys(range_request* rr, apr_pool_t* pool,
                           const char* cluster)
 {
     set* sections;
-    sqlite3* db;
     sqlite3_stmt* stmt;
-    int err;
     
     /* our return set */
     sections = set_new(pool, 0);
 
-    db = _open_db(rr);
-    
-    /* prepare our select */
-    err = sqlite3_prepare(db, KEYVALUE_SQL, strlen(KEYVALUE_SQL),
-                          &stmt, NULL);
-    assert(err == SQLITE_OK);
+    if (!(stmt = sqlite_db_stmt(rr, KEYVALUE_SQL)))
+        return sections;
 
     /* for each key/value pair in cluster */
     sqlite3_bind_text(stmt, 1, cluster, strlen(cluster), SQLITE_STATIC);
@@ -71,7 +49,7 @@ static set* _cluster_keys(range_request* rr, apr_pool_t* pool,
         const char* value = (const char*)sqlite3_column_text(stmt, 1);
         set_add(sections, key, apr_psprintf(pool, "%s", value));
     }
-    sqlite3_finalize(stmt);
+    sqlite3_reset(stmt);
 
     /* Add the magic "KEYS" index */
     set_add(sections, "KEYS", _join_elements(pool, ',', sections));
@@ -79,12 +57,22 @@ static set* _cluster_keys(range_request* rr, apr_pool_t* pool,
     return sections;
 }
 
-typedef struct cache_entry
+/* every cluster read since the data last changed. Single clusters are
+ * read as they're asked for; anything that needs all of them loads the
+ * whole table in one scan, with the indexes. A change anywhere in the
+ * database drops the lot */
+typedef struct cluster_cache
 {
-    time_t mtime;
+    long gen;
     apr_pool_t* pool;
-    set* sections;
-} cache_entry;
+    set* clusters;      /* cluster -> sections */
+    int complete;       /* the whole table is in clusters */
+    const char** all;   /* once complete: every cluster, sorted */
+    set* key_values;    /* once complete: key -> value -> cluster names */
+    set* hosts;         /* host -> cluster names, built on first use */
+    int building;       /* hosts is being built: don't drop anything */
+    size_t bytes;       /* charged to the cache */
+} cluster_cache;
 
 char* _join_elements(apr_pool_t* pool, char sep, set* the_set)
 {
@@ -115,46 +103,167 @@ char* _join_elements(apr_pool_t* pool, char sep, set* the_set)
     return result;
 }
 
-static range* _expand_cluster(range_request* rr,
-                              const char* cluster, const char* section)
+/* what one cluster's sections cost */
+static size_t _sections_bytes(set* sections)
 {
-    struct stat st;
-    const char* res;
+    size_t bytes = set_bytes(sections);
+    set_iter it;
+    set_element* section;
+
+    for (set_iter_init(&it, sections); (section = set_iter_next(&it)); )
+        if (section->data)
+            bytes += strlen(section->data) + 1;
+    return bytes;
+}
+
+/* charge the cache for what was just added to it */
+static void _charge(libcrange* lr, cluster_cache* cache, long bytes)
+{
+    libcrange_cache_charge(lr, CACHE_NAME, bytes);
+    cache->bytes += bytes;
+}
+
+/* the cache for the current data, or NULL if there's no database. With
+ * caching off it's a new one in the request's pool each time */
+static cluster_cache* _get_cache(range_request* rr)
+{
+    long gen;
     libcrange* lr = range_request_lr(rr);
-    set* cache = libcrange_get_cache(lr, "nodescf:cluster_keys");
-    apr_pool_t* req_pool = range_request_pool(rr);
-    apr_pool_t* lr_pool = range_request_lr_pool(rr);
+    cluster_cache* cache = libcrange_get_cache(lr, CACHE_NAME);
+    apr_pool_t* cache_pool;
 
-    cache_entry* e;
+    if (cache && cache->building)
+        return cache;
+    if ((gen = sqlite_db_generation(rr)) < 0)
+        return NULL;
 
+    if (!(cache_pool = libcrange_cache_pool(lr, CACHE_NAME)))
+        cache_pool = range_request_pool(rr);
     if (!cache) {
-        cache = set_new(lr_pool, 0);
-        libcrange_set_cache(lr, "nodescf:cluster_keys", cache);
+        cache = apr_pcalloc(cache_pool, sizeof(*cache));
+        libcrange_set_cache(lr, CACHE_NAME, cache);
+    }
+    if (!cache->pool || cache->gen != gen) {
+        if (cache->pool)
+            apr_pool_destroy(cache->pool);
+        libcrange_cache_charge(lr, CACHE_NAME, -(long)cache->bytes);
+        cache->bytes = 0;
+        apr_pool_create(&cache->pool, cache_pool);
+        cache->clusters = set_new(cache->pool, 0);
+        cache->complete = 0;
+        cache->all = NULL;
+        cache->key_values = NULL;
+        cache->hosts = NULL;
+        cache->gen = gen;
     }
+    return cache;
+}
 
-    if (stat("/etc/range.sqlite", &st) == -1) {
+/* charge the cache for everything in it, once the table is loaded */
+static void _account_all(libcrange* lr, cluster_cache* cache)
+{
+    size_t bytes = set_bytes(cache->clusters) + set_bytes(cache->key_values);
+    set_iter it;
+    set_iter vit;
+    set_element* elt;
+    set_element* value;
+
+    for (set_iter_init(&it, cache->clusters); (elt = set_iter_next(&it)); )
+        bytes += sizeof(char*) + _sections_bytes(elt->data);
+    for (set_iter_init(&it, cache->key_values); (elt = set_iter_next(&it)); ) {
+        bytes += set_bytes(elt->data);
+        for (set_iter_init(&vit, elt->data); (value = set_iter_next(&vit)); )
+            bytes += sizeof(apr_array_header_t) + sizeof(char*) *
+                ((apr_array_header_t*)value->data)->nalloc;
+    }
+    _charge(lr, cache, (long)bytes - (long)cache->bytes);
+}
+
+/* the whole table in one ordered scan */
+static cluster_cache* _load_all(range_request* rr)
+{
+    cluster_cache* cache = _get_cache(rr);
+    apr_pool_t* pool;
+    apr_array_header_t* all;
+    sqlite3_stmt* stmt;
+    set* sections = NULL;
+    const char* cluster = NULL;
+
+    if (!cache || cache->complete)
+        return cache;
+    if (!(stmt = sqlite_db_stmt(rr, ALL_SQL)))
+        return NULL;
+
+    pool = cache->pool;
+    all = apr_array_make(pool, 1024, sizeof(char*));
+    cache->key_values = set_new(pool, 0);
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        const char* name = (const char*)sqlite3_column_text(stmt, 0);
+        const char* key = (const char*)sqlite3_column_text(stmt, 1);
+        const char* value = (const char*)sqlite3_column_text(stmt, 2);
+        apr_array_header_t* clusters;
+        set* values;
+
+        if (!name || !key || !value)
+            continue;
+        if (!cluster || strcmp(cluster, name) != 0) {
+            /* rows come grouped by cluster */
+            if (sections)
+                set_add(sections, "KEYS", _join_elements(pool, ',', sections));
+            sections = set_new(pool, 0);
+            cluster = set_add(cache->clusters, name, sections)->name;
+            *(const char**)apr_array_push(all) = cluster;
+        }
+        set_add(sections, key, apr_pstrdup(pool, value));
+
+        if (!(values = set_get_data(cache->key_values, key))) {
+            values = set_new(pool, 0);
+            set_add(cache->key_values, key, values);
+        }
+        if (!(clusters = set_get_data(values, value))) {
+            clusters = apr_array_make(pool, 1, sizeof(char*));
+            set_add(values, value, clusters);
+        }
+        *(const char**)apr_array_push(clusters) = cluster;
+    }
+    sqlite3_reset(stmt);
+    if (sections)
+        set_add(sections, "KEYS", _join_elements(pool, ',', sections));
+
+    *(const char**)apr_array_push(all) = NULL;
+    cache->all = (const char**)all->elts;
+    cache->complete = 1;
+    _account_all(range_request_lr(rr), cache);
+    return cache;
+}
+
+static range* _expand_cluster(range_request* rr,
+                              const char* cluster, const char* section)
+{
+    const char* res;
+    cluster_cache* cache = _get_cache(rr);
+    apr_pool_t* req_pool = range_request_pool(rr);
+    set* sections;
+
+    if (!cache) {
         range_request_warn_type(rr, "NOCLUSTERDEF", cluster);
         return range_new(rr);
     }
 
-    e = set_get_data(cache, cluster);
-    if (!e) {
-        e = apr_palloc(lr_pool, sizeof(struct cache_entry));
-        apr_pool_create(&e->pool, lr_pool);
-        e->sections = _cluster_keys(rr, e->pool, cluster);
-        e->mtime = st.st_mtime;
-        set_add(cache, cluster, e);
-    }
-    else {
-        time_t cached_mtime = e->mtime;
-        if (cached_mtime != st.st_mtime) {
-            apr_pool_clear(e->pool);
-            e->sections = _cluster_keys(rr, e->pool, cluster);
-            e->mtime = st.st_mtime;
-        } 
+    sections = set_get_data(cache->clusters, cluster);
+    if (!sections) {
+        if (cache->complete) /* no such cluster */
+            sections = set_new(req_pool, 0);
+        else {
+            sections = _cluster_keys(rr, cache->pool, cluster);
+            set_add(cache->clusters, cluster, sections);
+            _charge(range_request_lr(rr), cache,
+                    sizeof(set_element) + strlen(cluster) + 1 +
+                    _sections_bytes(sections));
+        }
     }
 
-    res = set_get_data(e->sections, section);
+    res = set_get_data(sections, section);
 
     if (!res) {
         char* cluster_section = apr_psprintf(req_pool,
@@ -169,37 +278,8 @@ static range* _expand_cluster(range_request* rr,
 /* get a list of all clusters */
 static const char** _all_clusters(range_request* rr)
 {
-    sqlite3 *db;
-    sqlite3_stmt *stmt;
-    int err, n, i;
-    apr_pool_t* pool = range_request_pool(rr);
-    set* clusters = set_new(pool, 0);
-    set_element** elts;
-    const char** table;
-    
-    db = _open_db(rr);
-    err = sqlite3_prepare(db, ALLCLUSTER_SQL, strlen(ALLCLUSTER_SQL),
-                          &stmt, NULL);
-    assert(err == SQLITE_OK);
-
-    /* for each cluster */
-    while(sqlite3_step(stmt) == SQLITE_ROW) {
-        const char* cluster = (const char*)sqlite3_column_text(stmt, 0);
-        set_add(clusters, cluster, 0);
-    }
-    sqlite3_finalize(stmt);
-    
-    n = clusters->members;
-    table = apr_palloc(pool, sizeof(char*) * (n + 1));
-    table[n] = NULL;
-
-    elts = set_members(clusters);
-    for (i=0; i<n; i++) {
-        const char* name = (*elts++)->name;
-        table[i] = name;
-    }
-
-    return table;
+    cluster_cache* cache = _load_all(rr);
+    return cache ? cache->all : NULL;
 }
 
 range* rangefunc_allclusters(range_request* rr, range** r)
@@ -224,9 +304,6 @@ range* rangefunc_allclusters(range_request* rr, range** r)
 
 range* rangefunc_has(range_request* rr, range** r)
 {
-    sqlite3* db;
-    sqlite3_stmt* stmt;
-    int err;
     range* ret = range_new(rr);
     apr_pool_t* pool = range_request_pool(rr);
     const char** tag_names = range_get_hostnames(pool, r[0]);
@@ -235,24 +312,17 @@ range* rangefunc_has(range_request* rr, range** r)
     const char* tag_name = tag_names[0];
     const char* tag_value = tag_values[0];
 
-    const char** all_clusters = _all_clusters(rr);
-    const char** cluster = all_clusters;
-    int warn_enabled = range_request_warn_enabled(rr);
+    cluster_cache* cache = _load_all(rr);
+    set* values;
+    apr_array_header_t* clusters;
+    int i;
 
-    db = _open_db(rr);
-    err = sqlite3_prepare(db, HAS_SQL, strlen(HAS_SQL), &stmt,
-                          NULL);
-    assert(err == SQLITE_OK);
+    if (!cache || !(values = set_get_data(cache->key_values, tag_name)) ||
+        !(clusters = set_get_data(values, tag_value)))
+        return ret;
 
-    sqlite3_bind_text(stmt, 1, tag_name, strlen(tag_name), SQLITE_STATIC);
-    sqlite3_bind_text(stmt, 2, tag_value, strlen(tag_value), SQLITE_STATIC);
-
-    while(sqlite3_step(stmt) == SQLITE_ROW) {
-        const char* answer = (const char*)sqlite3_column_text(stmt, 0);
-        range_add(ret, answer);
-    }
-
-    sqlite3_finalize(stmt);
+    for (i = 0; i < clusters->nelts; i++)
+        range_add(ret, ((const char**)clusters->elts)[i]);
 
     return ret;
 }
@@ -330,35 +400,42 @@ range* rangefunc_cluster(range_request* rr, range** r)
 
 static set* _get_clusters(range_request* rr)
 {
-    const char** all_clusters = _all_clusters(rr);
-    const char** p_cl = all_clusters;
-    apr_pool_t* pool = range_request_pool(rr);
-    set* node_cluster = set_new(pool, 40000);
+    cluster_cache* cache = _load_all(rr);
+    const char** p_cl;
     
-    if(p_cl == NULL) {
-        return node_cluster;
-    }
-    
-    while (*p_cl) {
+    if (!cache)
+        return set_new(range_request_pool(rr), 0);
+    if (cache->hosts)
+        return cache->hosts;
+
+    /* CLUSTER may refer to other clusters: keep the data put while we
+     * expand */
+    cache->building = 1;
+    cache->hosts = set_new(cache->pool, 0);
+    for (p_cl = cache->all; *p_cl; ++p_cl) {
         range* nodes_r = _expand_cluster(rr, *p_cl, "CLUSTER");
-        const char** nodes = range_get_hostnames(pool, nodes_r);
-        const char** p_nodes = nodes;
+        set_iter it;
+        set_element* node;
 
-        while (*p_nodes) {
-            apr_array_header_t* clusters = set_get_data(node_cluster, *p_nodes);
+        for (set_iter_init(&it, nodes_r->nodes);
+             (node = set_iter_next(&it)); ) {
+            apr_array_header_t* clusters = set_get_data(cache->hosts,
+                                                        node->name);
 
             if (!clusters) {
-                clusters = apr_array_make(pool, 1, sizeof(char*));
-                set_add(node_cluster, *p_nodes, clusters);
+                clusters = apr_array_make(cache->pool, 1, sizeof(char*));
+                set_add(cache->hosts, node->name, clusters);
             }
 
             *(const char**)apr_array_push(clusters) = *p_cl;
-            ++p_nodes;
         }
-        ++p_cl;
     }
+    cache->building = 0;
+    _charge(range_request_lr(rr), cache, set_bytes(cache->hosts) +
+            cache->hosts->members * (sizeof(apr_array_header_t) +
+                                     sizeof(char*)));
 
-    return node_cluster;
+    return cache->hosts;
 }
 
 range* rangefunc_get_cluster(range_request* rr, range** r)
@@ -437,5 +514,20 @@ range* rangefunc_get_groups(range_request* rr, range** r)
     return ret;
 }
 
-
-
+#define CLUSTER_DATA (RANGE_FUNC_PURE | RANGE_FUNC_CACHEABLE | RANGE_FUNC_READS_FILES)
+
+static const range_function_desc functions[] = {
+    { "mem", rangefunc_mem, 2, CLUSTER_DATA },
+    { "cluster", rangefunc_cluster, 1, CLUSTER_DATA },
+    { "clusters", rangefunc_clusters, 1, CLUSTER_DATA },
+    { "get_cluster", rangefunc_get_cluster, 1, CLUSTER_DATA },
+    { "get_groups", rangefunc_get_groups, 1, CLUSTER_DATA },
+    { "has", rangefunc_has, 2, CLUSTER_DATA },
+    { "allclusters", rangefunc_allclusters, 0, CLUSTER_DATA },
+    { NULL }
+};
+
+const range_module_desc range_module = {
+    LIBCRANGE_MODULE_ABI, "sqlite", functions,
+    _init, NULL, _depends
+};
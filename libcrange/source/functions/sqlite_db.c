@@ -0,0 +1,199 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <apr_pools.h>
+#include <apr_strings.h>
+#include <apr_time.h>
+
+#include "set.h"
+#include "libcrange.h"
+#include "range_request.h"
+#include "sqlite_db.h"
+
+#define DEFAULT_MMAP_SIZE "268435456"
+#define DEFAULT_FRESHNESS_INTERVAL 1
+
+#define DATA_VERSION_SQL "PRAGMA data_version"
+
+typedef struct sqlite_conn
+{
+    apr_pool_t* pool;
+    const char* path;
+    sqlite3* db;
+    apr_pool_t* stmt_pool;
+    set* stmts;              /* sql -> sqlite3_stmt */
+    ino_t ino;               /* of the file we have open */
+    sqlite3_int64 data_version;
+    long gen;
+    apr_time_t checked;
+    apr_interval_time_t interval;
+} sqlite_conn;
+
+static void close_db(sqlite_conn* c)
+{
+    set_iter it;
+    set_element* elt;
+
+    if (!c->db)
+        return;
+    for (set_iter_init(&it, c->stmts); (elt = set_iter_next(&it)); )
+        sqlite3_finalize(elt->data);
+    apr_pool_destroy(c->stmt_pool);
+    sqlite3_close(c->db);
+    c->db = NULL;
+}
+
+static apr_status_t cleanup_conn(void* data)
+{
+    close_db(data);
+    return APR_SUCCESS;
+}
+
+static sqlite3_int64 data_version(range_request* rr, sqlite_conn* c);
+
+static int open_db(range_request* rr, sqlite_conn* c)
+{
+    libcrange* lr = range_request_lr(rr);
+    const char* mmap_size;
+    struct stat st;
+
+    if (sqlite3_open_v2(c->path, &c->db, SQLITE_OPEN_READONLY,
+                        NULL) != SQLITE_OK) {
+        range_request_warn(rr, "%s: %s", c->path, sqlite3_errmsg(c->db));
+        sqlite3_close(c->db);
+        c->db = NULL;
+        return 0;
+    }
+    apr_pool_create(&c->stmt_pool, c->pool);
+    c->stmts = set_new(c->stmt_pool, 0);
+    c->ino = stat(c->path, &st) == 0 ? st.st_ino : 0;
+
+    /* pages are read straight from the mapping instead of being copied
+     * into sqlite's cache */
+    if (!(mmap_size = libcrange_getcfg(lr, "sqlite_mmap_size")))
+        mmap_size = DEFAULT_MMAP_SIZE;
+    sqlite3_exec(c->db, apr_psprintf(range_request_pool(rr),
+                                     "PRAGMA mmap_size=%ld",
+                                     atol(mmap_size)), NULL, NULL, NULL);
+
+    c->data_version = data_version(rr, c);
+    c->checked = apr_time_now();
+    c->gen++;
+    return 1;
+}
+
+/* the connection, opened if need be */
+static sqlite_conn* get_conn(range_request* rr)
+{
+    libcrange* lr = range_request_lr(rr);
+    const char* cfg;
+    apr_pool_t* pool;
+    sqlite_conn* c;
+
+    if ((c = libcrange_get_cache(lr, "sqlite:nodes")))
+        return c->db || open_db(rr, c) ? c : NULL;
+
+    /* with caching off the connection goes with the request */
+    apr_pool_create(&pool, lr->want_caching ? libcrange_get_pool(lr) :
+                    range_request_pool(rr));
+    c = apr_pcalloc(pool, sizeof(*c));
+    c->pool = pool;
+    if (!(c->path = libcrange_getcfg(lr, "sqlitedb")))
+        c->path = DEFAULT_SQLITE_DB;
+    cfg = libcrange_getcfg(lr, "freshness_interval");
+    c->interval = (apr_interval_time_t)
+        ((cfg ? atof(cfg) : DEFAULT_FRESHNESS_INTERVAL) * APR_USEC_PER_SEC);
+    apr_pool_cleanup_register(pool, c, cleanup_conn, apr_pool_cleanup_null);
+    libcrange_set_cache(lr, "sqlite:nodes", c);
+
+    return open_db(rr, c) ? c : NULL;
+}
+
+static sqlite3_stmt* conn_stmt(range_request* rr, sqlite_conn* c,
+                               const char* sql)
+{
+    sqlite3_stmt* stmt;
+    int err;
+
+    if ((stmt = set_get_data(c->stmts, sql))) {
+        sqlite3_reset(stmt);
+        sqlite3_clear_bindings(stmt);
+        return stmt;
+    }
+
+#if SQLITE_VERSION_NUMBER >= 3020000
+    err = sqlite3_prepare_v3(c->db, sql, -1, SQLITE_PREPARE_PERSISTENT,
+                             &stmt, NULL);
+#else
+    err = sqlite3_prepare_v2(c->db, sql, -1, &stmt, NULL);
+#endif
+    if (err != SQLITE_OK) {
+        range_request_warn(rr, "%s: %s", sql, sqlite3_errmsg(c->db));
+        return NULL;
+    }
+    set_add(c->stmts, sql, stmt);
+    return stmt;
+}
+
+/* changes whenever another connection commits to the database */
+static sqlite3_int64 data_version(range_request* rr, sqlite_conn* c)
+{
+    sqlite3_stmt* stmt = conn_stmt(rr, c, DATA_VERSION_SQL);
+    sqlite3_int64 version = -1;
+
+    if (stmt && sqlite3_step(stmt) == SQLITE_ROW)
+        version = sqlite3_column_int64(stmt, 0);
+    if (stmt)
+        sqlite3_reset(stmt);
+    return version;
+}
+
+sqlite3* sqlite_db_open(range_request* rr)
+{
+    sqlite_conn* c = get_conn(rr);
+    return c ? c->db : NULL;
+}
+
+sqlite3_stmt* sqlite_db_stmt(range_request* rr, const char* sql)
+{
+    sqlite_conn* c = get_conn(rr);
+    return c ? conn_stmt(rr, c, sql) : NULL;
+}
+
+long sqlite_db_generation(range_request* rr)
+{
+    sqlite_conn* c = get_conn(rr);
+    apr_time_t now = apr_time_now();
+    struct stat st;
+    sqlite3_int64 version;
+
+    if (!c)
+        return -1;
+    if (now - c->checked < c->interval)
+        return c->gen;
+    c->checked = now;
+
+    /* a new file moved into place: our connection still reads the old
+     * one */
+    if (stat(c->path, &st) != 0 || st.st_ino != c->ino) {
+        close_db(c);
+        c->gen++;
+        return open_db(rr, c) ? c->gen : -1;
+    }
+
+    version = data_version(rr, c);
+    if (version != c->data_version) {
+        c->data_version = version;
+        c->gen++;
+    }
+    return c->gen;
+}
+
+void sqlite_db_files(libcrange* lr, const char** files)
+{
+    const char* path = libcrange_getcfg(lr, "sqlitedb");
+
+    files[0] = path ? path : DEFAULT_SQLITE_DB;
+    files[1] = apr_pstrcat(libcrange_get_pool(lr), files[0], "-wal", NULL);
+    files[2] = NULL;
+}
@@ -0,0 +1,45 @@
+#ifndef SQLITE_DB_H
+#define SQLITE_DB_H
+
+#include <sqlite3.h>
+#include "libcrange.h"
+#include "range_request.h"
+
+/* sqlite_db: the connection to sqlitedb (range.conf) shared by the
+ * sqlite modules. The database is only ever read: it's opened
+ * read-only, memory mapped (sqlite_mmap_size, default 256M, 0 turns it
+ * off) and kept in the libcrange cache with its prepared statements.
+ *
+ * The schema the modules expect, with the indexes their queries need
+ * (clusters_cluster covers both the per-cluster lookup and the ordered
+ * scan that loads every cluster):
+ *
+ *   CREATE TABLE clusters (cluster TEXT, key TEXT, value TEXT);
+ *   CREATE INDEX clusters_cluster ON clusters (cluster, key, value);
+ *
+ *   CREATE TABLE nodes (name TEXT);
+ *   CREATE TABLE tags (name TEXT, range TEXT);
+ *   CREATE INDEX tags_name ON tags (name);
+ */
+
+/* the connection, opened on first use. NULL (with a warning) if the
+ * database can't be opened */
+sqlite3* sqlite_db_open(range_request* rr);
+
+/* sql, prepared once per connection and kept: reset, with no bindings.
+ * NULL (with a warning) if it doesn't prepare. The statement is shared:
+ * sqlite3_reset it when done, and don't expand ranges while stepping
+ * it, or a nested call may reset it under you */
+sqlite3_stmt* sqlite_db_stmt(range_request* rr, const char* sql);
+
+/* changes whenever the data does: another connection committed
+ * (PRAGMA data_version) or the file was replaced. Checked at most every
+ * freshness_interval seconds (range.conf, default 1), so calling it for
+ * every lookup is free. -1 if the database can't be opened */
+long sqlite_db_generation(range_request* rr);
+
+/* for the module's depends: the database and its write-ahead log,
+ * files[0] and files[1], allocated from lr's pool. files[2] is NULL */
+void sqlite_db_files(libcrange* lr, const char** files);
+
+#endif
@@ -1,4 +1,6 @@
 #include <netdb.h>
+#include <errno.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <ctype.h>
@@ -12,68 +14,87 @@
 #include "libcrange.h"
 #include "tinydns_ip.h"
 
+#define CACHE_NAME "dns:tinydns_data"
+
+/* lives in the cache's pool, the parsed data in a subpool */
 typedef struct cache_entry
 {
-    time_t mtime;
+    long gen;
     apr_pool_t* pool;
     set* hosts_ip;
     set* cnames;
+    size_t bytes;  /* charged to the cache */
 } cache_entry;
 
 static cache_entry* _dummy_cache_entry(apr_pool_t* pool)
 {
     cache_entry* e = apr_palloc(pool, sizeof(cache_entry));
-    e->mtime = 0;
+    e->gen = 0;
     e->cnames = e->hosts_ip = set_new(pool, 0);
     return e;
 }
 
-static cache_entry* tinydns_read(libcrange* lr)
+static pcre* a_re = NULL;
+static pcre* cname_re = NULL;
+
+void tinydns_init(void)
 {
-    const char* error;
-    int offset;
-    static pcre* a_re = NULL;
-    static pcre* cname_re = NULL;
+    if (!a_re) {
+        const char* error;
+        int offset;
+        a_re = pcre_compile(A_RE, 0, &error, &offset, NULL);
+        cname_re = pcre_compile(CNAME_RE, 0, &error, &offset, NULL);
+    }
+}
 
-    apr_pool_t* pool = libcrange_get_pool(lr);
+/* with caching off the entry is pool's, the caller's, and isn't kept */
+static cache_entry* _new_cache_entry(libcrange* lr, apr_pool_t* pool)
+{
+    apr_pool_t* cache_pool = libcrange_cache_pool(lr, CACHE_NAME);
     cache_entry* e;
-    struct stat st;
-    char line[8192];
-    FILE* fp;
-    const char* dns_file = libcrange_getcfg(lr, "dns_data_file");
-    if (!dns_file) dns_file = DNS_FILE;
 
-    if (stat(dns_file, &st) < 0) {
-        fprintf(stderr, "Can't stat %s", dns_file);
-        /* dummy cache */
-        return _dummy_cache_entry(pool);
-    }
+    if (!cache_pool)
+        cache_pool = pool;
+    e = apr_pcalloc(cache_pool, sizeof(cache_entry));
+    apr_pool_create(&e->pool, cache_pool);
+    libcrange_set_cache(lr, CACHE_NAME, e);
+    return e;
+}
 
-    e = libcrange_get_cache(lr, "dns:tinydns_data");
-    if (e && e->mtime == st.st_mtime)
-        return e;
+/* charge the cache for e as it is now */
+static void _account(libcrange* lr, cache_entry* e)
+{
+    size_t bytes = set_bytes(e->hosts_ip) + set_bytes(e->cnames) +
+        e->hosts_ip->members * (sizeof(ip) + sizeof("255.255.255.255"));
+    set_iter it;
+    set_element* elt;
 
-    if (!e) {
-        e = apr_palloc(pool, sizeof(cache_entry));
-        apr_pool_create(&e->pool, pool);
-        libcrange_set_cache(lr, "dns:tinydns_data", e);
-    }
-    else
-        apr_pool_clear(e->pool);
+    for (set_iter_init(&it, e->cnames); (elt = set_iter_next(&it)); )
+        bytes += strlen(elt->data) + 1;
+    libcrange_cache_charge(lr, CACHE_NAME, (long)bytes - (long)e->bytes);
+    e->bytes = bytes;
+}
+
+static const char* tinydns_file(libcrange* lr)
+{
+    const char* dns_file = libcrange_getcfg(lr, "dns_data_file");
+    return dns_file ? dns_file : DNS_FILE;
+}
+
+/* fill e->hosts_ip and e->cnames from dns_file, allocating from e->pool */
+static int tinydns_parse(const char* dns_file, cache_entry* e)
+{
+    char line[8192];
+    FILE* fp;
 
-    e->mtime = st.st_mtime;
     e->hosts_ip = set_new(e->pool, 50000);
     e->cnames = set_new(e->pool, 1000);
 
-    if (!a_re) {
-	a_re = pcre_compile(A_RE, 0, &error, &offset, NULL);
-	cname_re = pcre_compile(CNAME_RE, 0, &error, &offset, NULL);
-    }
-
+    tinydns_init();
     fp = fopen(dns_file, "r");
     if (!fp) {
         fprintf(stderr, "Can't open %s: %s", dns_file, strerror(errno));
-        return _dummy_cache_entry(pool);;
+        return 0;
     }
 
     while (fgets(line, sizeof line, fp)) {
@@ -86,7 +107,7 @@ static cache_entry* tinydns_read(libcrange* lr)
         if (len+1 >= sizeof(line) && line[len - 1] != '\n') {
             /* incomplete line */
             fprintf(stderr, "%s: lines > %d chars not supported\n", dns_file,
-                    sizeof line);
+                    (int)sizeof line);
             exit(-1);
         }
 
@@ -110,7 +131,36 @@ static cache_entry* tinydns_read(libcrange* lr)
 	    }
 	}
     }
+    fclose(fp);
+
+    return 1;
+}
+
+static cache_entry* tinydns_read(libcrange* lr, apr_pool_t* pool)
+{
+    cache_entry* e;
+    const char* dns_file = tinydns_file(lr);
+    long gen = libcrange_file_generation(lr, dns_file);
+
+    if (gen < 0) {
+        fprintf(stderr, "Can't stat %s", dns_file);
+        /* dummy cache */
+        return _dummy_cache_entry(pool);
+    }
+
+    e = libcrange_get_cache(lr, CACHE_NAME);
+    if (e && e->gen == gen)
+        return e;
 
+    if (!e)
+        e = _new_cache_entry(lr, pool);
+    else
+        apr_pool_clear(e->pool);
+
+    e->gen = gen;
+    if (!tinydns_parse(dns_file, e))
+        e->gen = 0; /* try again next time */
+    _account(lr, e);
     return e;
 }
 
@@ -139,15 +189,14 @@ ip* tinydns_get_ip(range_request* rr,  const char* hostname)
 }
 
 
-ip_host** tinydns_all_ip_hosts(libcrange* lr, apr_pool_t* pool)
+static ip_host** _ip_hosts(apr_pool_t* pool, const set* hosts_ip)
 {
     ip_host** result;
     ip_host** p;
     set_element** hosts;
-    cache_entry* e = tinydns_read(lr);
 
-    p = result = apr_palloc(pool, sizeof(ip_host*) * (e->hosts_ip->members + 1));
-    for (hosts = set_members(e->hosts_ip); *hosts; ++hosts) {
+    p = result = apr_palloc(pool, sizeof(ip_host*) * (hosts_ip->members + 1));
+    for (hosts = set_members(hosts_ip); *hosts; ++hosts) {
 	const char* host = (*hosts)->name;
 	const ip* host_ip = (*hosts)->data;
 	ip_host* iph = apr_palloc(pool, sizeof(ip_host));
@@ -160,6 +209,75 @@ ip_host** tinydns_all_ip_hosts(libcrange* lr, apr_pool_t* pool)
     return result;
 }
 
+ip_host** tinydns_all_ip_hosts(libcrange* lr, apr_pool_t* pool)
+{
+    return _ip_hosts(pool, tinydns_read(lr, pool)->hosts_ip);
+}
+
+ip_host** tinydns_read_ip_hosts(libcrange* lr, apr_pool_t* pool)
+{
+    cache_entry e;
+
+    e.pool = pool;
+    tinydns_parse(tinydns_file(lr), &e);
+    return _ip_hosts(pool, e.hosts_ip);
+}
+
+/* warm start: the parsed data file, as tinydns-style "+host" -> ip and
+ * "Calias" -> canonical name pairs */
+void tinydns_snapshot_save(libcrange* lr, range_snapshot* s)
+{
+    char name[8192];
+    set_iter it;
+    set_element* elt;
+    cache_entry* e = libcrange_get_cache(lr, CACHE_NAME);
+
+    if (!e)
+        return;
+    range_snapshot_entry(s, CACHE_NAME);
+    range_snapshot_depends(s, tinydns_file(lr));
+    for (set_iter_init(&it, e->hosts_ip); (elt = set_iter_next(&it)); ) {
+        snprintf(name, sizeof name, "+%s", elt->name);
+        range_snapshot_put(s, name, ((ip*)elt->data)->str);
+    }
+    for (set_iter_init(&it, e->cnames); (elt = set_iter_next(&it)); ) {
+        snprintf(name, sizeof name, "C%s", elt->name);
+        range_snapshot_put(s, name, elt->data);
+    }
+}
+
+void tinydns_snapshot_load(libcrange* lr, range_snapshot* s)
+{
+    const char* key;
+    const char* name;
+    const char* value;
+
+    if (!lr->want_caching)
+        return;
+    while (range_snapshot_next_entry(s, &key)) {
+        cache_entry* e;
+        long gen = libcrange_file_generation(lr, tinydns_file(lr));
+
+        if (strcmp(key, CACHE_NAME) != 0 || gen < 0 ||
+            libcrange_get_cache(lr, CACHE_NAME))
+            continue;
+
+        e = _new_cache_entry(lr, NULL);
+        e->hosts_ip = set_new(e->pool, 50000);
+        e->cnames = set_new(e->pool, 1000);
+        e->gen = gen;
+        /* names and values stay in the mapped snapshot */
+        while (range_snapshot_get(s, &name, &value)) {
+            if (*name == '+')
+                set_add_nocopy(e->hosts_ip, name + 1,
+                               ip_new(e->pool, value));
+            else if (*name == 'C')
+                set_add_nocopy(e->cnames, name + 1, (void*)value);
+        }
+        _account(lr, e);
+    }
+}
+
 ip* ip_new(apr_pool_t* pool, const char* ipaddr)
 {
     ip* i;
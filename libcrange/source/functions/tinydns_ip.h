@@ -23,6 +23,14 @@ unsigned str2ip(const char* str);
 ip* ip_new(apr_pool_t* pool, const char* ipaddr);
 ip* tinydns_get_ip(range_request* rr, const char* hostname);
 ip_host** tinydns_all_ip_hosts(libcrange* lr, apr_pool_t* pool);
+/* like tinydns_all_ip_hosts but parses the data file into pool
+ * without going through the cache */
+ip_host** tinydns_read_ip_hosts(libcrange* lr, apr_pool_t* pool);
+/* compile the regexes up front, before any threads use them */
+void tinydns_init(void);
+/* snapshot_save/snapshot_load for the parsed data file */
+void tinydns_snapshot_save(libcrange* lr, range_snapshot* s);
+void tinydns_snapshot_load(libcrange* lr, range_snapshot* s);
 
 
 #endif
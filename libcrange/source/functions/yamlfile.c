@@ -64,17 +64,86 @@ the key will be composed of all elements set-added together.
 #include <apr_tables.h>
 #include "libcrange.h"
 #include "range.h"
+#include "range_request.h"
+#include "cluster_index.h"
 
 static const char* yaml_path = LIBCRANGE_YAML_DIR;
 
-/* List of functions that are provided by this module */
-const char** functions_provided(libcrange* lr)
+/* the parsed cluster files, by path. The set and the entries live in
+ * the cache's pool, each entry's sections in a pool of its own */
+#define CACHE_NAME "yamlfile:cluster_keys"
+
+typedef struct cache_entry
+{
+    long gen;
+    apr_pool_t* pool;
+    set* sections;
+    size_t bytes;  /* charged to the cache */
+} cache_entry;
+
+static void _reload_cluster(libcrange* lr, const char* path, void* data);
+
+static apr_status_t _destroy_entries(void* data)
+{
+    set_iter it;
+    set_element* file;
+
+    for (set_iter_init(&it, data); (file = set_iter_next(&it)); )
+        apr_pool_destroy(((cache_entry*)file->data)->pool);
+    return APR_SUCCESS;
+}
+
+/* with caching off the cache is an empty one in pool, the request's,
+ * and the entries put in it go when the request does */
+static set* _get_cache(libcrange* lr, apr_pool_t* pool)
+{
+    set* cache = libcrange_get_cache(lr, CACHE_NAME);
+    apr_pool_t* cache_pool;
+
+    if (!cache) {
+        if (!(cache_pool = libcrange_cache_pool(lr, CACHE_NAME)))
+            cache_pool = pool;
+        cache = set_new(cache_pool, 0);
+        apr_pool_cleanup_register(cache_pool, cache, _destroy_entries,
+                                  apr_pool_cleanup_null);
+        libcrange_set_cache(lr, CACHE_NAME, cache);
+    }
+    return cache;
+}
+
+static cache_entry* _new_entry(libcrange* lr, set* cache, const char* file)
+{
+    cache_entry* e = apr_pcalloc(cache->pool, sizeof(*e));
+    set_add(cache, file, e);
+    return e;
+}
+
+/* charge the cache for e as it is now */
+static void _account(libcrange* lr, cache_entry* e)
+{
+    size_t bytes = sizeof(*e) + set_bytes(e->sections);
+    set_iter it;
+    set_element* section;
+
+    for (set_iter_init(&it, e->sections); (section = set_iter_next(&it)); )
+        if (section->data) /* KEYS, with no keys at all */
+            bytes += strlen(section->data) + 1;
+    libcrange_cache_charge(lr, CACHE_NAME, (long)bytes - (long)e->bytes);
+    e->bytes = bytes;
+}
+
+static void _remove_entry(libcrange* lr, set* cache, const char* file)
 {
-    static const char* functions[] = {"mem", "cluster", "clusters",
-                                      "group",
-                                      "get_cluster", "get_groups",
-                                      "has", "allclusters", 0 };
+    cache_entry* e = set_get_data(cache, file);
+
+    libcrange_cache_charge(lr, CACHE_NAME, -(long)e->bytes);
+    e->bytes = 0;
+    set_remove(cache, file);
+}
+static const char** _all_clusters(range_request* rr);
 
+static int _init(libcrange* lr)
+{
     /* initialize our path to the nodes database */
 
     /* First try env variable */
@@ -87,27 +156,76 @@ const char** functions_provided(libcrange* lr)
     if (altpath)
         yaml_path = altpath;
 
-    return functions;
+    libcrange_watch(lr, yaml_path, _reload_cluster, NULL);
+
+    return 0;
 }
 
-typedef struct cache_entry
+static const char** _depends(libcrange* lr)
+{
+    static const char* files[2];
+    files[0] = yaml_path;
+    return files;
+}
+
+/* section values are built up here, then copied once into the cache
+ * entry's pool. Grows by doubling in the request pool */
+typedef struct strbuf
 {
-    time_t mtime;
     apr_pool_t* pool;
-    set* sections;
-} cache_entry;
+    char* buf;
+    size_t len;
+    size_t size;
+} strbuf;
+
+static void _buf_reserve(strbuf* b, size_t more)
+{
+    size_t size = b->size ? b->size : 256;
+    char* buf;
+
+    if (b->len + more + 1 <= b->size)
+        return;
+    while (size < b->len + more + 1)
+        size *= 2;
+    buf = apr_palloc(b->pool, size);
+    if (b->len)
+        memcpy(buf, b->buf, b->len);
+    b->buf = buf;
+    b->size = size;
+}
 
-static char* _substitute_dollars(apr_pool_t* pool,
-                                 const char* cluster, const char* line)
+static void _buf_append(strbuf* b, const char* s, size_t len)
 {
-    static char buf[262144];
-    char* dst = buf;
+    _buf_reserve(b, len);
+    memcpy(b->buf + b->len, s, len);
+    b->len += len;
+}
+
+static const char* _buf_copy(strbuf* b, apr_pool_t* pool)
+{
+    return b->len ? apr_pstrmemdup(pool, b->buf, b->len) : "";
+}
+
+/* append line to b with each $SECTION turned into
+ * cluster(<cluster>:SECTION) */
+static void _append_substituted(strbuf* b, const char* cluster,
+                                const char* line)
+{
+    char* dst;
     int len = strlen(cluster);
     int in_regex = 0;
+    int ndollars = 0;
+    const char* p;
     char c;
     assert(line);
     assert(cluster);
 
+    for (p = line; *p; p++)
+        if (*p == '$') ndollars++;
+    /* each $ becomes cluster(<cluster>:...) */
+    _buf_reserve(b, (p - line) + ndollars * (len + sizeof("cluster(:)")));
+    dst = b->buf + b->len;
+
     while ((c = *line) != '\0') {
         if (!in_regex && c == '$') {
             strcpy(dst, "cluster(");
@@ -130,8 +248,7 @@ static char* _substitute_dollars(apr_pool_t* pool,
             *dst++ = *line++;
         }
     }
-    *dst = '\0';
-    return buf;
+    b->len = dst - b->buf;
 }
 
 char* _join_elements(apr_pool_t* pool, char sep, set* the_set)
@@ -163,24 +280,32 @@ char* _join_elements(apr_pool_t* pool, char sep, set* the_set)
     return result;
 }
 
-/* this is where the magic happens */
+/* what an anchor (&name) stood for */
+typedef struct anchored
+{
+    const char* value;
+    int is_scalar;
+} anchored;
+
+/* this is where the magic happens. The file is read as a stream of
+ * parser events rather than loaded as a document: each section's value
+ * is put together in a scratch buffer and copied once into pool */
 static set* _cluster_keys(range_request* rr, apr_pool_t* pool,
                           const char* cluster, const char* cluster_file)
 {
-    apr_array_header_t* working_range;
     set* sections;
-    char* section;
-    char* cur_section;
+    set* anchors;
     apr_pool_t* req_pool = range_request_pool(rr);
-    yaml_node_t *node;
-    yaml_node_t *rootnode;
-    yaml_node_t *keynode;
-    yaml_node_t *valuenode;
     yaml_parser_t parser;
-    yaml_node_item_t *item;
-    yaml_node_pair_t *pair;
-    
-    yaml_document_t document;
+    yaml_event_t event;
+    strbuf key = { req_pool, NULL, 0, 0 };
+    strbuf value = { req_pool, NULL, 0, 0 };
+    const char* seq_anchor = NULL;
+    int have_key = 0;
+    int in_mapping = 0, in_seq = 0;
+    int skip = 0;  /* depth of a value we don't understand */
+    int nitems = 0;
+    int ok = 1, done = 0;
     
     FILE* fp = fopen(cluster_file, "r");
 
@@ -196,117 +321,212 @@ static set* _cluster_keys(range_request* rr, apr_pool_t* pool,
         return set_new(pool, 0);
     }
 
-    yaml_parser_set_input_file(&parser, fp);
-    if(!yaml_parser_load(&parser, &document)) {
-        range_request_warn(rr, "%s: malformatted cluster definition %s",
-                           cluster, cluster_file);
-        fclose(fp);
-        yaml_parser_delete(&parser);
-        return set_new(pool, 0);
-    }
-    fclose(fp);
-    
-    rootnode = yaml_document_get_root_node(&document);
-    /* make sure it's just a simple dictionary */
-    if(rootnode->type != YAML_MAPPING_NODE) {
-        range_request_warn(rr, "%s: malformatted cluster definition %s",
-                           cluster, cluster_file);
-        yaml_document_delete(&document);
-        yaml_parser_delete(&parser);
-        return set_new(pool, 0);
-    }
-
     /* "sections" refers to cluster sections - %cluster:SECTION
        it's what we're going to return */
     sections = set_new(pool, 0);
-    section = cur_section = NULL;
-
-    for(pair = rootnode->data.mapping.pairs.start;
-        pair < rootnode->data.mapping.pairs.top;
-        pair++) { /* these are the keys */
-        keynode = yaml_document_get_node(&document, pair->key);
-        /* cur_section is the keyname - the WHATEVER in %cluster:WHATEVER */
-        cur_section = apr_pstrdup(pool, (char *)(keynode->data.scalar.value));
-        valuenode = yaml_document_get_node(&document, pair->value);
-        /* if the value is a scalar, that's our answer */
-        if(valuenode->type == YAML_SCALAR_NODE) {
-            set_add(sections, cur_section,
-                    apr_psprintf(pool, "%s", valuenode->data.scalar.value));
-        } else if (valuenode->type == YAML_SEQUENCE_NODE) {
-            /* otherwise, glue together all the values in the list */
-            working_range = apr_array_make(req_pool, 1, sizeof(char*));
-            for(item = valuenode->data.sequence.items.start;
-                item < valuenode->data.sequence.items.top;
-                item++) {
-                node = yaml_document_get_node(&document, (int)*item);
-                if(node->type != YAML_SCALAR_NODE) { /* only scalars allowed */
-                    range_request_warn(rr,
-                                       "%s: malformed cluster definition %s",
-                                       cluster, cluster_file);
-                    yaml_document_delete(&document);
-                    yaml_parser_delete(&parser);
-                    return set_new(pool, 0);
-                } else { /* add to the working set */
-                    /* include it in () because we're going to comma it
-                       together later */
-                    *(char**)apr_array_push(working_range) =
-                        apr_psprintf(pool, "(%s)", _substitute_dollars(pool,
-                          cluster, node->data.scalar.value));
+    anchors = set_new(req_pool, 0);
+    yaml_parser_set_input_file(&parser, fp);
+
+    while (ok && !done) {
+        const char* text = NULL;
+        size_t text_len = 0;
+        const anchored* alias = NULL;
+
+        if (!yaml_parser_parse(&parser, &event)) {
+            ok = 0;
+            break;
+        }
+
+        switch (event.type) {
+        case YAML_STREAM_START_EVENT:
+        case YAML_DOCUMENT_START_EVENT:
+            break;
+
+        case YAML_MAPPING_START_EVENT:
+        case YAML_SEQUENCE_START_EVENT:
+            if (skip)
+                skip++;
+            else if (!in_mapping) {
+                /* make sure it's just a simple dictionary */
+                if (event.type == YAML_MAPPING_START_EVENT)
+                    in_mapping = 1;
+                else
+                    ok = 0;
+            }
+            else if (in_seq || !have_key)
+                ok = 0; /* only scalars allowed */
+            else if (event.type == YAML_SEQUENCE_START_EVENT) {
+                in_seq = 1;
+                nitems = 0;
+                value.len = 0;
+                seq_anchor = event.data.sequence_start.anchor ?
+                    apr_pstrdup(req_pool,
+                                (char*)event.data.sequence_start.anchor) :
+                    NULL;
+            }
+            else
+                skip = 1; /* a mapping: not a section we can use */
+            break;
+
+        case YAML_SEQUENCE_END_EVENT:
+        case YAML_MAPPING_END_EVENT:
+            if (skip) {
+                if (--skip == 0)
+                    have_key = 0;
+            }
+            else if (in_seq) {
+                /* the list items glued together with commas */
+                const char* joined = _buf_copy(&value, pool);
+                key.buf[key.len] = '\0';
+                set_add(sections, key.buf, (void*)joined);
+                if (seq_anchor) {
+                    anchored* a = apr_palloc(req_pool, sizeof(*a));
+                    a->value = joined;
+                    a->is_scalar = 0;
+                    set_add(anchors, seq_anchor, a);
+                }
+                in_seq = have_key = 0;
+            }
+            else
+                done = 1; /* the end of the top level mapping */
+            break;
+
+        case YAML_ALIAS_EVENT:
+            alias = set_get_data(anchors, (char*)event.data.alias.anchor);
+            if (!alias) {
+                ok = 0;
+                break;
+            }
+            text = alias->value;
+            text_len = strlen(text);
+            /* fall through */
+        case YAML_SCALAR_EVENT:
+            if (event.type == YAML_SCALAR_EVENT) {
+                text = (const char*)event.data.scalar.value;
+                text_len = event.data.scalar.length;
+                if (event.data.scalar.anchor) {
+                    anchored* a = apr_palloc(req_pool, sizeof(*a));
+                    a->value = apr_pstrmemdup(req_pool, text, text_len);
+                    a->is_scalar = 1;
+                    set_add(anchors, (char*)event.data.scalar.anchor, a);
                 }
             }
-            /* glue the list items together with commas */
-            set_add(sections, cur_section,
-                    apr_array_pstrcat(pool, working_range, ','));
+            if (skip)
+                break;
+            if (!in_mapping || (alias && !alias->is_scalar &&
+                                (in_seq || !have_key)))
+                ok = 0;
+            else if (in_seq) {
+                /* include it in () because we're going to comma it
+                   together */
+                if (nitems++)
+                    _buf_append(&value, ",", 1);
+                _buf_append(&value, "(", 1);
+                _append_substituted(&value, cluster, text);
+                _buf_append(&value, ")", 1);
+            }
+            else if (!have_key) {
+                /* the WHATEVER in %cluster:WHATEVER */
+                key.len = 0;
+                _buf_append(&key, text, text_len);
+                have_key = 1;
+            }
+            else {
+                /* a scalar is our answer as it is */
+                key.buf[key.len] = '\0';
+                set_add(sections, key.buf,
+                        apr_pstrmemdup(pool, text, text_len));
+                have_key = 0;
+            }
+            break;
+
+        default:
+            /* document or stream end before the mapping: nothing */
+            ok = in_mapping;
+            done = 1;
+            break;
         }
+        yaml_event_delete(&event);
+    }
+    yaml_parser_delete(&parser);
+    fclose(fp);
+
+    if (!ok) {
+        range_request_warn(rr, "%s: malformatted cluster definition %s",
+                           cluster, cluster_file);
+        return set_new(pool, 0);
     }
 
     /* Add a "KEYS" toplevel key that lists all the other keys */
     /* TODO: make an error if somebody tries to specify KEYS manually? */
     set_add(sections, "KEYS", _join_elements(pool, ',', sections));
-    yaml_document_delete(&document);
-    yaml_parser_delete(&parser);
     return sections;
 }
 
+/* parse cluster_file with the lock suspended, so requests for other
+ * clusters go on meanwhile, and put it in the cache. An index build
+ * keeps the lock: see cluster_index_busy */
+static cache_entry* _read_entry(range_request* rr, const char* cluster,
+                                const char* cluster_file, long gen)
+{
+    libcrange* lr = range_request_lr(rr);
+    apr_pool_t* pool = libcrange_pool_new(lr);
+    int suspended = !cluster_index_busy() && libcrange_lock_suspend(lr);
+    set* sections = _cluster_keys(rr, pool, cluster, cluster_file);
+    set* cache;
+    cache_entry* e;
+
+    libcrange_lock_resume(lr, suspended);
+    /* the cache may have been evicted, or the file reloaded */
+    cache = _get_cache(lr, range_request_pool(rr));
+    e = set_get_data(cache, cluster_file);
+    if (e && e->gen >= gen) {
+        libcrange_pool_destroy(lr, pool);
+        return e;
+    }
+    if (!e)
+        e = _new_entry(lr, cache, cluster_file);
+    else
+        libcrange_pool_destroy(lr, e->pool);
+    e->pool = pool;
+    e->sections = sections;
+    e->gen = gen;
+    _account(lr, e);
+    return e;
+}
+
 static range* _expand_cluster(range_request* rr,
                               const char* cluster, const char* section)
 {
-    struct stat st;
+    long gen;
     const char* res;
     libcrange* lr = range_request_lr(rr);
-    set* cache = libcrange_get_cache(lr, "nodescf:cluster_keys");
     apr_pool_t* req_pool = range_request_pool(rr);
-    apr_pool_t* lr_pool = range_request_lr_pool(rr);
 
     const char* cluster_file;
     cache_entry* e;
 
     cluster_file = apr_psprintf(req_pool, "%s/%s.yaml", yaml_path, cluster);
-    if (!cache) {
-        cache = set_new(lr_pool, 0);
-        libcrange_set_cache(lr, "nodescf:cluster_keys", cache);
-    }
 
-    if (stat(cluster_file, &st) == -1) {
+    gen = libcrange_file_generation(lr, cluster_file);
+    cluster_index_depends(lr, cluster_file, gen);
+    if (gen < 0) {
         range_request_warn_type(rr, "NOCLUSTERDEF", cluster);
         return range_new(rr);
     }
     
-    e = set_get_data(cache, cluster_file);
-    if (!e) {
-        e = apr_palloc(lr_pool, sizeof(struct cache_entry));
-        apr_pool_create(&e->pool, lr_pool);
-        e->sections = _cluster_keys(rr, e->pool, cluster, cluster_file);
-        e->mtime = st.st_mtime;
-        set_add(cache, cluster_file, e);
-    }
-    else {
-        time_t cached_mtime = e->mtime;
-        if (cached_mtime != st.st_mtime) {
-            apr_pool_clear(e->pool);
-            e->sections = _cluster_keys(rr, e->pool, cluster, cluster_file);
-            e->mtime = st.st_mtime;
-        } 
+    for (;;) {
+        libcrange_flight* f;
+
+        e = set_get_data(_get_cache(lr, req_pool), cluster_file);
+        if (e && e->gen == gen)
+            break;
+        /* one request parses it, any others for it wait */
+        if ((f = libcrange_flight_begin(lr, cluster_file))) {
+            e = _read_entry(rr, cluster, cluster_file, gen);
+            libcrange_flight_end(lr, f);
+            break;
+        }
     }
 
     res = set_get_data(e->sections, section);
@@ -325,11 +545,221 @@ static range* _expand_cluster(range_request* rr,
     return do_range_expand(rr, res);
 }
 
+/* called from the watcher thread when something under yaml_path
+ * changes: parse the new file without the lock, then swap it in */
+static void _reload_cluster(libcrange* lr, const char* path, void* data)
+{
+    long gen;
+    set* cache;
+    set* sections = NULL;
+    cache_entry* e;
+    apr_pool_t* pool = NULL;
+    apr_pool_t* old_pool;
+    const char* base = strrchr(path, '/');
+    size_t len = strlen(path);
+    char* cluster;
+
+    if (len < 5 || strcmp(path + len - 5, ".yaml") != 0)
+        return;
+
+    libcrange_lock(lr);
+    cache = libcrange_get_cache(lr, CACHE_NAME);
+    e = cache ? set_get_data(cache, path) : NULL;
+    libcrange_unlock(lr);
+    if (!e)
+        return; /* not loaded yet: it'll be read on first use */
+
+    if (access(path, R_OK) == 0) {
+        pool = libcrange_pool_new(lr);
+        base = base ? base + 1 : path;
+        cluster = apr_pstrndup(pool, base, strlen(base) - 5);
+        sections = _cluster_keys(range_request_new(lr, pool), pool,
+                                 cluster, path);
+    }
+
+    libcrange_lock(lr);
+    gen = libcrange_file_refresh(lr, path);
+    /* the cache may have been cleared or evicted while we parsed */
+    cache = libcrange_get_cache(lr, CACHE_NAME);
+    if (!cache || !(e = set_get_data(cache, path))) {
+        libcrange_unlock(lr);
+        if (pool)
+            libcrange_pool_destroy(lr, pool);
+        return;
+    }
+    old_pool = e->pool;
+    if (sections && gen >= 0) {
+        e->pool = pool;
+        e->sections = sections;
+        e->gen = gen;
+        _account(lr, e);
+    }
+    else {
+        _remove_entry(lr, cache, path);
+        if (pool) /* gone again while we parsed it */
+            libcrange_pool_destroy(lr, pool);
+    }
+    libcrange_unlock(lr);
+
+    libcrange_pool_destroy(lr, old_pool);
+}
+
+static const cluster_source source = {
+    "yamlfile", "CLUSTER", _all_clusters, _expand_cluster
+};
+
+/* warm start: the parsed cluster files, each depending on its file,
+ * and the host index */
+void snapshot_save(libcrange* lr, range_snapshot* s)
+{
+    set_iter it;
+    set_element* file;
+    set* cache = libcrange_get_cache(lr, CACHE_NAME);
+
+    cluster_index_snapshot_save(lr, &source, s);
+    if (!cache)
+        return;
+    for (set_iter_init(&it, cache); (file = set_iter_next(&it)); ) {
+        cache_entry* e = file->data;
+        set_iter sit;
+        set_element* section;
+
+        range_snapshot_entry(s, file->name);
+        range_snapshot_depends(s, file->name);
+        for (set_iter_init(&sit, e->sections);
+             (section = set_iter_next(&sit)); )
+            range_snapshot_put(s, section->name, section->data);
+    }
+}
+
+void snapshot_load(libcrange* lr, range_snapshot* s)
+{
+    const char* cluster_file;
+    const char* name;
+    const char* value;
+    set* cache;
+
+    if (!lr->want_caching)
+        return;
+    cache = _get_cache(lr, NULL);
+    while (range_snapshot_next_entry(s, &cluster_file)) {
+        cache_entry* e;
+        long gen;
+
+        if (cluster_index_snapshot_entry(lr, &source, s, cluster_file))
+            continue;
+        gen = libcrange_file_generation(lr, cluster_file);
+        if (gen < 0 || set_get_data(cache, cluster_file))
+            continue;
+        e = _new_entry(lr, cache, cluster_file);
+        e->pool = libcrange_pool_new(lr);
+        e->sections = set_new(e->pool, 0);
+        e->gen = gen;
+        /* names and values stay in the mapped snapshot */
+        while (range_snapshot_get(s, &name, &value))
+            set_add_nocopy(e->sections, name, (void*)value);
+        _account(lr, e);
+    }
+}
+
+/* cold start: parse every cluster file up front, in parallel */
+typedef struct preload_task
+{
+    libcrange* lr;
+    int n;
+    const char** clusters;
+    const char** files;
+    long* gens;
+    cache_entry* entries;
+} preload_task;
+
+static void _preload_one(void* data, int task, apr_pool_t* pool)
+{
+    preload_task* p = data;
+    cache_entry* e = &p->entries[task];
+    apr_pool_t* tmp;
+
+    /* like a reload: the entry gets a pool of its own, the parser's
+     * scratch space and warnings go away with tmp */
+    apr_pool_create(&tmp, pool);
+    e->pool = libcrange_pool_new(p->lr);
+    e->gen = p->gens[task];
+    e->sections = _cluster_keys(range_request_new(p->lr, tmp), e->pool,
+                                p->clusters[task], p->files[task]);
+    apr_pool_destroy(tmp);
+}
+
+void preload(libcrange* lr, int nthreads)
+{
+    apr_pool_t* pool;
+    range_request* rr;
+    const char** clusters;
+    preload_task p;
+    set* cache;
+    int i, n;
+
+    if (!lr->want_caching)
+        return; /* nowhere to keep them */
+    pool = libcrange_pool_new(lr);
+    rr = range_request_new(lr, pool);
+    libcrange_lock(lr);
+    cache = _get_cache(lr, pool);
+    clusters = cluster_index_all(rr, &source);
+    for (n = 0; clusters && clusters[n]; n++)
+        ;
+    p.lr = lr;
+    p.n = 0;
+    p.clusters = apr_palloc(pool, sizeof(char*) * (n + 1));
+    p.files = apr_palloc(pool, sizeof(char*) * (n + 1));
+    p.gens = apr_palloc(pool, sizeof(long) * (n + 1));
+    p.entries = apr_palloc(pool, sizeof(cache_entry) * (n + 1));
+    for (i = 0; i < n; i++) {
+        const char* file = apr_psprintf(pool, "%s/%s.yaml", yaml_path,
+                                        clusters[i]);
+        /* the generation before parsing: if the file changes under us
+         * the next lookup parses it again */
+        long gen = libcrange_file_generation(lr, file);
+        cache_entry* e = set_get_data(cache, file);
+        if (gen < 0 || (e && e->gen == gen))
+            continue;
+        p.clusters[p.n] = apr_pstrdup(pool, clusters[i]);
+        p.files[p.n] = file;
+        p.gens[p.n++] = gen;
+    }
+    libcrange_unlock(lr);
+
+    libcrange_parallel(pool, nthreads, p.n, _preload_one, &p);
+
+    libcrange_lock(lr);
+    /* in case it was cleared meanwhile */
+    cache = _get_cache(lr, pool);
+    for (i = 0; i < p.n; i++) {
+        cache_entry* e = set_get_data(cache, p.files[i]);
+        if (e && e->gen >= p.entries[i].gen) {
+            /* somebody got there first */
+            libcrange_pool_destroy(lr, p.entries[i].pool);
+            continue;
+        }
+        if (!e)
+            e = _new_entry(lr, cache, p.files[i]);
+        else
+            libcrange_pool_destroy(lr, e->pool);
+        e->gen = p.entries[i].gen;
+        e->pool = p.entries[i].pool;
+        e->sections = p.entries[i].sections;
+        _account(lr, e);
+    }
+    libcrange_unlock(lr);
+
+    libcrange_pool_destroy(lr, pool);
+}
+
 /* get a list of all clusters */
 static const char** _all_clusters(range_request* rr)
 {
     DIR* dir;
     struct dirent* dir_entry;
+    libcrange* lr = range_request_lr(rr);
     apr_pool_t* pool = range_request_pool(rr);
     set* res = set_new(pool, 0);
     char nodes_cf_buf[8192];
@@ -338,6 +768,10 @@ static const char** _all_clusters(range_request* rr)
     char *cname;
     int i, n;
 
+    /* files coming and going change the directory */
+    cluster_index_depends(lr, yaml_path,
+                          libcrange_file_generation(lr, yaml_path));
+
     /* check in the cluster dir, by default /etc/range */
     dir = opendir(yaml_path);
     if (!dir) {
@@ -383,7 +817,7 @@ range* rangefunc_allclusters(range_request* rr, range** r)
 {
     range* ret = range_new(rr);
 
-    const char** all_clusters = _all_clusters(rr);
+    const char** all_clusters = cluster_index_all(rr, &source);
     const char** cluster = all_clusters;
     int warn_enabled = range_request_warn_enabled(rr);
 
@@ -405,30 +839,19 @@ range* rangefunc_has(range_request* rr, range** r)
     if (!validate_range_args(rr, r, 2)) {
         return ret;
     }
-
     apr_pool_t* pool = range_request_pool(rr);
-
     const char** tag_names = range_get_hostnames(pool, r[0]);
     const char** tag_values = range_get_hostnames(pool, r[1]);
 
     const char* tag_name = tag_names[0];
     const char* tag_value = tag_values[0];
 
-    const char** all_clusters = _all_clusters(rr);
-    const char** cluster = all_clusters;
-    int warn_enabled = range_request_warn_enabled(rr);
-
-    if (!cluster) return ret;
+    const apr_array_header_t* clusters =
+        cluster_index_lookup(rr, &source, tag_name, tag_value);
+    int i;
 
-    range_request_disable_warns(rr);
-    while (*cluster) {
-        range* vals = _expand_cluster(rr, *cluster, tag_name);
-        if (set_get(vals->nodes, tag_value) != NULL) {
-            range_add(ret, *cluster);
-        }
-        cluster++;
-    }
-    if (warn_enabled) range_request_enable_warns(rr);
+    for (i = 0; clusters && i < clusters->nelts; ++i)
+        range_add(ret, ((const char**)clusters->elts)[i]);
 
     return ret;
 }
@@ -445,23 +868,14 @@ range* rangefunc_mem(range_request* rr, range** r)
     const char** clusters = range_get_hostnames(pool, r[0]);
     const char* cluster = clusters[0];
     const char** wanted = range_get_hostnames(pool, r[1]);
-    
-    range* keys = _expand_cluster(rr, cluster, "KEYS");
-    const char** all_sections = range_get_hostnames(pool, keys);
-    const char** p_section = all_sections;
-
-  SECTION:
-    while (*p_section) {
-        range* r_s = _expand_cluster(rr, cluster, *p_section);
-        const char** p_wanted = wanted;
-        while (*p_wanted) {
-            if (set_get(r_s->nodes, *p_wanted) != NULL) {
-                range_add(ret, *p_section++);
-                goto SECTION;
-            }
-            ++p_wanted;
-        }
-        ++p_section;
+
+    while (*wanted) {
+        const apr_array_header_t* sections =
+            cluster_index_sections(rr, &source, cluster, *wanted);
+        int i;
+        for (i = 0; sections && i < sections->nelts; ++i)
+            range_add(ret, ((const char**)sections->elts)[i]);
+        ++wanted;
     }
 
     return ret;
@@ -512,52 +926,19 @@ range* rangefunc_cluster(range_request* rr, range** r)
     return ret;
 }
 
-static set* _get_clusters(range_request* rr)
-{
-    const char** all_clusters = _all_clusters(rr);
-    const char** p_cl = all_clusters;
-    apr_pool_t* pool = range_request_pool(rr);
-    set* node_cluster = set_new(pool, 40000);
-    
-    if(p_cl == NULL) {
-        return node_cluster;
-    }
-    
-    while (*p_cl) {
-        range* nodes_r = _expand_cluster(rr, *p_cl, "CLUSTER");
-        const char** nodes = range_get_hostnames(pool, nodes_r);
-        const char** p_nodes = nodes;
-
-        while (*p_nodes) {
-            apr_array_header_t* clusters = set_get_data(node_cluster, *p_nodes);
-
-            if (!clusters) {
-                clusters = apr_array_make(pool, 1, sizeof(char*));
-                set_add(node_cluster, *p_nodes, clusters);
-            }
-
-            *(const char**)apr_array_push(clusters) = *p_cl;
-            ++p_nodes;
-        }
-        ++p_cl;
-    }
-
-    return node_cluster;
-}
-
 range* rangefunc_get_cluster(range_request* rr, range** r)
 {
     range* ret = range_new(rr);
     if (!validate_range_args(rr, r, 1)) {
         return ret;
     }
-    apr_pool_t* pool = range_request_lr_pool(rr);
+    apr_pool_t* pool = range_request_pool(rr);
     const char** nodes = range_get_hostnames(pool, r[0]);
     const char** p_nodes = nodes;
-    set* node_cluster = _get_clusters(rr);
-    
+
     while (*p_nodes) {
-        apr_array_header_t* clusters = set_get_data(node_cluster, *p_nodes);
+        const apr_array_header_t* clusters =
+            cluster_index_lookup(rr, &source, source.section, *p_nodes);
         if (!clusters)
             range_request_warn_type(rr, "NO_CLUSTER", *p_nodes);
         else {
@@ -581,10 +962,10 @@ range* rangefunc_clusters(range_request* rr, range** r)
     apr_pool_t* pool = range_request_pool(rr);
     const char** nodes = range_get_hostnames(pool, r[0]);
     const char** p_nodes = nodes;
-    set* node_cluster = _get_clusters(rr);
-    
+
     while (*p_nodes) {
-        apr_array_header_t* clusters = set_get_data(node_cluster, *p_nodes);
+        const apr_array_header_t* clusters =
+            cluster_index_lookup(rr, &source, source.section, *p_nodes);
         if (!clusters)
             range_request_warn_type(rr, "NO_CLUSTER", *p_nodes);
         else {
@@ -624,30 +1005,9 @@ range* rangefunc_get_groups(range_request* rr, range** r)
     apr_pool_t* pool = range_request_pool(rr);
     const char** in_nodes = range_get_hostnames(pool, n);
 
-    set* node_group = set_new(pool, 40000);
-    range* groups_r = _expand_cluster(rr, "GROUPS", "KEYS");
-    const char** groups = range_get_hostnames(pool, groups_r);
-    const char** p_group = groups;
-
-    while (*p_group) {
-        range* nodes_r = _expand_cluster(rr, "GROUPS", *p_group);
-        const char** nodes = range_get_hostnames(pool, nodes_r);
-        const char** p_nodes = nodes;
-
-        while (*p_nodes) {
-            apr_array_header_t* my_groups = set_get_data(node_group, *p_nodes);
-            if (!my_groups) {
-                my_groups = apr_array_make(pool, 4, sizeof(char*));
-                set_add(node_group, *p_nodes, my_groups);
-            }
-            *(const char**)apr_array_push(my_groups) = *p_group;
-            ++p_nodes;
-        }
-        ++p_group;
-    }
-
     while (*in_nodes) {
-        apr_array_header_t* my_groups = set_get_data(node_group, *in_nodes);
+        const apr_array_header_t* my_groups =
+            cluster_index_sections(rr, &source, "GROUPS", *in_nodes);
         if (!my_groups) 
             range_request_warn_type(rr, "NO_GROUPS", *in_nodes);
         else {
@@ -660,3 +1020,23 @@ range* rangefunc_get_groups(range_request* rr, range** r)
 
     return ret;
 }
+
+#define CLUSTER_DATA (RANGE_FUNC_PURE | RANGE_FUNC_CACHEABLE | RANGE_FUNC_READS_FILES)
+
+static const range_function_desc functions[] = {
+    { "mem", rangefunc_mem, 2, CLUSTER_DATA },
+    { "cluster", rangefunc_cluster, 1, CLUSTER_DATA },
+    { "clusters", rangefunc_clusters, 1, CLUSTER_DATA },
+    { "group", rangefunc_group, 1, CLUSTER_DATA },
+    { "get_cluster", rangefunc_get_cluster, 1, CLUSTER_DATA },
+    { "get_groups", rangefunc_get_groups, 1, CLUSTER_DATA },
+    { "has", rangefunc_has, 2, CLUSTER_DATA },
+    { "allclusters", rangefunc_allclusters, 0, CLUSTER_DATA },
+    { NULL }
+};
+
+const range_module_desc range_module = {
+    LIBCRANGE_MODULE_ABI, "yamlfile", functions,
+    _init, NULL, _depends,
+    preload, snapshot_save, snapshot_load
+};
@@ -7,10 +7,43 @@
 #include "tinydns_ip.h"
 #include "hosts-netblocks.h"
 
-const char** functions_provided(libcrange* lr)
+static void _reload_ip_data(libcrange* lr, const char* path, void* data)
 {
-    static const char* functions[] = {"vlan", "dc", "hosts_v", "hosts_dc", "vlans_dc", 0};
-    return functions;
+    hosts_netblocks_reload(lr);
+}
+
+void snapshot_save(libcrange* lr, range_snapshot* s)
+{
+    tinydns_snapshot_save(lr, s);
+}
+
+/* the netblock tables are small and the host caches are rebuilt from
+ * the tinydns data on first use, so only that is kept */
+void snapshot_load(libcrange* lr, range_snapshot* s)
+{
+    tinydns_snapshot_load(lr, s);
+}
+
+/* the tinydns data and the netblocks */
+static const char* data_files[3];
+
+static int _init(libcrange* lr)
+{
+    const char* dns_file = libcrange_getcfg(lr, "dns_data_file");
+    const char* yst_ip_list = libcrange_getcfg(lr, "yst_ip_list");
+
+    data_files[0] = dns_file ? dns_file : DNS_FILE;
+    data_files[1] = yst_ip_list ? yst_ip_list : YST_IP_LIST;
+    tinydns_init();
+    netblock_init();
+    libcrange_watch(lr, data_files[0], _reload_ip_data, NULL);
+    libcrange_watch(lr, data_files[1], _reload_ip_data, NULL);
+    return 0;
+}
+
+static const char** _depends(libcrange* lr)
+{
+    return data_files;
 }
 
 range* rangefunc_vlans_dc(range_request* rr, range** r)
@@ -115,3 +148,20 @@ range* rangefunc_dc(range_request* rr, range **r)
 
     return ret;
 }
+
+#define IP_DATA (RANGE_FUNC_PURE | RANGE_FUNC_CACHEABLE | RANGE_FUNC_READS_FILES)
+
+static const range_function_desc functions[] = {
+    { "vlan", rangefunc_vlan, 1, IP_DATA },
+    { "dc", rangefunc_dc, 1, IP_DATA },
+    { "hosts_v", rangefunc_hosts_v, 1, IP_DATA },
+    { "hosts_dc", rangefunc_hosts_dc, 1, IP_DATA },
+    { "vlans_dc", rangefunc_vlans_dc, 1, IP_DATA },
+    { NULL }
+};
+
+const range_module_desc range_module = {
+    LIBCRANGE_MODULE_ABI, "yst-ip-list", functions,
+    _init, NULL, _depends,
+    NULL, snapshot_save, snapshot_load
+};
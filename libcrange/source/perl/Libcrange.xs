@@ -16,13 +16,21 @@ static void expand(long ptr, const char* range)
 {
  dXSARGS;
  range_request* rr = (range_request*) ptr;
- const char** nodes;
+ range_node_iter it;
+ const char* name;
+ size_t len;
+ int quoted;
 
  sp = mark;
  rr = range_expand_rr(rr, range);
- nodes = range_request_nodes(rr);
- while (*nodes)
-   XPUSHs(sv_2mortal(newSVpv(*nodes++, 0)));
+ quoted = range_request_is_quoted(rr);
+ EXTEND(sp, range_request_node_count(rr));
+ range_request_iter(rr, &it);
+ while (range_node_iter_next(&it, &name, &len))
+   if (quoted)
+     PUSHs(sv_2mortal(newSVpvf("\"%s\"", name)));
+   else
+     PUSHs(sv_2mortal(newSVpvn(name, len)));
 
  PUTBACK;
 }
@@ -19,6 +19,22 @@ rangeast* range_ast_new(apr_pool_t* pool, rangetype type)
     return r;
 }
 
+/* evaluate the operands of a {} expression without expanding it */
+static range_product* evaluate_product(range_request* rr, const rangeast* ast)
+{
+    range* left = range_evaluate(rr, ast->children);
+    range* center = range_evaluate(rr, ast->children->next);
+    range* right = range_evaluate(rr, ast->children->next->next);
+    return range_product_new(rr, left, center, right);
+}
+
+static void destroy_product(range_product* p)
+{
+    range_destroy((range*)p->left);
+    range_destroy((range*)p->center);
+    range_destroy((range*)p->right);
+}
+
 range* range_evaluate(range_request* rr, const rangeast* ast)
 {
     range* r;
@@ -28,6 +44,7 @@ range* range_evaluate(range_request* rr, const rangeast* ast)
     range* r1;
     range* r2;
     range* r3;
+    range_product* p;
     apr_pool_t* pool = range_request_pool(rr);
     
     switch (ast->type) {
@@ -56,6 +73,12 @@ range* range_evaluate(range_request* rr, const rangeast* ast)
             return r;
         case AST_DIFF:
             r1 = range_evaluate(rr, ast->children);
+            if (ast->children->next->type == AST_BRACES) {
+                p = evaluate_product(rr, ast->children->next);
+                range_diff_product_inplace(rr, r1, p);
+                destroy_product(p);
+                return r1;
+            }
             if (ast->children->next->type == AST_REGEX) 
                 r2 = range_from_match(rr, r1, ast->children->next->data.string);
             else
@@ -63,7 +86,23 @@ range* range_evaluate(range_request* rr, const rangeast* ast)
             range_diff_inplace(rr, r1, r2);
             return r1;
         case AST_INTER:
+            if (ast->children->type == AST_BRACES &&
+                ast->children->next->type != AST_REGEX) {
+                p = evaluate_product(rr, ast->children);
+                r2 = range_evaluate(rr, ast->children->next);
+                r = range_inter_product(rr, r2, p);
+                destroy_product(p);
+                range_destroy(r2);
+                return r;
+            }
             r1 = range_evaluate(rr, ast->children);
+            if (ast->children->next->type == AST_BRACES) {
+                p = evaluate_product(rr, ast->children->next);
+                r = range_inter_product(rr, r1, p);
+                destroy_product(p);
+                range_destroy(r1);
+                return r;
+            }
             if (ast->children->next->type == AST_REGEX)
                 r2 = range_from_match(rr, r1, ast->children->next->data.string);
             else
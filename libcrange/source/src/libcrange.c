@@ -6,13 +6,23 @@ Copyrights licensed under the New BSD License. See the accompanying LICENSE file
 #include <assert.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <dlfcn.h>
 #include <pcre.h>
 #include <errno.h>
+#include <sys/stat.h>
 #include <apr_pools.h>
 #include <apr_strings.h>
+#include <apr_tables.h>
+#include <apr_allocator.h>
+#if APR_HAS_THREADS
+#include <apr_portable.h>
+#include <apr_thread_cond.h>
+#include <apr_thread_mutex.h>
+#include <apr_thread_proc.h>
+#endif
 
 #include "libcrange.h"
 #include "range.h"
@@ -24,19 +34,57 @@ libcrange* static_lr = NULL;
 static int initd = 0;
 
 static int parse_config_file(libcrange* lr);
+
+/* what lr->caches holds for each name */
+typedef struct cache_slot {
+    void* data;
+    apr_pool_t* pool;       /* from libcrange_cache_pool, or NULL */
+    size_t bytes;
+    unsigned long used;     /* lr->cache_clock when last looked up */
+} cache_slot;
+
+#define CACHE_POOL_MAX_FREE (256 * 1024)
+
+/* what lr->functions holds for each name */
+typedef struct function_slot {
+    const range_function_desc* desc;
+    const range_module_desc* module;
+    int dirs;   /* some of the module's depends are directories */
+} function_slot;
+
+/* bytes, with an optional k, m or g */
+static size_t parse_size(const char* cfg)
+{
+    char* end;
+    double n = strtod(cfg, &end);
+
+    switch (*end) {
+    case 'g': case 'G': n *= 1024;
+    case 'm': case 'M': n *= 1024;
+    case 'k': case 'K': n *= 1024;
+    }
+    return n > 0 ? (size_t)n : 0;
+}
 libcrange* libcrange_new(apr_pool_t* pool, const char* config_file)
 {
     libcrange* lr;
+    const char* cfg;
 
     if (!initd) {
         initd = 1;
         apr_initialize();
         atexit(apr_terminate);
+        range_init();
     }
 
     lr = apr_palloc(pool, sizeof(libcrange));
     lr->pool = pool;
-    lr->caches = set_new(pool, 0);
+    apr_pool_create(&lr->cache_pool, pool);
+    lr->caches = set_new(lr->cache_pool, 0);
+    lr->cache_bytes = 0;
+    lr->cache_limit = 0;
+    lr->cache_clock = 0;
+    lr->lock_depth = 0;
     lr->default_domain = NULL;
     lr->funcdir = LIBCRANGE_FUNCDIR;
     lr->want_caching = 1;
@@ -44,6 +92,19 @@ libcrange* libcrange_new(apr_pool_t* pool, const char* config_file)
     lr->functions = set_new(pool, 0);
     lr->perl_functions = NULL;
     lr->vars = set_new(pool, 0);
+    lr->modules = set_new(pool, 0);
+    lr->lock = NULL;
+    lr->watch = NULL;
+    lr->flights = NULL;
+    lr->flight_mutex = NULL;
+    lr->flight_cond = NULL;
+#if APR_HAS_THREADS
+    apr_thread_mutex_create(&lr->lock, APR_THREAD_MUTEX_NESTED, pool);
+    if (apr_thread_mutex_create(&lr->flight_mutex, APR_THREAD_MUTEX_DEFAULT,
+                                pool) != APR_SUCCESS ||
+        apr_thread_cond_create(&lr->flight_cond, pool) != APR_SUCCESS)
+        lr->flight_cond = NULL;
+#endif
 
     if (access(lr->config_file, R_OK) != 0)
         return lr; /* no config file, don't load any modules */
@@ -51,6 +112,12 @@ libcrange* libcrange_new(apr_pool_t* pool, const char* config_file)
     if (parse_config_file(lr) < 0)
         return NULL;
 
+    if ((cfg = libcrange_getcfg(lr, "cache_memory_limit")))
+        lr->cache_limit = parse_size(cfg);
+
+    if ((cfg = libcrange_getcfg(lr, "preload")) && atoi(cfg) > 0)
+        libcrange_preload(lr);
+
     return lr;
 }
 
@@ -114,37 +181,119 @@ const char* libcrange_get_perl_module(libcrange* lr, const char* funcname)
 
 void* libcrange_get_function(libcrange* lr, const char* funcname)
 {
-    set* functions;
+    const range_function_desc* f = libcrange_get_function_desc(lr, funcname);
+    return f ? *(void**)(&f->fn) : NULL;
+}
+
+const range_function_desc* libcrange_get_function_desc(libcrange* lr,
+                                                       const char* funcname)
+{
+    function_slot* f;
     assert(lr);
     assert(funcname);
 
-    functions = lr->functions;
-    return set_get_data(functions, funcname);
+    f = set_get_data(lr->functions, funcname);
+    return f ? f->desc : NULL;
+}
+
+const char** libcrange_function_depends(libcrange* lr, const char* funcname)
+{
+    function_slot* f;
+    assert(lr);
+    assert(funcname);
+
+    f = set_get_data(lr->functions, funcname);
+    if (!f || !f->module->depends)
+        return NULL;
+    return (*f->module->depends)(lr);
+}
+
+const char* libcrange_function_generation(libcrange* lr, apr_pool_t* pool,
+                                          const char* funcname)
+{
+    function_slot* f;
+    const char** files;
+    char* gen = NULL;
+    assert(lr);
+    assert(funcname);
+
+    f = set_get_data(lr->functions, funcname);
+    if (!f || !f->module->depends || !(files = (*f->module->depends)(lr)))
+        return NULL;
+    if (f->dirs)
+        return apr_psprintf(pool, "v%ld", libcrange_data_version(lr));
+    for (; *files; files++)
+        gen = apr_psprintf(pool, "%s%s%ld", gen ? gen : "", gen ? "." : "",
+                           libcrange_file_generation(lr, *files));
+    return gen ? gen : "";
+}
+
+const range_module_desc* libcrange_get_module(libcrange* lr,
+                                              const char* module)
+{
+    if (lr == NULL) lr = get_static_lr();
+    return set_get_data(lr->modules, module);
 }
 
 
 void* libcrange_get_cache(libcrange* lr, const char* name)
 {
-    set_element* se;
+    cache_slot* slot;
     if (lr == NULL) lr = get_static_lr();
 
-    if ((se = set_get(lr->caches, name)))
-        return se->data;
+    if ((slot = set_get_data(lr->caches, name))) {
+        slot->used = ++lr->cache_clock;
+        return slot->data;
+    }
     else
         return NULL;
 }
 
+/* the cache pools go with their caches, and with them everything the
+ * modules kept there */
 void libcrange_clear_caches(libcrange* lr)
 {
     if (lr == NULL) lr = get_static_lr();
-    lr->caches = set_new(lr->pool, 317);
+    libcrange_lock(lr);
+    apr_pool_destroy(lr->cache_pool);
+    apr_pool_create(&lr->cache_pool, lr->pool);
+    lr->caches = set_new(lr->cache_pool, 317);
+    lr->cache_bytes = 0;
+    libcrange_unlock(lr);
+}
+
+void libcrange_clear_cache(libcrange* lr, const char* name)
+{
+    cache_slot* slot;
+
+    if (lr == NULL) lr = get_static_lr();
+    libcrange_lock(lr);
+    if ((slot = set_get_data(lr->caches, name))) {
+        if (slot->pool)
+            apr_pool_destroy(slot->pool);
+        lr->cache_bytes -= slot->bytes;
+        set_remove(lr->caches, name);
+    }
+    libcrange_unlock(lr);
+}
+
+static cache_slot* get_slot(libcrange* lr, const char* name)
+{
+    cache_slot* slot = set_get_data(lr->caches, name);
+
+    if (!slot) {
+        slot = apr_pcalloc(lr->cache_pool, sizeof(*slot));
+        set_add(lr->caches, name, slot);
+    }
+    slot->used = ++lr->cache_clock;
+    return slot;
 }
 
 void libcrange_set_cache(libcrange* lr, const char* name, void* data)
 {
     if (lr == NULL) lr = get_static_lr();
     if (lr->want_caching)
-        set_add(lr->caches, name, data);
+        get_slot(lr, name)->data = data;
 }
 
 const char* range_compress(libcrange* lr, apr_pool_t* p, const char** nodes)
@@ -168,6 +317,7 @@ range_request* range_expand(libcrange* lr, apr_pool_t* pool, const char* text)
     if (lr == NULL) lr = get_static_lr();
     assert(lr);
 
+    libcrange_trim_caches(lr);
     rr = range_request_new(lr, pool);
     do_range_expand(rr, text);
 
@@ -181,6 +331,440 @@ range_request* range_expand_rr(range_request* rr, const char* text)
     return rr;
 }
 
+void libcrange_lock(libcrange* lr)
+{
+#if APR_HAS_THREADS
+    if (lr->lock)
+        apr_thread_mutex_lock(lr->lock);
+#endif
+    lr->lock_depth++;
+}
+
+void libcrange_unlock(libcrange* lr)
+{
+    lr->lock_depth--;
+#if APR_HAS_THREADS
+    if (lr->lock)
+        apr_thread_mutex_unlock(lr->lock);
+#endif
+}
+
+int libcrange_lock_suspend(libcrange* lr)
+{
+    if (lr == NULL) lr = get_static_lr();
+    /* nested, somebody further up may be holding on to cached data */
+    if (lr->lock_depth != 1)
+        return 0;
+    libcrange_unlock(lr);
+    return 1;
+}
+
+void libcrange_lock_resume(libcrange* lr, int suspended)
+{
+    if (lr == NULL) lr = get_static_lr();
+    if (suspended)
+        libcrange_lock(lr);
+}
+
+/* on lr->flights while key is being loaded; freed by whoever is last
+ * out, the loader or its last waiter */
+struct libcrange_flight {
+    struct libcrange_flight* next;
+    int waiters;
+    int done;               /* under flight_mutex */
+#if APR_HAS_THREADS
+    apr_os_thread_t owner;
+#endif
+    char key[1];
+};
+
+/* out of memory: load without telling anybody */
+static libcrange_flight unlisted;
+
+libcrange_flight* libcrange_flight_begin(libcrange* lr, const char* key)
+{
+    libcrange_flight* f;
+    size_t len = strlen(key);
+
+    if (lr == NULL) lr = get_static_lr();
+    for (f = lr->flights; f; f = f->next)
+        if (strcmp(f->key, key) == 0)
+            break;
+
+#if APR_HAS_THREADS
+    /* waiting on ourselves would be forever */
+    if (f && lr->flight_cond && lr->lock_depth == 1 &&
+        !apr_os_thread_equal(f->owner, apr_os_thread_current())) {
+        f->waiters++;
+        libcrange_unlock(lr);
+        apr_thread_mutex_lock(lr->flight_mutex);
+        while (!f->done)
+            apr_thread_cond_wait(lr->flight_cond, lr->flight_mutex);
+        apr_thread_mutex_unlock(lr->flight_mutex);
+        libcrange_lock(lr);
+        if (--f->waiters == 0)
+            free(f);
+        return NULL;
+    }
+#endif
+
+    if (!(f = malloc(sizeof(*f) + len)))
+        return &unlisted;
+    f->waiters = 0;
+    f->done = 0;
+#if APR_HAS_THREADS
+    f->owner = apr_os_thread_current();
+#endif
+    memcpy(f->key, key, len + 1);
+    f->next = lr->flights;
+    lr->flights = f;
+    return f;
+}
+
+void libcrange_flight_end(libcrange* lr, libcrange_flight* f)
+{
+    libcrange_flight** p;
+
+    if (lr == NULL) lr = get_static_lr();
+    if (f == &unlisted)
+        return;
+    for (p = &lr->flights; *p != f; p = &(*p)->next)
+        ;
+    *p = f->next;
+    if (!f->waiters) {
+        free(f);
+        return;
+    }
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(lr->flight_mutex);
+    f->done = 1;
+    apr_thread_cond_broadcast(lr->flight_cond);
+    apr_thread_mutex_unlock(lr->flight_mutex);
+#endif
+}
+
+/* a child of parent with its own allocator, so the thread that owns it
+ * never contends with anybody else's allocations */
+static apr_pool_t* private_pool_new(apr_pool_t* parent)
+{
+    apr_allocator_t* allocator;
+    apr_pool_t* pool;
+
+    if (apr_allocator_create(&allocator) != APR_SUCCESS)
+        return NULL;
+    if (apr_pool_create_ex(&pool, parent, NULL, allocator) != APR_SUCCESS) {
+        apr_allocator_destroy(allocator);
+        return NULL;
+    }
+    apr_allocator_owner_set(allocator, pool);
+    return pool;
+}
+
+apr_pool_t* libcrange_pool_new(libcrange* lr)
+{
+    apr_pool_t* pool;
+
+    if (lr == NULL) lr = get_static_lr();
+    libcrange_lock(lr);
+    pool = private_pool_new(lr->pool);
+    libcrange_unlock(lr);
+    return pool;
+}
+
+void libcrange_pool_destroy(libcrange* lr, apr_pool_t* pool)
+{
+    if (lr == NULL) lr = get_static_lr();
+    libcrange_lock(lr);
+    apr_pool_destroy(pool);
+    libcrange_unlock(lr);
+}
+
+apr_pool_t* libcrange_cache_pool(libcrange* lr, const char* name)
+{
+    cache_slot* slot;
+    apr_pool_t* pool;
+
+    if (lr == NULL) lr = get_static_lr();
+    /* nothing is kept, so no slot and no pool to keep it in */
+    if (!lr->want_caching)
+        return NULL;
+    libcrange_lock(lr);
+    slot = get_slot(lr, name);
+    if (!slot->pool && (slot->pool = private_pool_new(lr->cache_pool)))
+        apr_allocator_max_free_set(apr_pool_allocator_get(slot->pool),
+                                   CACHE_POOL_MAX_FREE);
+    pool = slot->pool;
+    libcrange_unlock(lr);
+    return pool;
+}
+
+void libcrange_cache_charge(libcrange* lr, const char* name, long bytes)
+{
+    cache_slot* slot;
+
+    if (lr == NULL) lr = get_static_lr();
+    libcrange_lock(lr);
+    if ((slot = set_get_data(lr->caches, name))) {
+        /* never below zero, whatever the module's arithmetic */
+        if (bytes < 0 && (size_t)-bytes > slot->bytes)
+            bytes = -(long)slot->bytes;
+        slot->bytes += bytes;
+        lr->cache_bytes += bytes;
+    }
+    libcrange_unlock(lr);
+}
+
+size_t libcrange_cache_usage(libcrange* lr, const char* name)
+{
+    cache_slot* slot;
+    size_t bytes;
+
+    if (lr == NULL) lr = get_static_lr();
+    libcrange_lock(lr);
+    if (!name)
+        bytes = lr->cache_bytes;
+    else
+        bytes = (slot = set_get_data(lr->caches, name)) ? slot->bytes : 0;
+    libcrange_unlock(lr);
+    return bytes;
+}
+
+const char** libcrange_cache_names(libcrange* lr, apr_pool_t* pool)
+{
+    set_iter it;
+    set_element* e;
+    const char** names;
+    int n = 0;
+
+    if (lr == NULL) lr = get_static_lr();
+    libcrange_lock(lr);
+    names = apr_palloc(pool, sizeof(char*) * (lr->caches->members + 1));
+    for (set_iter_init(&it, lr->caches); (e = set_iter_next(&it)); )
+        names[n++] = apr_pstrdup(pool, e->name);
+    names[n] = NULL;
+    libcrange_unlock(lr);
+    return names;
+}
+
+void libcrange_trim_caches(libcrange* lr)
+{
+    if (lr == NULL) lr = get_static_lr();
+    libcrange_lock(lr);
+    /* nested in a module call, its data may be in use */
+    while (lr->lock_depth == 1 && lr->cache_limit &&
+           lr->cache_bytes > lr->cache_limit) {
+        set_iter it;
+        set_element* e;
+        set_element* victim = NULL;
+
+        for (set_iter_init(&it, lr->caches); (e = set_iter_next(&it)); ) {
+            cache_slot* slot = e->data;
+            if (slot->pool && slot->bytes &&
+                (!victim || slot->used < ((cache_slot*)victim->data)->used))
+                victim = e;
+        }
+        if (!victim)
+            break;
+        libcrange_clear_cache(lr, victim->name);
+    }
+    libcrange_unlock(lr);
+}
+
+typedef struct parallel_run {
+    libcrange_task_fn fn;
+    void* data;
+    int ntasks;
+    int next;
+#if APR_HAS_THREADS
+    apr_thread_mutex_t* mutex;
+#endif
+} parallel_run;
+
+typedef struct parallel_worker {
+    parallel_run* run;
+    apr_pool_t* pool;
+} parallel_worker;
+
+static int parallel_next_task(parallel_run* run)
+{
+    int task;
+#if APR_HAS_THREADS
+    if (run->mutex)
+        apr_thread_mutex_lock(run->mutex);
+#endif
+    task = run->next < run->ntasks ? run->next++ : -1;
+#if APR_HAS_THREADS
+    if (run->mutex)
+        apr_thread_mutex_unlock(run->mutex);
+#endif
+    return task;
+}
+
+static void parallel_work(parallel_worker* w)
+{
+    int task;
+    while ((task = parallel_next_task(w->run)) >= 0)
+        (*w->run->fn)(w->run->data, task, w->pool);
+}
+
+#if APR_HAS_THREADS
+static void* APR_THREAD_FUNC parallel_thread_main(apr_thread_t* thread,
+                                                 void* arg)
+{
+    parallel_work(arg);
+    apr_thread_exit(thread, APR_SUCCESS);
+    return NULL;
+}
+#endif
+
+int libcrange_parallel(apr_pool_t* pool, int nthreads, int ntasks,
+                       libcrange_task_fn fn, void* data)
+{
+    parallel_run run;
+    parallel_worker self;
+#if APR_HAS_THREADS
+    int i, started = 0;
+    apr_thread_t** threads;
+    parallel_worker* workers;
+    apr_threadattr_t* attr;
+#endif
+
+    run.fn = fn;
+    run.data = data;
+    run.ntasks = ntasks;
+    run.next = 0;
+    self.run = &run;
+    self.pool = pool;
+
+    if (nthreads > ntasks)
+        nthreads = ntasks;
+
+#if APR_HAS_THREADS
+    run.mutex = NULL;
+    if (nthreads > 1 &&
+        apr_thread_mutex_create(&run.mutex, APR_THREAD_MUTEX_DEFAULT,
+                                pool) == APR_SUCCESS &&
+        apr_threadattr_create(&attr, pool) == APR_SUCCESS) {
+        /* the calling thread is one of the workers */
+        threads = apr_palloc(pool, sizeof(apr_thread_t*) * nthreads);
+        workers = apr_palloc(pool, sizeof(parallel_worker) * nthreads);
+        for (i = 0; i < nthreads - 1; i++) {
+            workers[i].run = &run;
+            workers[i].pool = private_pool_new(pool);
+            if (!workers[i].pool ||
+                apr_thread_create(&threads[i], attr, parallel_thread_main,
+                                  &workers[i], pool) != APR_SUCCESS)
+                break;
+            started++;
+        }
+
+        parallel_work(&self);
+
+        for (i = 0; i < started; i++) {
+            apr_status_t rv;
+            apr_thread_join(&rv, threads[i]);
+        }
+        return started + 1;
+    }
+#endif
+
+    parallel_work(&self);
+    return 1;
+}
+
+typedef struct batch_task {
+    libcrange* lr;
+    const char** texts;
+    range_request** results;
+} batch_task;
+
+static void batch_expand_one(void* data, int task, apr_pool_t* pool)
+{
+    batch_task* b = data;
+    range_request* rr = range_request_new(b->lr, pool);
+
+    do_range_expand(rr, b->texts[task]);
+    b->results[task] = rr;
+}
+
+#define DEFAULT_BATCH_THREADS 4
+
+range_request** range_expand_batch(libcrange* lr, apr_pool_t* pool,
+                                   const char** texts, int n)
+{
+    int i, nunique = 0;
+    int* ids;
+    int* unique_of;
+    int nthreads = DEFAULT_BATCH_THREADS;
+    const char* cfg;
+    const char** unique;
+    set* seen;
+    batch_task b;
+    range_request** results;
+
+    if (lr == NULL) lr = get_static_lr();
+    assert(lr);
+
+    if ((cfg = libcrange_getcfg(lr, "batch_threads")) && atoi(cfg) > 0)
+        nthreads = atoi(cfg);
+    libcrange_trim_caches(lr);
+
+    /* evaluate each distinct expression once */
+    seen = set_new(pool, n);
+    unique = apr_palloc(pool, sizeof(char*) * (n + 1));
+    unique_of = apr_palloc(pool, sizeof(int) * (n + 1));
+    ids = apr_palloc(pool, sizeof(int) * (n + 1));
+    for (i = 0; i < n; i++) {
+        const char* text = texts[i] ? texts[i] : "";
+        int* id = set_get_data(seen, text);
+        if (!id) {
+            id = &ids[nunique];
+            *id = nunique;
+            unique[nunique++] = text;
+            set_add(seen, text, id);
+        }
+        unique_of[i] = *id;
+    }
+
+    b.lr = lr;
+    b.texts = unique;
+    b.results = apr_palloc(pool, sizeof(range_request*) * (nunique + 1));
+    libcrange_parallel(pool, nthreads, nunique, batch_expand_one, &b);
+
+    results = apr_palloc(pool, sizeof(range_request*) * (n + 1));
+    for (i = 0; i < n; i++)
+        results[i] = b.results[unique_of[i]];
+    results[n] = NULL;
+
+    return results;
+}
+
+int libcrange_preload(libcrange* lr)
+{
+    set_iter it;
+    set_element* module;
+    const char* cfg;
+    int nthreads;
+    int n = 0;
+
+    if (lr == NULL) lr = get_static_lr();
+
+    if ((cfg = libcrange_getcfg(lr, "preload_threads")) && atoi(cfg) > 0)
+        nthreads = atoi(cfg);
+    else if ((nthreads = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+        nthreads = 1;
+
+    /* modules take the lock themselves, only around publishing */
+    for (set_iter_init(&it, lr->modules); (module = set_iter_next(&it)); ) {
+        const range_module_desc* desc = module->data;
+        if (!desc->preload)
+            continue;
+        (*desc->preload)(lr, nthreads);
+        n++;
+    }
+    return n;
+}
+
 void libcrange_want_caching(libcrange* lr, int want)
 {
     if (lr == NULL) lr = get_static_lr();
@@ -199,56 +783,86 @@ const char* libcrange_getcfg(libcrange* lr, const char* what)
     return set_get_data(lr->vars, what);
 }
 
-static const char** get_function_names(libcrange* lr, void *handle,
-                                       const char* module)
+/* a module without a range_module descriptor gets one made up from
+ * functions_provided and the symbols it exports */
+static const range_module_desc* old_module_desc(libcrange* lr, void* handle,
+                                                const char* module)
 {
-    const char** (*f)(libcrange*);
-    const char* err;
-
-    *(void **)(&f) = dlsym(handle, "functions_provided");
-    if ((err = dlerror()) != NULL) {
+    const char** (*provided)(libcrange*);
+    const char** names;
+    range_module_desc* desc;
+    range_function_desc* functions;
+    int i, n;
+
+    *(void **)(&provided) = dlsym(handle, "functions_provided");
+    if (dlerror() != NULL || !provided) {
         fprintf(stderr, "Module %s: error getting functions_provided()\n",
                 module);
         return NULL;
     }
+    if (!(names = (*provided)(lr)))
+        return NULL;
+    for (n = 0; names[n]; n++)
+        ;
+
+    desc = apr_pcalloc(lr->pool, sizeof(*desc));
+    functions = apr_pcalloc(lr->pool, sizeof(*functions) * (n + 1));
+    for (i = 0; i < n; i++) {
+        char function_name[512] = "rangefunc_";
+        strncat(function_name, names[i], sizeof function_name - 11);
+
+        *(void **)(&functions[i].fn) = dlsym(handle, function_name);
+        if (dlerror() != NULL || !functions[i].fn) {
+            fprintf(stderr, "Module %s: error getting %s\n",
+                    module, function_name);
+            return NULL;
+        }
+        functions[i].name = apr_pstrdup(lr->pool, names[i]);
+        functions[i].nargs = -1;
+    }
 
-    return (*f)(lr);
+    desc->abi = 1;
+    desc->name = apr_pstrdup(lr->pool, module);
+    desc->functions = functions;
+    *(void **)(&desc->preload) = dlsym(handle, "preload");
+    *(void **)(&desc->snapshot_save) = dlsym(handle, "snapshot_save");
+    *(void **)(&desc->snapshot_load) = dlsym(handle, "snapshot_load");
+    dlerror(); /* those are optional */
+    return desc;
 }
 
-static int add_function(libcrange* lr, set* functions, void* handle,
-                        const char* module, const char* prefix,
-                        const char* function)
+static void add_function(libcrange* lr, set* functions,
+                         const range_module_desc* module, const char* prefix,
+                         const range_function_desc* function)
 {
-    void *f; /* it's actually a function pointer but since we're adding it
-              * to a set, let's leave it as void * */
-    const char* err;
-    char function_name[512] = "rangefunc_";
-    strncat(function_name, function, sizeof function_name);
-    function_name[sizeof function_name - 1] = '\0';
-
-    f = dlsym(handle, function_name);
-    if ((err = dlerror()) != NULL) {
-        fprintf(stderr, "Module %s: error getting %s\n",
-                module, function_name);
-        return 1;
-    }
+    function_slot* f = apr_palloc(lr->pool, sizeof(*f));
+    char function_name[512];
 
-    /* reusing function_name */
     assert(strlen(prefix) < 16);
-    assert(strlen(function) < 256);
+    assert(strlen(function->name) < 256);
 
     strcpy(function_name, prefix);
-    strcat(function_name, function);
+    strcat(function_name, function->name);
+    f->desc = function;
+    f->module = module;
+    f->dirs = 0;
     set_add(functions, function_name, f);
-    return 0;
 }
 
+/* loads module (once, whatever its prefixes) and adds its functions.
+ * Newly loaded modules go on loaded, to be initialized in order once
+ * the config file has been read */
 static int add_functions_from_module(libcrange* lr, set* functions,
-                                     const char* module, const char* prefix)
+                                     const char* module, const char* prefix,
+                                     apr_array_header_t* loaded)
 {
     void* handle;
     char filename[512];
-    const char** all_functions;
+    const range_module_desc* desc;
+    const range_function_desc* f;
+
+    if ((desc = set_get_data(lr->modules, module)))
+        goto add;
 
     snprintf(filename,
              sizeof filename,
@@ -275,20 +889,82 @@ static int add_functions_from_module(libcrange* lr, set* functions,
 
     dlerror(); /* Clear any existing errors */
 
-    all_functions = get_function_names(lr, handle, module);
-    if (all_functions == NULL)
+    if ((desc = dlsym(handle, "range_module"))) {
+        if (desc->abi != LIBCRANGE_MODULE_ABI) {
+            fprintf(stderr, "Module %s: ABI %d, this libcrange has %d\n",
+                    module, desc->abi, LIBCRANGE_MODULE_ABI);
+            return 1;
+        }
+    }
+    else if (!(desc = old_module_desc(lr, handle, module)))
         return 1;
 
-    while (*all_functions) {
-        int err = add_function(lr, functions, handle,
-                               module, prefix, *all_functions++);
-        if (err != 0)
-            return err;
-    }
+    set_add(lr->modules, module, (void*)desc);
+    *(const range_module_desc**)apr_array_push(loaded) = desc;
+
+  add:
+    for (f = desc->functions; f->name; f++)
+        add_function(lr, functions, desc, prefix, f);
 
     return 0;
 }
 
+typedef struct module_cleanup {
+    libcrange* lr;
+    const range_module_desc* desc;
+} module_cleanup;
+
+static apr_status_t fini_module(void* data)
+{
+    module_cleanup* m = data;
+    (*m->desc->fini)(m->lr);
+    return APR_SUCCESS;
+}
+
+/* in the order they were loaded; fini runs in the reverse order */
+static int init_modules(libcrange* lr, apr_array_header_t* loaded)
+{
+    int i;
+
+    for (i = 0; i < loaded->nelts; i++) {
+        const range_module_desc* desc =
+            ((const range_module_desc**)loaded->elts)[i];
+
+        if (desc->init && (*desc->init)(lr) != 0) {
+            fprintf(stderr, "Module %s: init failed\n", desc->name);
+            return -1;
+        }
+        if (desc->fini) {
+            module_cleanup* m = apr_palloc(lr->pool, sizeof(*m));
+            m->lr = lr;
+            m->desc = desc;
+            apr_pool_pre_cleanup_register(lr->pool, m, fini_module);
+        }
+    }
+    return 0;
+}
+
+/* once modules are initialized and their depends known: which functions'
+ * data may be anywhere under a directory. A file that isn't there yet
+ * might turn out to be one */
+static void find_depends_dirs(libcrange* lr, set* functions)
+{
+    set_iter it;
+    set_element* e;
+
+    for (set_iter_init(&it, functions); (e = set_iter_next(&it)); ) {
+        function_slot* f = e->data;
+        const char** files;
+        struct stat st;
+
+        if (!f->module->depends || !(files = (*f->module->depends)(lr)))
+            continue;
+        for (; *files && !f->dirs; files++)
+            if (stat(*files, &st) != 0 || S_ISDIR(st.st_mode))
+                f->dirs = 1;
+    }
+}
+
 #define LOADMODULE_RE "^\\s*loadmodule\\s+([-\\S]+)(?:\\s+prefix=([-\\w]+))?\\s*$"
 #define PERLMODULE_RE "^\\s*perlmodule\\s+([-\\S]+)(?:\\s+prefix=([-\\w]+))?\\s*$"
 #define VAR_RE "^\\s*([-\\w]+)\\s*=\\s*(\\S+)\\s*$"
@@ -309,6 +985,7 @@ static int parse_config_file(libcrange* lr)
     set* functions;
     set* perl_functions = NULL;
     set* vars;
+    apr_array_header_t* loaded;
 
     assert(lr);
     assert(lr->config_file);
@@ -325,6 +1002,7 @@ static int parse_config_file(libcrange* lr)
 
     functions = lr->functions;
     vars = lr->vars;
+    loaded = apr_array_make(lr->pool, 8, sizeof(range_module_desc*));
 
     /* compile the regex */
     loadmodule_re = pcre_compile(LOADMODULE_RE, 0, &error,
@@ -372,7 +1050,8 @@ static int parse_config_file(libcrange* lr)
             else
                 prefix = "";
 
-            err = add_functions_from_module(lr, functions, module, prefix);
+            err = add_functions_from_module(lr, functions, module, prefix,
+                                            loaded);
 
             if (err) {
                 fclose(fp);
@@ -433,6 +1112,10 @@ static int parse_config_file(libcrange* lr)
 
     fclose(fp);
 
+    if (init_modules(lr, loaded) < 0)
+        return -1;
+    find_depends_dirs(lr, functions);
+
     lr->perl_functions = perl_functions;
     lr->functions = functions;
     lr->vars = vars;
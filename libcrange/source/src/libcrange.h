@@ -34,6 +34,7 @@ typedef struct libcrange {
     set* functions;
     set* perl_functions;
     set* vars;
+    set* modules; /* module name -> range_module_desc */
 
     apr_pool_t* pool;
     const char* default_domain;
@@ -41,6 +42,18 @@ typedef struct libcrange {
     const char* config_file;
     const char* funcdir;
     int want_caching;
+    struct apr_thread_mutex_t* lock;
+    struct range_watch* watch;
+
+    apr_pool_t* cache_pool;   /* caches and the cache pools below it */
+    size_t cache_bytes;       /* charged to the caches */
+    size_t cache_limit;       /* cache_memory_limit, 0 for none */
+    unsigned long cache_clock;
+    int lock_depth;
+
+    struct libcrange_flight* flights;  /* cache misses being loaded */
+    struct apr_thread_mutex_t* flight_mutex;
+    struct apr_thread_cond_t* flight_cond;
 } libcrange;
 
 
@@ -58,6 +71,13 @@ struct range_request* range_expand(libcrange* lr, apr_pool_t* pool,
 
 struct range_request* range_expand_rr(range_request* rr, const char* text);
 
+/* expand n expressions in one go. Returns an array of n range_requests
+ * allocated from pool, in the same order as texts; identical texts
+ * share the same range_request. Expressions are evaluated in parallel
+ * using up to batch_threads (from range.conf) threads */
+struct range_request** range_expand_batch(libcrange* lr, apr_pool_t* pool,
+                                          const char** texts, int n);
+
 /* return a compressed version of this range_request results */
 const char* range_request_compressed(struct range_request* rr);
 
@@ -67,6 +87,32 @@ const char* range_request_warnings(struct range_request* rr);
 /* the result as a NULL terminated array of strings */
 const char** range_request_nodes(struct range_request* rr);
 
+/* same, in natural order (prefix, domain, then numeric part) - the order
+ * range_request_compressed groups them in. Names are never quoted */
+const char** range_request_nodes_sorted(struct range_request* rr);
+
+/* zero-copy access to the result: names point into the result set and
+ * live as long as the request's pool. Unlike range_request_nodes, the
+ * names of a quoted result are not wrapped in quotes; check
+ * range_request_is_quoted and add them if needed */
+size_t range_request_node_count(struct range_request* rr);
+int range_request_is_quoted(struct range_request* rr);
+
+/* call fn for each node; stops at the first non-zero return and
+ * returns it, otherwise 0 */
+typedef int (*range_node_fn)(void* data, const char* name, size_t len);
+int range_request_foreach(struct range_request* rr, range_node_fn fn,
+                          void* data);
+
+/* or walk them with an iterator:
+ *   range_node_iter it;
+ *   range_request_iter(rr, &it);
+ *   while (range_node_iter_next(&it, &name, &len)) ... */
+typedef set_iter range_node_iter;
+void range_request_iter(struct range_request* rr, range_node_iter* it);
+int range_node_iter_next(range_node_iter* it, const char** name,
+                         size_t* len);
+
 /* did we generate warnings */
 int range_request_has_warnings(struct range_request* rr);
 
@@ -82,6 +128,7 @@ apr_pool_t* libcrange_get_pool(libcrange* lr);
 void libcrange_set_cache(libcrange* lr, const char *name, void *data);
 void* libcrange_get_cache(libcrange* lr, const char *name);
 void libcrange_clear_caches(libcrange* lr);
+void libcrange_clear_cache(libcrange* lr, const char* name);
 void libcrange_want_caching(libcrange* lr, int want);
 const char* libcrange_getcfg(libcrange* lr, const char* what);
 void libcrange_set_default_domain(libcrange* lr, const char* domain);
@@ -91,6 +138,234 @@ void* libcrange_get_function(libcrange* lr, const char* funcname);
 char* libcrange_get_pcre_substring(apr_pool_t* pool, const char* string,
                                    int offsets[], int substr);
 
+/* serializes calls into modules and perl functions, which share caches
+ * in lr; recursive, so a module may expand ranges while holding it */
+void libcrange_lock(libcrange* lr);
+void libcrange_unlock(libcrange* lr);
+
+/* let other threads have the lock while this one does slow work that
+ * keeps off lr's caches, like parsing a file into a pool of its own.
+ * Only possible when the lock is held just once, by a module called
+ * straight from an expansion; otherwise the caller keeps it. Returns
+ * whether it let go, for libcrange_lock_resume. Anything looked up in
+ * the caches before must be looked up again after */
+int libcrange_lock_suspend(libcrange* lr);
+void libcrange_lock_resume(libcrange* lr, int suspended);
+
+/* singleflight for cache misses. With the lock held, a module that
+ * finds key (a path, say) missing calls libcrange_flight_begin. If
+ * nobody else is loading key, it returns a flight: load it - with the
+ * lock suspended, ideally - put it in the cache, and call
+ * libcrange_flight_end. If another thread is, it waits for that to
+ * finish and returns NULL: look in the cache again, and start another
+ * flight if it's still missing (the load failed). Threads that can't
+ * wait - holding the lock more than once - get a flight of their own */
+typedef struct libcrange_flight libcrange_flight;
+libcrange_flight* libcrange_flight_begin(libcrange* lr, const char* key);
+void libcrange_flight_end(libcrange* lr, libcrange_flight* f);
+
+/* run fn(data, i, pool) for i in [0, ntasks) on up to nthreads threads.
+ * Each thread gets a private pool (a child of pool with its own
+ * allocator) so tasks can allocate without locking */
+typedef void (*libcrange_task_fn)(void* data, int task, apr_pool_t* pool);
+int libcrange_parallel(apr_pool_t* pool, int nthreads, int ntasks,
+                       libcrange_task_fn fn, void* data);
+
+/* a child of lr's pool with its own allocator, for data built without
+ * the libcrange lock held (e.g. by reload callbacks) and swapped into
+ * the caches later. Always create and destroy these through lr */
+apr_pool_t* libcrange_pool_new(libcrange* lr);
+void libcrange_pool_destroy(libcrange* lr, apr_pool_t* pool);
+
+/* cache memory. Data for the cache name should come from
+ * libcrange_cache_pool(lr, name) (or pools whose cleanup it runs): the
+ * pool belongs to the cache, and clearing or evicting the cache
+ * destroys it, memory and all. Its allocator is private and hands
+ * freed memory back beyond a small reserve, so subpools cleared as the
+ * data changes give it back too.
+ *
+ * Modules charge each cache with what its data costs, and
+ * libcrange_cache_usage reports that per name (NULL for the total).
+ * Once the total is over cache_memory_limit (range.conf, bytes, with
+ * an optional k, m or g; none by default), the least recently used
+ * pooled caches are evicted at the start of the next top-level
+ * expansion, when no module is in the middle of using one. Modules
+ * find them gone and read their data again.
+ *
+ * With caching off (libcrange_want_caching) there are no caches and
+ * libcrange_cache_pool returns NULL: what a module reads then belongs
+ * in the request's pool, and goes away with the request */
+apr_pool_t* libcrange_cache_pool(libcrange* lr, const char* name);
+void libcrange_cache_charge(libcrange* lr, const char* name, long bytes);
+size_t libcrange_cache_usage(libcrange* lr, const char* name);
+/* the names of all caches, NULL terminated, allocated from pool */
+const char** libcrange_cache_names(libcrange* lr, apr_pool_t* pool);
+/* evict down to cache_memory_limit now; range_expand does this itself */
+void libcrange_trim_caches(libcrange* lr);
+
+/* read every module's data now rather than on first use. Calls
+ *     void preload(libcrange* lr, int nthreads);
+ * in each module that has one (see range_module_desc); modules parse on up to nthreads
+ * threads (preload_threads from range.conf, default one per CPU) and
+ * publish the results into their caches. libcrange_new does this
+ * itself when range.conf has preload=1. Returns the number of modules
+ * that preloaded */
+int libcrange_preload(libcrange* lr);
+
+/* hot reload. Modules register the files and directories they read;
+ * once libcrange_watch_start has been called, a background thread
+ * (inotify, Linux only) calls fn(lr, path, data) shortly after path
+ * changes. For a directory - watched with its subdirectories - path is
+ * the file that changed inside it. fn runs on the watcher thread
+ * without the libcrange lock: it should rebuild into a
+ * libcrange_pool_new pool and only take the lock to swap the result in
+ * (calling libcrange_file_refresh for path as it does) */
+typedef void (*libcrange_watch_fn)(libcrange* lr, const char* path,
+                                   void* data);
+void libcrange_watch(libcrange* lr, const char* path,
+                     libcrange_watch_fn fn, void* data);
+/* returns 0 on success, -1 if watching isn't available */
+int libcrange_watch_start(libcrange* lr);
+/* true once the watcher is running */
+int libcrange_watching(libcrange* lr);
+
+/* warm-start snapshots. libcrange_snapshot_save writes the caches of
+ * every module that has a
+ *     void snapshot_save(libcrange* lr, range_snapshot* s);
+ * to path (atomically, through a temp file). libcrange_snapshot_load
+ * maps a snapshot back and hands each module's part to its
+ *     void snapshot_load(libcrange* lr, range_snapshot* s);
+ * Both return 0 on success, -1 on error */
+typedef struct range_snapshot range_snapshot;
+int libcrange_snapshot_save(libcrange* lr, const char* path);
+int libcrange_snapshot_load(libcrange* lr, const char* path);
+
+/* for snapshot_save: start an entry (one cached item), record the files
+ * it was built from and add its name/value pairs (value may be NULL) */
+void range_snapshot_entry(range_snapshot* s, const char* key);
+void range_snapshot_depends(range_snapshot* s, const char* path);
+void range_snapshot_put(range_snapshot* s, const char* name,
+                        const char* value);
+/* for snapshot_load: step to the next entry whose files are unchanged
+ * since the save, then read its pairs. Both return 0 when there are no
+ * more. The strings point into the mapped snapshot, which stays mapped
+ * for the life of lr */
+int range_snapshot_next_entry(range_snapshot* s, const char** key);
+int range_snapshot_get(range_snapshot* s, const char** name,
+                       const char** value);
+
+/* freshness of data files. The generation of path changes whenever the
+ * file does and is -1 while it doesn't exist: modules keep the
+ * generation they parsed next to the parsed data and compare. Cheap
+ * enough for every lookup: with the watcher running it's a counter
+ * bumped from inotify events, otherwise path is stat()ed at most every
+ * freshness_interval seconds (config, default 1, 0 to stat every time) */
+long libcrange_file_generation(libcrange* lr, const char* path);
+/* stat path now and return its new generation. Reload callbacks call
+ * this with the lock held as they swap new data in, so requests see the
+ * new generation and the new data together */
+long libcrange_file_refresh(libcrange* lr, const char* path);
+/* changes whenever any file generation may have: data built from many
+ * files only needs checking file by file when this moves */
+long libcrange_data_version(libcrange* lr);
+
+/* function modules. A module describes itself by exporting
+ *     const range_module_desc range_module = { LIBCRANGE_MODULE_ABI, ... };
+ * Modules without one are loaded the old way: functions_provided(lr)
+ * names the functions, each found as rangefunc_<name>, and preload,
+ * snapshot_save and snapshot_load are looked up by name. Their
+ * functions get no flags and their arguments aren't checked */
+#define LIBCRANGE_MODULE_ABI 2
+
+/* what the evaluator may assume about a function */
+#define RANGE_FUNC_PURE        0x01 /* no side effects: the same arguments
+                                     * and data give the same result, so
+                                     * a request computes each call once */
+#define RANGE_FUNC_CACHEABLE   0x02 /* results may be kept across requests
+                                     * until a file the module depends on
+                                     * changes: the "memo" result cache
+                                     * (memo_cache_ttl, below). Only with
+                                     * RANGE_FUNC_PURE; calls that warn
+                                     * are never memoized */
+#define RANGE_FUNC_THREAD_SAFE 0x04 /* may run without the libcrange lock */
+#define RANGE_FUNC_READS_FILES 0x08 /* reads the module's data files */
+
+typedef struct range_function_desc {
+    const char* name;
+    struct range* (*fn)(range_request* rr, struct range** args);
+    int nargs;          /* as for validate_range_args, -1 for any */
+    unsigned flags;
+} range_function_desc;
+
+typedef struct range_module_desc {
+    int abi;                                /* LIBCRANGE_MODULE_ABI */
+    const char* name;
+    const range_function_desc* functions;   /* up to a NULL name */
+    /* once range.conf has been read; non-zero fails libcrange_new */
+    int (*init)(libcrange* lr);
+    /* when lr's pool is destroyed, before the caches go */
+    void (*fini)(libcrange* lr);
+    /* the files and directories its data comes from, NULL terminated and
+     * valid for the life of lr */
+    const char** (*depends)(libcrange* lr);
+    /* as described above; any of them may be NULL */
+    void (*preload)(libcrange* lr, int nthreads);
+    void (*snapshot_save)(libcrange* lr, range_snapshot* s);
+    void (*snapshot_load)(libcrange* lr, range_snapshot* s);
+} range_module_desc;
+
+/* a loaded module by name, and the function funcname and the files its
+ * module depends on (NULL if it declares none). NULL if not loaded */
+const range_module_desc* libcrange_get_module(libcrange* lr,
+                                              const char* module);
+const range_function_desc* libcrange_get_function_desc(libcrange* lr,
+                                                       const char* funcname);
+const char** libcrange_function_depends(libcrange* lr, const char* funcname);
+/* the generation of the data funcname's results come from, allocated
+ * from pool: the files' generations, or libcrange_data_version when the
+ * module depends on a directory. NULL if it declares no depends */
+const char* libcrange_function_generation(libcrange* lr, apr_pool_t* pool,
+                                          const char* funcname);
+
+/* result caches, for data with no file generation to check (database
+ * queries). An entry is a key and a NULL terminated list of names. Per
+ * cache name, range.conf sets:
+ *   <name>_cache_ttl    seconds an entry is fresh (default 0: no caching)
+ *   <name>_cache_stale  seconds after that it may still be served while
+ *                       one caller fetches it again (default 0)
+ *   <name>_cache_size   bytes, beyond which the least recently used
+ *                       entries go (default 16M)
+ * libcrange_result_cache returns NULL when caching is off; the other
+ * functions take that as an empty cache. Evicting the cache frees it, so
+ * hold the libcrange lock (module functions run with it) from
+ * libcrange_result_cache until done with what it returned */
+typedef struct range_cache range_cache;
+typedef struct range_cache_stats {
+    unsigned long hits;
+    unsigned long stale;      /* stale values handed out for revalidation */
+    unsigned long misses;
+    unsigned long expired;    /* misses on an entry past its stale time */
+    unsigned long inserts;
+    unsigned long evictions;
+    size_t entries;
+    size_t bytes;
+    size_t limit;
+} range_cache_stats;
+
+enum { RANGE_CACHE_MISS, RANGE_CACHE_HIT, RANGE_CACHE_STALE };
+
+range_cache* libcrange_result_cache(libcrange* lr, const char* name);
+/* whether c keeps anything at all: it's there, with a ttl */
+int range_cache_enabled(range_cache* c);
+/* copies key's values into pool. RANGE_CACHE_STALE means they're past
+ * their ttl and this caller should fetch and range_cache_put them;
+ * meanwhile everybody else gets the stale values as a hit. If the fetch
+ * fails, the stale values are still the best answer there is */
+int range_cache_get(range_cache* c, const char* key, apr_pool_t* pool,
+                    const char*** values);
+void range_cache_put(range_cache* c, const char* key, const char** values);
+void range_cache_get_stats(range_cache* c, range_cache_stats* stats);
+
 #ifdef __cplusplus
 }
 #endif
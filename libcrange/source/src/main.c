@@ -5,9 +5,98 @@ Copyrights licensed under the New BSD License. See the accompanying LICENSE file
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <getopt.h>
 #include "libcrange.h"
 #include <apr_pools.h>
+#include <apr_strings.h>
+#include <apr_time.h>
+
+/* expand text n times with caching off, so every expansion reads and
+ * parses the module data again, and report how long that took */
+static void time_expansions(apr_pool_t* pool, struct libcrange* lr,
+                            const char* text, int n)
+{
+    apr_time_t start;
+    double secs;
+    int i;
+
+    libcrange_want_caching(lr, 0);
+    start = apr_time_now();
+    for (i = 0; i < n; i++) {
+        apr_pool_t* sub;
+        apr_pool_create(&sub, pool);
+        range_expand(lr, sub, text);
+        apr_pool_destroy(sub);
+    }
+    secs = (double)(apr_time_now() - start) / APR_USEC_PER_SEC;
+    fprintf(stderr, "%d expansions in %.3fs, %.3fms each\n",
+            n, secs, secs * 1000 / n);
+    libcrange_want_caching(lr, 1);
+}
+
+/* what each cache holds, and how the result caches have done */
+static void dump_caches(apr_pool_t* pool, struct libcrange* lr)
+{
+    const char** names = libcrange_cache_names(lr, pool);
+
+    for (; *names; names++) {
+        range_cache_stats st;
+        printf("DEBUG: cache %s: %lu bytes\n", *names,
+               (unsigned long)libcrange_cache_usage(lr, *names));
+        if (strncmp(*names, "result_cache:", 13))
+            continue;
+        range_cache_get_stats(libcrange_result_cache(lr, *names + 13), &st);
+        printf("DEBUG: %s: hits %lu stale %lu misses %lu expired %lu "
+               "inserts %lu evictions %lu entries %lu\n", *names,
+               st.hits, st.stale, st.misses, st.expired, st.inserts,
+               st.evictions, (unsigned long)st.entries);
+    }
+    printf("DEBUG: caches: %lu bytes\n",
+           (unsigned long)libcrange_cache_usage(lr, NULL));
+}
+
+/* expand one range per line of stdin, print one compressed result per
+ * line; or with expand, each result's nodes one per line and an empty
+ * line after each result */
+static int expand_batch(apr_pool_t* pool, struct libcrange* lr, int expand)
+{
+    char* line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    int i, n = 0;
+    int size = 64;
+    const char** texts = malloc(sizeof(char*) * size);
+    struct range_request** rrs;
+
+    while ((len = getline(&line, &cap, stdin)) != -1) {
+        if (len && line[len - 1] == '\n')
+            line[len - 1] = '\0';
+        if (n == size) {
+            size *= 2;
+            texts = realloc(texts, sizeof(char*) * size);
+        }
+        texts[n++] = apr_pstrdup(pool, line);
+    }
+    free(line);
+
+    rrs = range_expand_batch(lr, pool, texts, n);
+    for (i = 0; i < n; i++) {
+        if (expand) {
+            const char** nodes = range_request_nodes(rrs[i]);
+            while (*nodes)
+                printf("%s\n", *nodes++);
+            printf("\n");
+        } else {
+            printf("%s\n", range_request_compressed(rrs[i]));
+        }
+        if (range_request_has_warnings(rrs[i]))
+            fprintf(stderr, "%d: %s\n", i + 1, range_request_warnings(rrs[i]));
+    }
+
+    free(texts);
+    return 0;
+}
 
 int main(int argc, char const* const* argv)
 {
@@ -15,6 +104,8 @@ int main(int argc, char const* const* argv)
     struct range_request* rr;
     const char **nodes;
     int expand_flag = 0;
+    int batch_flag = 0;
+    int repeat = 0;
     int c;
     int debug = 0;
     struct libcrange *lr;
@@ -24,18 +115,24 @@ int main(int argc, char const* const* argv)
     atexit(apr_terminate);
     apr_pool_create(&pool, NULL);
 
-    while ((c = getopt (argc, argv, "edc:")) != -1) {
+    while ((c = getopt (argc, argv, "ebdc:n:")) != -1) {
       switch (c)
       {
         case 'e':
           expand_flag = 1;
           break;
+        case 'b':
+          batch_flag = 1;
+          break;
         case 'd':
           debug = 1;
           break;
         case 'c':
           config_file = optarg;
           break;
+        case 'n':
+          repeat = atoi(optarg);
+          break;
         case '?':
           fprintf (stderr, "Usage: crange [-e] <range>\n\n");
           return 1;
@@ -45,8 +142,9 @@ int main(int argc, char const* const* argv)
     }
 
     debug && printf("DEBUG: argc: %d and optind: %d\n", argc, optind);
-    if (optind + 1 != argc) {
-      fprintf (stderr, "Usage: crange [-c <configfile>] [-d] [-e] <range>\n\n");
+    if (optind + 1 != argc && !(batch_flag && optind == argc)) {
+      fprintf (stderr, "Usage: crange [-c <configfile>] [-d] [-e] [-n <count>] <range>\n"
+                       "       crange [-c <configfile>] [-e] -b < ranges\n\n");
       return 1;
     }
 
@@ -66,6 +164,17 @@ int main(int argc, char const* const* argv)
         set_dump(lr->vars);
     }
 
+    if (batch_flag) {
+      int ret = expand_batch(pool, lr, expand_flag);
+      if (debug)
+        dump_caches(pool, lr);
+      apr_pool_destroy(pool);
+      return ret;
+    }
+
+    if (repeat > 0)
+      time_expansions(pool, lr, argv[argc-1], repeat);
+
     rr = range_expand(lr, pool, argv[argc-1]);
     if (expand_flag == 1) {
       nodes = range_request_nodes(rr);
@@ -79,6 +188,9 @@ int main(int argc, char const* const* argv)
     if (range_request_has_warnings(rr))
       printf("%s\n", range_request_warnings(rr));
 
+    if (debug)
+      dump_caches(pool, lr);
+
     apr_pool_destroy(pool);
     return 0;
 }
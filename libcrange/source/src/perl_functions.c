@@ -149,7 +149,8 @@ int add_functions_from_perlmodule(libcrange* lr, apr_pool_t* pool,
 SV* range_to_array_ref(apr_pool_t* pool, const range* r)
 {
     int i, n;
-    const char** nodes;
+    set_iter it;
+    set_element* e;
     SV* result;
     AV* array;
 
@@ -159,9 +160,12 @@ SV* range_to_array_ref(apr_pool_t* pool, const range* r)
     n = r->nodes->members;
     av_unshift(array, n);
 
-    nodes = range_get_hostnames(pool, r);
-    for (i=0; i<n; i++) {
-        av_store(array, i, newSVpv(nodes[i], 0));
+    set_iter_init(&it, r->nodes);
+    for (i=0; (e = set_iter_next(&it)); i++) {
+        if (r->quoted)
+            av_store(array, i, newSVpvf("\"%s\"", e->name));
+        else
+            av_store(array, i, newSVpvn(e->name, e->len));
     }
 
     assert(av_len(array) == (n - 1));
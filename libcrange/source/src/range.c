@@ -15,11 +15,28 @@ Copyrights licensed under the New BSD License. See the accompanying LICENSE file
 #include "range_scanner.h"
 #include "perl_functions.h"
 #include "ast.h"
+#include "range_parts.h"
+#include "range_memo.h"
 #include "range_request.h"
 
 int yyparse(void*);
 
-static range_request* current_rr;
+/* batch expansion parses on several threads at once */
+static __thread range_request* current_rr;
+static pcre* regex_node = NULL;
+
+/* compile the shared regexes up front so threads never race to do it */
+void range_init(void)
+{
+    const char* error;
+    int offset;
+
+    if (!regex_node)
+        regex_node = pcre_compile(NODE_RE, 0, &error, &offset, NULL);
+    assert(regex_node);
+    init_range_parts();
+}
+
 void yyerror(const char* s)
 {
     range_request_warn(current_rr, "%s", s);
@@ -127,10 +144,20 @@ range* range_from_hostnames(range_request* rr,
 }
 
 range* range_new(range_request* rr)
+{
+    return range_new_sized(rr, 0);
+}
+
+/* don't let a huge hint trip the prime table in set_new */
+#define RANGE_MAX_PRESIZE (1 << 26)
+
+range* range_new_sized(range_request* rr, size_t members_hint)
 {
     apr_pool_t* pool = range_request_pool(rr);
     range* r = apr_palloc(pool, sizeof(range));
-    r->nodes = set_new(pool, 0);
+    if (members_hint > RANGE_MAX_PRESIZE)
+        members_hint = RANGE_MAX_PRESIZE;
+    r->nodes = set_new(pool, (int)members_hint);
     r->quoted = 0;
     return r;
 }
@@ -190,58 +217,186 @@ range* range_from_nonrange_literal(range_request* rr,
     return r;
 }
 
-range* range_from_braces(range_request* rr,
-                         const range* r1, const range* r2, const range* r3)
+/* members of one operand of a product; an empty operand contributes "" */
+static set_element** product_operand(range_request* rr, const range* r,
+                                     size_t** lens)
 {
-    int i, j, k;
-    set_element** m1;
-    set_element** m2;
-    set_element** m3;
-    set* temp = NULL;
-    range* bigrange;
-    char* bundle;
     apr_pool_t* pool = range_request_pool(rr);
-    
-    if(r1->nodes->members == 0) {
-        if(!temp) {
-            temp = set_new(pool, 1);
-            set_add(temp, "", NULL);
-        }
-        m1 = set_members(temp);
-    } else m1 = set_members(r1->nodes);
+    set_element** members;
+    int i;
 
-    if(r2->nodes->members == 0) {
-        if(!temp) {
-            temp = set_new(pool, 1);
-            set_add(temp, "", NULL);
-        }
-        m2 = set_members(temp);
-    } else m2 = set_members(r2->nodes);
+    if (r->nodes->members == 0) {
+        set_element* empty = apr_palloc(pool, sizeof(set_element));
+        empty->name = "";
+        empty->len = 0;
+        empty->data = NULL;
+        empty->next = NULL;
+        members = apr_palloc(pool, sizeof(set_element*) * 2);
+        members[0] = empty;
+        members[1] = NULL;
+    }
+    else
+        members = set_members(r->nodes);
+
+    for (i = 0; members[i]; i++)
+        ;
+    *lens = apr_palloc(pool, sizeof(size_t) * (i + 1));
+    for (i = 0; members[i]; i++)
+        (*lens)[i] = members[i]->len;
+
+    return members;
+}
 
-    if(r3->nodes->members == 0) {
-        if(!temp) {
-            temp = set_new(pool, 1);
-            set_add(temp, "", NULL);
+range_product* range_product_new(range_request* rr,
+                                 const range* left, const range* center,
+                                 const range* right)
+{
+    apr_pool_t* pool = range_request_pool(rr);
+    range_product* p = apr_palloc(pool, sizeof(range_product));
+
+    p->left = left;
+    p->center = center;
+    p->right = right;
+    p->l_members = product_operand(rr, left, &p->l_lens);
+    p->r_members = product_operand(rr, right, &p->r_lens);
+    p->quoted = left->quoted || center->quoted || right->quoted;
+    return p;
+}
+
+#define operand_members(r) ((r)->nodes->members ? (r)->nodes->members : 1)
+
+size_t range_product_members(const range_product* p)
+{
+    return operand_members(p->left) * operand_members(p->center) *
+        operand_members(p->right);
+}
+
+int range_product_contains(const range_product* p, const char* name)
+{
+    size_t len = strlen(name);
+    int i, j;
+
+    for (i = 0; p->l_members[i]; i++) {
+        size_t l_len = p->l_lens[i];
+        if (l_len > len || memcmp(name, p->l_members[i]->name, l_len) != 0)
+            continue;
+
+        for (j = 0; p->r_members[j]; j++) {
+            size_t r_len = p->r_lens[j];
+            size_t c_len;
+            if (l_len + r_len > len ||
+                memcmp(name + len - r_len, p->r_members[j]->name, r_len) != 0)
+                continue;
+
+            c_len = len - l_len - r_len;
+            if (p->center->nodes->members == 0) {
+                if (c_len == 0)
+                    return 1;
+            }
+            else if (set_getn(p->center->nodes, name + l_len, c_len))
+                return 1;
         }
-        m3 = set_members(temp);
-    } else m3 = set_members(r3->nodes);
-
-    bigrange = range_new(rr);
-
-    for(i = 0; m1[i]; i++)
-        for(j = 0; m2[j]; j++)
-            for(k = 0; m3[k]; k++) {
-                bundle = apr_pstrcat(pool,
-                                    m1[i]->name, m2[j]->name,
-                                     m3[k]->name, NULL);
-                range_add(bigrange, bundle);
+    }
+    return 0;
+}
+
+range* range_from_product(range_request* rr, const range_product* p)
+{
+    int i, j, k;
+    size_t n_l, n_c, n_r, sum_l, sum_c, sum_r, bytes;
+    set_element** c_members;
+    size_t* c_lens;
+    range* bigrange;
+    char* arena;
+
+    c_members = product_operand(rr, p->center, &c_lens);
+
+    n_l = sum_l = 0;
+    for (i = 0; p->l_members[i]; i++, n_l++) sum_l += p->l_lens[i];
+    n_c = sum_c = 0;
+    for (j = 0; c_members[j]; j++, n_c++) sum_c += c_lens[j];
+    n_r = sum_r = 0;
+    for (k = 0; p->r_members[k]; k++, n_r++) sum_r += p->r_lens[k];
+
+    /* every combination goes into one arena owned by the result set */
+    bytes = sum_l * n_c * n_r + sum_c * n_l * n_r + sum_r * n_l * n_c +
+        n_l * n_c * n_r;
+    bigrange = range_new_sized(rr, n_l * n_c * n_r);
+    arena = apr_palloc(bigrange->nodes->pool, bytes);
+
+    for (i = 0; p->l_members[i]; i++)
+        for (j = 0; c_members[j]; j++)
+            for (k = 0; p->r_members[k]; k++) {
+                char* bundle = arena;
+                memcpy(arena, p->l_members[i]->name, p->l_lens[i]);
+                arena += p->l_lens[i];
+                memcpy(arena, c_members[j]->name, c_lens[j]);
+                arena += c_lens[j];
+                memcpy(arena, p->r_members[k]->name, p->r_lens[k]);
+                arena += p->r_lens[k];
+                *arena++ = '\0';
+                set_add_nocopy(bigrange->nodes, bundle, NULL);
             }
 
-    if (temp) set_destroy(temp);
-    bigrange->quoted = r1->quoted || r2->quoted || r3->quoted;
+    bigrange->quoted = p->quoted;
     return bigrange;
 }
 
+range* range_from_braces(range_request* rr,
+                         const range* r1, const range* r2, const range* r3)
+{
+    return range_from_product(rr, range_product_new(rr, r1, r2, r3));
+}
+
+/* probing the product costs |left|*|right| per candidate, building it
+ * costs |left|*|center|*|right|, so probe when there are fewer candidates
+ * than center members */
+#define product_worth_probing(r, p) \
+    (range_members(r) <= operand_members((p)->center))
+
+range* range_inter_product(range_request* rr,
+                           const range* r, const range_product* p)
+{
+    range* ret;
+    set_element** members;
+    int i;
+
+    if (!product_worth_probing(r, p)) {
+        range* prod = range_from_product(rr, p);
+        ret = range_from_inter(rr, r, prod);
+        range_destroy(prod);
+        return ret;
+    }
+
+    ret = range_new_sized(rr, range_members(r));
+    members = set_members(r->nodes);
+    for (i = 0; members[i]; i++)
+        if (range_product_contains(p, members[i]->name))
+            range_add(ret, members[i]->name);
+
+    ret->quoted = r->quoted || p->quoted;
+    return ret;
+}
+
+void range_diff_product_inplace(range_request* rr,
+                                range* dst, const range_product* p)
+{
+    set_element** members;
+    int i;
+
+    if (!product_worth_probing(dst, p)) {
+        range* prod = range_from_product(rr, p);
+        range_diff_inplace(rr, dst, prod);
+        range_destroy(prod);
+        return;
+    }
+
+    members = set_members(dst->nodes);
+    for (i = 0; members[i]; i++)
+        if (range_product_contains(p, members[i]->name))
+            range_remove(dst, members[i]->name);
+}
+
 range* range_from_union(range_request* rr,
                         const range* r1, const range* r2)
 {
@@ -308,7 +463,6 @@ rangeparts *rangeparts_from_hostname(range_request* rr,
     rangeparts* rangeparts;
     int offset, count;
     int offsets[128];
-    static pcre* regex_node = NULL;
     apr_pool_t* pool = range_request_pool(rr);
     
     if (!regex_node) 
@@ -352,42 +506,117 @@ rangeparts *rangeparts_from_hostname(range_request* rr,
     return NULL;
 }
 
+/* largest serial we accept, so first..last always fits in 64 bits */
+#define RANGEPARTS_MAX_DIGITS 18
+
+/* write n into buf zero-padded to width, returns the number of chars */
+static int format_padded(char* buf, apr_int64_t n, int width)
+{
+    char tmp[RANGEPARTS_MAX_DIGITS + 1];
+    int len = 0;
+    int i;
+
+    do {
+        tmp[len++] = '0' + (char)(n % 10);
+        n /= 10;
+    } while (n > 0);
+
+    i = 0;
+    while (width-- > len)
+        buf[i++] = '0';
+    while (len > 0)
+        buf[i++] = tmp[--len];
+    return i;
+}
+
+/* add one to a decimal string in place, growing it on carry out */
+static int increment_digits(char* digits, int len)
+{
+    int i = len - 1;
+    while (i >= 0 && digits[i] == '9')
+        digits[i--] = '0';
+
+    if (i >= 0) {
+        digits[i]++;
+        return len;
+    }
+
+    memmove(digits + 1, digits, len);
+    digits[0] = '1';
+    return len + 1;
+}
+
 range* range_from_rangeparts(range_request* rr,
                              const rangeparts* parts)
 {
     int i;
-    int f, l, firstlength, lastlength, length;
+    int firstlength, lastlength, length;
+    int head_len, domain_len, num_len, stride;
+    apr_int64_t f, l, n, count;
     range* r;
-    char* pad1 = "";
     char* first;
-    char* last;
-    char* tmpstr;
+    char* head;
+    char* arena;
+    char digits[RANGEPARTS_MAX_DIGITS + 2];
     apr_pool_t* pool = range_request_pool(rr);
-    
-    r = range_new(rr);
 
     firstlength = strlen(parts->first);
     lastlength = strlen(parts->last);
     first = parts->first;
-    last = parts->last;
 
-    if (firstlength > lastlength) {
-        pad1 = apr_palloc(pool, firstlength - lastlength + 1);
-        for(i=0; i < (firstlength - lastlength); i++)
-            pad1[i] = parts->first[i];
-        pad1[i] = '\0';
+    if (firstlength > RANGEPARTS_MAX_DIGITS + lastlength ||
+        lastlength > RANGEPARTS_MAX_DIGITS) {
+        range_request_warn(rr, "%s%s..%s%s: number too large",
+                           parts->prefix, parts->first, parts->last,
+                           parts->domain);
+        return range_new(rr);
+    }
+
+    /* the common part of every name: prefix and any leading digits of
+     * first not repeated in last (foo100..10 is foo100..foo110) */
+    i = firstlength > lastlength ? firstlength - lastlength : 0;
+    head = parts->prefix;
+    if (i) {
+        head = apr_pstrcat(pool, parts->prefix,
+                           apr_pstrndup(pool, parts->first, i), NULL);
         first = parts->first + i;
     }
 
-    f = atoi(first);
-    l = atoi(last);
+    f = apr_strtoi64(first, NULL, 10);
+    l = apr_strtoi64(parts->last, NULL, 10);
+    if (l < f)
+        return range_new(rr);
 
     length = firstlength > lastlength ? lastlength : firstlength;
+    count = l - f + 1;
+    if (count > RANGE_MAX_PRESIZE) {
+        range_request_warn(rr, "%s%s..%s%s: too many nodes",
+                           parts->prefix, parts->first, parts->last,
+                           parts->domain);
+        return range_new(rr);
+    }
 
-    for(i=f; i<=l; i++) {
-        tmpstr = apr_psprintf(pool, "%s%s%0*d%s",
-                             parts->prefix, pad1, length, i, parts->domain);
-        range_add(r, tmpstr);
+    head_len = strlen(head);
+    domain_len = strlen(parts->domain);
+    num_len = format_padded(digits, l, length);
+    stride = head_len + num_len + domain_len + 1;
+
+    /* one arena for every name, owned by the result set */
+    r = range_new_sized(rr, (size_t)count);
+    arena = apr_palloc(r->nodes->pool, (apr_size_t)(count * stride));
+
+    num_len = format_padded(digits, f, length);
+    for (n = 0; n < count; n++) {
+        char* name = arena + n * stride;
+        char* p = name;
+        memcpy(p, head, head_len);
+        p += head_len;
+        memcpy(p, digits, num_len);
+        p += num_len;
+        memcpy(p, parts->domain, domain_len);
+        p[domain_len] = '\0';
+        set_add_nocopy(r->nodes, name, NULL);
+        num_len = increment_digits(digits, num_len);
     }
 
     return r;
@@ -407,24 +636,58 @@ range* range_from_group(range_request* rr,
     return ret;
 }
 
+static range* call_function(range_request* rr, const range_function_desc* f,
+                            const range** r)
+{
+    range* ret;
+    libcrange* lr = range_request_lr(rr);
+
+    if (f->flags & RANGE_FUNC_THREAD_SAFE)
+        return (*f->fn)(rr, (range**)r);
+    /* modules keep their caches in lr, so only one runs at a time */
+    libcrange_lock(lr);
+    ret = (*f->fn)(rr, (range**)r);
+    libcrange_unlock(lr);
+    return ret;
+}
+
 range* range_from_function(range_request* rr,
                            const char* funcname, const range** r)
 {
     range* ret;
-    range* (*f)(range_request*, const range**);
+    const range_function_desc* f;
     const char* perl_module;
+    range_memo memo;
+    unsigned warnings;
     libcrange* lr = range_request_lr(rr);
     
     perl_module = libcrange_get_perl_module(lr, funcname);
-    if (perl_module)
+    if (perl_module) {
+        libcrange_lock(lr);
         ret = perl_function(rr, funcname, r);
+        libcrange_unlock(lr);
+        range_memo_unshared(rr);
+    }
     else {
-        f = libcrange_get_function(lr, funcname);
+        f = libcrange_get_function_desc(lr, funcname);
         if (!f) {
         range_request_warn_type(rr, "NO_FUNCTION", funcname);
             return range_new(rr);
         }
-        ret = (*f)(rr, r);
+        if (f->nargs >= 0 && !validate_range_args(rr, (range**)r, f->nargs)) {
+            range_request_warn_type(rr, "BAD_ARGS", funcname);
+            return range_new(rr);
+        }
+        range_memo_begin(&memo, rr, f, funcname, r);
+        if ((ret = range_memo_get(rr, &memo)))
+            range_memo_end(rr, &memo, ret, 0);
+        else {
+            warnings = range_request_warning_count(rr);
+            ret = call_function(rr, f, r);
+            /* a memoized result wouldn't repeat the warnings */
+            range_memo_end(rr, &memo, ret,
+                           range_request_warning_count(rr) == warnings);
+        }
     }
     return ret;
 }
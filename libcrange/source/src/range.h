@@ -40,6 +40,20 @@ typedef struct range
     int quoted;
 } range;
 
+/* the cartesian product left{center}right, kept unexpanded so that
+ * membership tests don't need to build every combination */
+typedef struct range_product
+{
+    const range* left;
+    const range* center;
+    const range* right;
+    set_element** l_members;
+    set_element** r_members;
+    size_t* l_lens;
+    size_t* r_lens;
+    int quoted;
+} range_product;
+
 typedef struct range_extras
 {
     struct range_request* rr;
@@ -58,8 +72,10 @@ typedef struct rangelist
 
 range* copy_range(apr_pool_t* pool, const range* r);
 range* do_range_expand(range_request* rr, const char* text);
+void range_init(void);
 const char** range_get_hostnames(apr_pool_t* pool, const range* r);
 range* range_new(range_request* rr);
+range* range_new_sized(range_request* rr, size_t members_hint);
 
 void range_union_inplace(range_request* rr, range* r1, const range* r2);
 void range_diff_inplace(range_request* rr, range* r1, const range* r2);
@@ -85,6 +101,16 @@ range* range_from_union(range_request* rr,
 range* range_from_braces(range_request* rr,
                          const range* left, const range* center,
                          const range* right);
+range_product* range_product_new(range_request* rr,
+                                 const range* left, const range* center,
+                                 const range* right);
+size_t range_product_members(const range_product* p);
+int range_product_contains(const range_product* p, const char* name);
+range* range_from_product(range_request* rr, const range_product* p);
+range* range_inter_product(range_request* rr,
+                           const range* r, const range_product* p);
+void range_diff_product_inplace(range_request* rr,
+                                range* dst, const range_product* p);
 range* range_from_diff(range_request* rr,
                        const range* r1, const range* r2);
 range* range_from_inter(range_request* rr,
@@ -0,0 +1,381 @@
+/*
+Copyright (c) 2011, Yahoo! Inc.  All rights reserved.
+Copyrights licensed under the New BSD License. See the accompanying LICENSE file for terms
+*/
+
+/* range_bench: HTTP load generator for range servers.
+ *
+ * Sends the same GET to a server from several keep-alive connections,
+ * optionally pipelining requests, and reports throughput and latency.
+ * Point it at rangedd and at an httpd running mod_ranged to compare:
+ *
+ *   range_bench -p 9999 -c 32 -n 100000 '/range/list?foo1..1000'
+ *   range_bench -p 80   -c 32 -n 100000 '/range/list?foo1..1000'
+ */
+
+#define _GNU_SOURCE /* memmem */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+typedef struct bench {
+    const char* host;
+    const char* port;
+    const char* request;
+    size_t request_len;
+    int pipeline;
+    long requests_per_conn;
+} bench;
+
+typedef struct client {
+    const bench* b;
+    pthread_t thread;
+    long done;
+    long errors;
+    long bytes;
+    double* latencies;
+    char* buf;
+    size_t buf_len;
+    size_t buf_size;
+} client;
+
+static double now(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1E6;
+}
+
+static int connect_to(const char* host, const char* port)
+{
+    struct addrinfo hints, *res, *ai;
+    int fd = -1;
+
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &res) != 0)
+        return -1;
+
+    for (ai = res; ai; ai = ai->ai_next) {
+        int one = 1;
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0)
+            continue;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+            break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+static int send_all(int fd, const char* data, size_t len)
+{
+    while (len) {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* the length of the chunked body at data, trailers included: 0 if it
+ * isn't all there yet, -1 if it isn't chunked encoding */
+static long chunked_length(const char* data, size_t len)
+{
+    size_t pos = 0;
+
+    for (;;) {
+        const char* eol = memmem(data + pos, len - pos, "\r\n", 2);
+        unsigned long size;
+        char* end;
+
+        if (!eol)
+            return 0;
+        size = strtoul(data + pos, &end, 16);
+        if (end == data + pos)
+            return -1;
+        pos = eol - data + 2;
+        if (size == 0)
+            break;
+        if (len - pos < size + 2)
+            return 0;
+        pos += size + 2;
+    }
+
+    /* trailers, up to an empty line */
+    for (;;) {
+        const char* eol = memmem(data + pos, len - pos, "\r\n", 2);
+        int empty;
+
+        if (!eol)
+            return 0;
+        empty = eol == data + pos;
+        pos = eol - data + 2;
+        if (empty)
+            return pos;
+    }
+}
+
+/* read one response, leaving anything after it in c->buf. Returns the
+ * status code, 0 if the server closed the connection, -1 on error.
+ * *keep_alive is cleared when the server won't take more requests */
+static int read_response(client* c, int fd, int* keep_alive)
+{
+    char* end = NULL;
+    long content_length = -1;
+    size_t header_len = 0;
+    int chunked = 0;
+    int status = -1;
+
+    for (;;) {
+        ssize_t n;
+
+        if (!end && (end = memmem(c->buf, c->buf_len, "\r\n\r\n", 4))) {
+            char* line = c->buf;
+            header_len = end - c->buf + 4;
+            *end = '\0';
+            status = atoi(strchr(line, ' ') ? strchr(line, ' ') + 1 : "0");
+            while ((line = strstr(line, "\r\n"))) {
+                char* eol;
+                line += 2;
+                if ((eol = strstr(line, "\r\n")))
+                    *eol = '\0';
+                if (!strncasecmp(line, "Content-Length:", 15))
+                    content_length = atol(line + 15);
+                else if (!strncasecmp(line, "Transfer-Encoding:", 18) &&
+                         strcasestr(line + 18, "chunked"))
+                    chunked = 1;
+                else if (!strncasecmp(line, "Connection:", 11) &&
+                         strcasestr(line + 11, "close"))
+                    *keep_alive = 0;
+                if (!eol)
+                    break;
+                *eol = '\r';
+            }
+            if (chunked)
+                content_length = -1;
+            else if (content_length < 0)
+                *keep_alive = 0;
+        }
+
+        /* mod_ranged streams its answers chunked on keep-alive */
+        if (end && chunked) {
+            long body = chunked_length(c->buf + header_len,
+                                       c->buf_len - header_len);
+            if (body < 0)
+                return -1;
+            if (body > 0)
+                content_length = body;
+        }
+
+        if (end && content_length >= 0 &&
+            c->buf_len >= header_len + content_length) {
+            size_t used = header_len + content_length;
+            c->bytes += used;
+            memmove(c->buf, c->buf + used, c->buf_len - used);
+            c->buf_len -= used;
+            return status;
+        }
+
+        if (c->buf_len == c->buf_size) {
+            c->buf_size *= 2;
+            c->buf = realloc(c->buf, c->buf_size);
+        }
+        n = recv(fd, c->buf + c->buf_len, c->buf_size - c->buf_len, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            /* no Content-Length: the body runs until close */
+            if (end && !chunked && content_length < 0) {
+                c->bytes += c->buf_len;
+                c->buf_len = 0;
+                return status;
+            }
+            return n == 0 && !end && c->buf_len == 0 ? 0 : -1;
+        }
+        c->buf_len += n;
+    }
+}
+
+static void* client_main(void* arg)
+{
+    client* c = arg;
+    const bench* b = c->b;
+    double* sent_at = malloc(sizeof(double) * b->pipeline);
+    int fd = -1;
+
+    c->buf_size = 65536;
+    c->buf = malloc(c->buf_size);
+
+    while (c->done + c->errors < b->requests_per_conn) {
+        int i, in_flight, keep_alive = 1;
+
+        if (fd < 0) {
+            c->buf_len = 0;
+            if ((fd = connect_to(b->host, b->port)) < 0) {
+                c->errors++;
+                continue;
+            }
+        }
+
+        in_flight = b->pipeline;
+        if (in_flight > b->requests_per_conn - c->done - c->errors)
+            in_flight = b->requests_per_conn - c->done - c->errors;
+
+        for (i = 0; i < in_flight; i++)
+            sent_at[i] = now();
+        /* one write for the whole pipeline */
+        for (i = 0; i < in_flight; i++)
+            if (send_all(fd, b->request, b->request_len) < 0)
+                break;
+
+        for (i = 0; i < in_flight; i++) {
+            int status = read_response(c, fd, &keep_alive);
+            if (status == 200) {
+                c->latencies[c->done++] = now() - sent_at[i];
+            }
+            else {
+                c->errors += in_flight - i;
+                keep_alive = 0;
+                break;
+            }
+            if (!keep_alive) {
+                c->errors += in_flight - i - 1;
+                break;
+            }
+        }
+
+        if (!keep_alive) {
+            close(fd);
+            fd = -1;
+        }
+    }
+
+    if (fd >= 0)
+        close(fd);
+    free(sent_at);
+    free(c->buf);
+    return NULL;
+}
+
+static int compare_doubles(const void* a, const void* b)
+{
+    double x = *(const double*)a, y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: range_bench [-H <host>] [-p <port>] "
+            "[-c <connections>] [-n <requests>] [-P <pipeline>] <path>\n\n");
+}
+
+int main(int argc, char* argv[])
+{
+    bench b;
+    client* clients;
+    double* all;
+    double start, elapsed, sum = 0;
+    long total = 100000, done = 0, errors = 0, bytes = 0;
+    int connections = 16;
+    int c, i, j, k;
+
+    b.host = "localhost";
+    b.port = "9999";
+    b.pipeline = 1;
+
+    while ((c = getopt(argc, argv, "H:p:c:n:P:")) != -1) {
+        switch (c) {
+            case 'H':
+                b.host = optarg;
+                break;
+            case 'p':
+                b.port = optarg;
+                break;
+            case 'c':
+                connections = atoi(optarg);
+                break;
+            case 'n':
+                total = atol(optarg);
+                break;
+            case 'P':
+                b.pipeline = atoi(optarg);
+                break;
+            default:
+                usage();
+                return 1;
+        }
+    }
+    if (optind + 1 != argc || connections < 1 || total < 1 ||
+        b.pipeline < 1) {
+        usage();
+        return 1;
+    }
+
+    b.request_len = strlen(argv[optind]) + strlen(b.host) + 64;
+    b.request = malloc(b.request_len);
+    b.request_len = snprintf((char*)b.request, b.request_len,
+                             "GET %s HTTP/1.1\r\nHost: %s\r\n\r\n",
+                             argv[optind], b.host);
+    b.requests_per_conn = (total + connections - 1) / connections;
+
+    clients = calloc(connections, sizeof(client));
+    start = now();
+    for (i = 0; i < connections; i++) {
+        clients[i].b = &b;
+        clients[i].latencies = malloc(sizeof(double) * b.requests_per_conn);
+        pthread_create(&clients[i].thread, NULL, client_main, &clients[i]);
+    }
+    for (i = 0; i < connections; i++) {
+        pthread_join(clients[i].thread, NULL);
+        done += clients[i].done;
+        errors += clients[i].errors;
+        bytes += clients[i].bytes;
+    }
+    elapsed = now() - start;
+
+    all = malloc(sizeof(double) * (done + 1));
+    for (i = 0, k = 0; i < connections; i++) {
+        for (j = 0; j < clients[i].done; j++) {
+            all[k++] = clients[i].latencies[j];
+            sum += clients[i].latencies[j];
+        }
+        free(clients[i].latencies);
+    }
+    qsort(all, done, sizeof(double), compare_doubles);
+
+    printf("requests:    %ld ok, %ld failed\n", done, errors);
+    printf("time:        %.3fs\n", elapsed);
+    printf("throughput:  %.1f req/s, %.1f MB/s\n", done / elapsed,
+           bytes / elapsed / (1024 * 1024));
+    if (done) {
+        printf("latency:     avg %.3fms, p50 %.3fms, p99 %.3fms, "
+               "max %.3fms\n", sum / done * 1000, all[done / 2] * 1000,
+               all[(long)(done * 0.99)] * 1000, all[done - 1] * 1000);
+    }
+
+    free(all);
+    free(clients);
+    return errors ? 2 : 0;
+}
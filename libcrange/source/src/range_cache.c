@@ -0,0 +1,372 @@
+/*
+Copyright (c) 2011, Yahoo! Inc.  All rights reserved.
+Copyrights licensed under the New BSD License. See the accompanying LICENSE file for terms
+*/
+
+/* range_cache.c: bounded result caches for data that can't be checked
+ * for freshness (databases).
+ *
+ * Each entry is a key and a list of names in one malloc()ed block, so
+ * that its size is known and evicting it gives the memory back. Entries
+ * live ttl seconds, and for stale seconds after that can still be
+ * served while one caller fetches the new value. When the cache grows
+ * past its limit, entries are evicted in CLOCK order: the hand sweeps
+ * the ring of entries, sparing (once) those used since it last passed.
+ *
+ * Entries are handed out as copies in the caller's pool, so eviction
+ * never pulls data out from under a request.
+ *
+ * The cache itself lives in the libcrange cache pool "result_cache:<name>"
+ * and charges it with the bytes its entries hold, so clearing or
+ * evicting that frees every entry, and the cache with them: callers
+ * hold the libcrange lock from libcrange_result_cache until they're
+ * done with it. */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <apr_strings.h>
+#include <apr_time.h>
+
+#include "libcrange.h"
+#include "set.h"
+
+#if APR_HAS_THREADS
+#include <apr_thread_mutex.h>
+#endif
+
+libcrange* get_static_lr(void);
+
+#define DEFAULT_CACHE_SIZE (16 * 1024 * 1024)
+
+typedef struct cache_entry {
+    struct cache_entry* next;   /* hash chain */
+    size_t size;                /* of the whole block */
+    size_t slot;                /* in the clock ring */
+    unsigned hash;
+    apr_time_t expires;
+    int used;                   /* since the hand last passed */
+    int revalidating;           /* someone was handed the stale value */
+    int nvalues;
+    const char* key;
+    const char** values;
+    /* followed by the value pointers, the key and the values */
+} cache_entry;
+
+struct range_cache {
+    libcrange* lr;
+    const char* name;
+    const char* cache_name;     /* ours in libcrange's caches */
+    apr_interval_time_t ttl;
+    apr_interval_time_t stale;
+    size_t limit;
+    cache_entry** table;
+    size_t nbuckets;
+    cache_entry** ring;
+    size_t nentries;
+    size_t ring_size;
+    size_t hand;
+    range_cache_stats stats;
+#if APR_HAS_THREADS
+    apr_thread_mutex_t* mutex;
+#endif
+};
+
+static void cache_lock(range_cache* c)
+{
+#if APR_HAS_THREADS
+    if (c->mutex)
+        apr_thread_mutex_lock(c->mutex);
+#endif
+}
+
+static void cache_unlock(range_cache* c)
+{
+#if APR_HAS_THREADS
+    if (c->mutex)
+        apr_thread_mutex_unlock(c->mutex);
+#endif
+}
+
+static unsigned hash_key(const char* key)
+{
+    unsigned h = 2166136261U;
+    for (; *key; key++)
+        h = (h ^ (unsigned char)*key) * 16777619U;
+    return h;
+}
+
+static cache_entry** find(range_cache* c, const char* key, unsigned hash)
+{
+    cache_entry** p = &c->table[hash & (c->nbuckets - 1)];
+    for (; *p; p = &(*p)->next)
+        if ((*p)->hash == hash && strcmp((*p)->key, key) == 0)
+            break;
+    return p;
+}
+
+static void unlink_entry(range_cache* c, cache_entry** p)
+{
+    cache_entry* e = *p;
+
+    *p = e->next;
+    /* the last entry in the ring takes e's slot */
+    c->ring[e->slot] = c->ring[--c->nentries];
+    c->ring[e->slot]->slot = e->slot;
+    c->stats.entries = c->nentries;
+    c->stats.bytes -= e->size;
+    free(e);
+}
+
+static void evict_one(range_cache* c)
+{
+    for (;;) {
+        cache_entry* e;
+        if (c->hand >= c->nentries)
+            c->hand = 0;
+        e = c->ring[c->hand];
+        if (e->used) {
+            e->used = 0;
+            c->hand++;
+            continue;
+        }
+        unlink_entry(c, find(c, e->key, e->hash));
+        c->stats.evictions++;
+        return;
+    }
+}
+
+static int grow(range_cache* c)
+{
+    size_t i;
+    size_t n = c->nbuckets * 2;
+    cache_entry** table = calloc(n, sizeof(cache_entry*));
+
+    if (!table)
+        return 0;
+    for (i = 0; i < c->nbuckets; i++) {
+        cache_entry* e = c->table[i];
+        while (e) {
+            cache_entry* next = e->next;
+            e->next = table[e->hash & (n - 1)];
+            table[e->hash & (n - 1)] = e;
+            e = next;
+        }
+    }
+    free(c->table);
+    c->table = table;
+    c->nbuckets = n;
+    return 1;
+}
+
+static apr_status_t cache_cleanup(void* data)
+{
+    range_cache* c = data;
+    size_t i;
+
+    for (i = 0; i < c->nentries; i++)
+        free(c->ring[i]);
+    free(c->ring);
+    free(c->table);
+    return APR_SUCCESS;
+}
+
+static apr_interval_time_t seconds(libcrange* lr, apr_pool_t* pool,
+                                   const char* name, const char* what)
+{
+    const char* cfg = libcrange_getcfg(lr, apr_psprintf(pool, "%s_%s",
+                                                         name, what));
+    return (apr_interval_time_t)((cfg ? atof(cfg) : 0) * APR_USEC_PER_SEC);
+}
+
+range_cache* libcrange_result_cache(libcrange* lr, const char* name)
+{
+    char key[256];
+    const char* cfg;
+    apr_pool_t* pool;
+    range_cache* c;
+
+    if (lr == NULL) lr = get_static_lr();
+    if (!lr->want_caching)
+        return NULL;
+
+    snprintf(key, sizeof key, "result_cache:%s", name);
+    libcrange_lock(lr);
+    if ((c = libcrange_get_cache(lr, key))) {
+        libcrange_unlock(lr);
+        return c;
+    }
+
+    pool = libcrange_cache_pool(lr, key);
+    c = apr_pcalloc(pool, sizeof(*c));
+    c->lr = lr;
+    c->name = apr_pstrdup(pool, name);
+    c->cache_name = apr_pstrdup(pool, key);
+    c->ttl = seconds(lr, pool, name, "cache_ttl");
+    c->stale = seconds(lr, pool, name, "cache_stale");
+    cfg = libcrange_getcfg(lr, apr_psprintf(pool, "%s_cache_size", name));
+    c->limit = cfg ? (size_t)atol(cfg) : DEFAULT_CACHE_SIZE;
+    c->nbuckets = 64;
+    c->table = calloc(c->nbuckets, sizeof(cache_entry*));
+    c->ring_size = 64;
+    c->ring = malloc(c->ring_size * sizeof(cache_entry*));
+    c->stats.limit = c->limit;
+#if APR_HAS_THREADS
+    apr_thread_mutex_create(&c->mutex, APR_THREAD_MUTEX_DEFAULT, pool);
+#endif
+    apr_pool_cleanup_register(pool, c, cache_cleanup, apr_pool_cleanup_null);
+    libcrange_set_cache(lr, key, c);
+    libcrange_unlock(lr);
+    return c;
+}
+
+int range_cache_enabled(range_cache* c)
+{
+    return c && c->ttl > 0;
+}
+
+/* a copy of e's values in pool */
+static const char** copy_values(apr_pool_t* pool, const cache_entry* e)
+{
+    const char* strings = (const char*)(e->values + e->nvalues + 1);
+    size_t len = (const char*)e + e->size - strings;
+    const char** values = apr_palloc(pool,
+                                     (e->nvalues + 1) * sizeof(char*));
+    char* copy = apr_pmemdup(pool, strings, len);
+    int i;
+
+    for (i = 0; i < e->nvalues; i++)
+        values[i] = copy + (e->values[i] - strings);
+    values[i] = NULL;
+    return values;
+}
+
+int range_cache_get(range_cache* c, const char* key, apr_pool_t* pool,
+                    const char*** values)
+{
+    apr_time_t now = apr_time_now();
+    cache_entry* e;
+    int ret;
+
+    *values = NULL;
+    if (!c || c->ttl <= 0)
+        return RANGE_CACHE_MISS;
+
+    cache_lock(c);
+    e = *find(c, key, hash_key(key));
+    if (!e || now >= e->expires + c->stale) {
+        if (e)
+            c->stats.expired++;
+        c->stats.misses++;
+        ret = RANGE_CACHE_MISS;
+    }
+    else {
+        if (now < e->expires || e->revalidating) {
+            /* fresh, or someone is already fetching it */
+            c->stats.hits++;
+            ret = RANGE_CACHE_HIT;
+        }
+        else {
+            e->revalidating = 1;
+            c->stats.stale++;
+            ret = RANGE_CACHE_STALE;
+        }
+        e->used = 1;
+        *values = copy_values(pool, e);
+    }
+    cache_unlock(c);
+    return ret;
+}
+
+void range_cache_put(range_cache* c, const char* key, const char** values)
+{
+    size_t size, klen;
+    int i, n;
+    unsigned hash;
+    size_t before;
+    cache_entry** p;
+    cache_entry* e;
+    char* s;
+
+    if (!c || c->ttl <= 0)
+        return;
+
+    klen = strlen(key) + 1;
+    size = sizeof(cache_entry) + klen;
+    for (n = 0; values[n]; n++)
+        size += strlen(values[n]) + 1;
+    size += (n + 1) * sizeof(char*);
+    if (size > c->limit)
+        return;
+    if (!(e = malloc(size)))
+        return;
+
+    e->size = size;
+    e->hash = hash = hash_key(key);
+    e->expires = apr_time_now() + c->ttl;
+    e->used = 0;
+    e->revalidating = 0;
+    e->nvalues = n;
+    e->values = (const char**)(e + 1);
+    s = (char*)(e->values + n + 1);
+    for (i = 0; i < n; i++) {
+        size_t len = strlen(values[i]) + 1;
+        memcpy(s, values[i], len);
+        e->values[i] = s;
+        s += len;
+    }
+    e->values[n] = NULL;
+    memcpy(s, key, klen);
+    e->key = s;
+
+    /* the charge below needs c still there: nobody evicts its cache
+     * while we hold the lock */
+    libcrange_lock(c->lr);
+    cache_lock(c);
+    before = c->stats.bytes;
+    p = find(c, key, hash);
+    if (*p)
+        unlink_entry(c, p);
+    while (c->nentries && c->stats.bytes + size > c->limit)
+        evict_one(c);
+
+    if (c->nentries == c->ring_size) {
+        cache_entry** ring = realloc(c->ring, 2 * c->ring_size *
+                                     sizeof(cache_entry*));
+        if (!ring) {
+            free(e);
+            goto done;
+        }
+        c->ring = ring;
+        c->ring_size *= 2;
+    }
+    if (c->nentries >= c->nbuckets)
+        grow(c);
+
+    p = &c->table[hash & (c->nbuckets - 1)];
+    e->next = *p;
+    *p = e;
+    e->slot = c->nentries;
+    c->ring[c->nentries++] = e;
+    c->stats.entries = c->nentries;
+    c->stats.bytes += size;
+    c->stats.inserts++;
+
+  done:
+    size = c->stats.bytes;
+    cache_unlock(c);
+    libcrange_cache_charge(c->lr, c->cache_name, (long)size - (long)before);
+    libcrange_unlock(c->lr);
+}
+
+void range_cache_get_stats(range_cache* c, range_cache_stats* stats)
+{
+    if (!c) {
+        memset(stats, 0, sizeof(*stats));
+        return;
+    }
+    cache_lock(c);
+    *stats = c->stats;
+    cache_unlock(c);
+}
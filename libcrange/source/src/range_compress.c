@@ -22,10 +22,11 @@ static node_parts_int* init_prev_parts(apr_pool_t* pool)
     return result;
 }
 
-static const char* ignore_common_prefix(apr_pool_t* pool, int n1, int n2)
+static const char* ignore_common_prefix(apr_pool_t* pool,
+                                        apr_int64_t n1, apr_int64_t n2)
 {
-    char* s1 = apr_itoa(pool, n1);
-    char* s2 = apr_itoa(pool, n2);
+    char* s1 = apr_psprintf(pool, "%" APR_INT64_T_FMT, n1);
+    char* s2 = apr_psprintf(pool, "%" APR_INT64_T_FMT, n2);
     int n, len1, len2;
     len1 = strlen(s1);
     len2 = strlen(s2);
@@ -0,0 +1,210 @@
+/*
+Copyright (c) 2011, Yahoo! Inc.  All rights reserved.
+Copyrights licensed under the New BSD License. See the accompanying LICENSE file for terms
+*/
+
+/* range_memo.c: memoized results of pure functions.
+ *
+ * A call is keyed on the function's name and a fingerprint of each
+ * argument. Within a request the results of RANGE_FUNC_PURE functions
+ * are kept in the request. Those of RANGE_FUNC_CACHEABLE ones also go
+ * into the "memo" result cache (memo_cache_ttl and friends in
+ * range.conf), with the generation of the module's data in the key, so
+ * that once a file it depends on changes the old results are never
+ * looked up again and age out.
+ *
+ * A cluster may be defined in terms of anything, so a cacheable call
+ * is only kept across requests if every call made inside it was too,
+ * from the same module's data: anything else counts as unshared.
+ *
+ * Callers own (and may destroy) what functions return, so the memo
+ * keeps copies and hands out copies. */
+
+#include <stdio.h>
+#include <string.h>
+#include <apr_strings.h>
+
+#include "libcrange.h"
+#include "range.h"
+#include "range_memo.h"
+#include "range_request.h"
+#include "set.h"
+
+#define MEMO_CACHE "memo"
+
+struct range_memo_state {
+    set* results;           /* key -> memo_entry */
+    const char** depends;   /* of the cacheable call running */
+    unsigned unshared;      /* calls whose results were request only */
+    int cache;              /* the memo cache is on; -1 till we know */
+};
+
+typedef struct memo_entry {
+    range* r;
+    int shared;             /* could be, and maybe was, kept across
+                             * requests */
+} memo_entry;
+
+range_memo_state* range_memo_state_new(apr_pool_t* pool)
+{
+    range_memo_state* st = apr_pcalloc(pool, sizeof(*st));
+    st->results = set_new(pool, 0);
+    st->cache = -1;
+    return st;
+}
+
+/* once a request: with the memo cache off there's no generation to
+ * take, nor anything to put */
+static int memo_cache_on(libcrange* lr, range_memo_state* st)
+{
+    if (st->cache < 0) {
+        libcrange_lock(lr);
+        st->cache = range_cache_enabled(libcrange_result_cache(lr,
+                                                               MEMO_CACHE));
+        libcrange_unlock(lr);
+    }
+    return st->cache;
+}
+
+static apr_uint64_t hash_name(const char* name, size_t len)
+{
+    apr_uint64_t h = 14695981039346656037ULL;
+    size_t i;
+    for (i = 0; i < len; i++)
+        h = (h ^ (unsigned char)name[i]) * 1099511628211ULL;
+    return h;
+}
+
+/* spreads each name's hash over all 64 bits before they're summed */
+static apr_uint64_t mix(apr_uint64_t h)
+{
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+    return h ^ (h >> 31);
+}
+
+/* a fingerprint of r that doesn't depend on the order its members come
+ * in, so there's no need to sort them: how many, and the sum and xor of
+ * their hashes */
+static const char* fingerprint(apr_pool_t* pool, const range* r)
+{
+    apr_uint64_t sum = 0, xor = 0;
+    set_iter it;
+    set_element* e;
+
+    set_iter_init(&it, r->nodes);
+    while ((e = set_iter_next(&it))) {
+        apr_uint64_t h = hash_name(e->name, e->len);
+        sum += mix(h);
+        xor ^= h;
+    }
+    return apr_psprintf(pool, "%lu.%llx.%llx%s",
+                        (unsigned long)r->nodes->members,
+                        (unsigned long long)sum, (unsigned long long)xor,
+                        r->quoted ? "q" : "");
+}
+
+void range_memo_begin(range_memo* m, range_request* rr,
+                      const range_function_desc* f, const char* funcname,
+                      const range** args)
+{
+    range_memo_state* st = range_request_memo(rr);
+    apr_pool_t* pool = range_request_pool(rr);
+    libcrange* lr = range_request_lr(rr);
+    const char* gen;
+    char* key;
+    int i;
+
+    m->key = m->cache_key = NULL;
+    m->depends = NULL;
+    m->outer = st->depends;
+    m->unshared = st->unshared;
+    st->depends = NULL;
+    if (!(f->flags & RANGE_FUNC_PURE))
+        return;
+
+    key = apr_pstrcat(pool, funcname, "(", NULL);
+    for (i = 0; args[i]; i++)
+        key = apr_pstrcat(pool, key, i ? ";" : "",
+                          fingerprint(pool, args[i]), NULL);
+    m->key = key = apr_pstrcat(pool, key, ")", NULL);
+
+    /* the generation is taken before the call: data that changes while
+     * it runs is keyed under the old one, which nobody asks for again */
+    if ((f->flags & RANGE_FUNC_CACHEABLE) && memo_cache_on(lr, st) &&
+        (gen = libcrange_function_generation(lr, pool, funcname))) {
+        m->cache_key = apr_pstrcat(pool, key, "@", gen, NULL);
+        st->depends = m->depends = libcrange_function_depends(lr, funcname);
+    }
+}
+
+range* range_memo_get(range_request* rr, range_memo* m)
+{
+    range_memo_state* st = range_request_memo(rr);
+    apr_pool_t* pool = range_request_pool(rr);
+    libcrange* lr = range_request_lr(rr);
+    const char** values;
+    memo_entry* e;
+    range* r;
+    int found;
+
+    if (!m->key)
+        return NULL;
+    if ((e = set_get_data(st->results, m->key))) {
+        if (!e->shared)
+            m->cache_key = NULL;
+        return copy_range(pool, e->r);
+    }
+    if (!m->cache_key)
+        return NULL;
+
+    /* a stale entry is as good as a miss: we're about to call anyway.
+     * The lock keeps the cache from being evicted while we look */
+    libcrange_lock(lr);
+    found = range_cache_get(libcrange_result_cache(lr, MEMO_CACHE),
+                            m->cache_key, pool, &values);
+    libcrange_unlock(lr);
+    if (found != RANGE_CACHE_HIT)
+        return NULL;
+    r = range_from_hostnames(rr, values);
+    e = apr_palloc(pool, sizeof(*e));
+    e->r = copy_range(pool, r);
+    e->shared = 1;
+    set_add(st->results, m->key, e);
+    return r;
+}
+
+void range_memo_end(range_request* rr, range_memo* m, const range* r,
+                    int keep)
+{
+    range_memo_state* st = range_request_memo(rr);
+    apr_pool_t* pool = range_request_pool(rr);
+    int shared = m->cache_key && st->unshared == m->unshared;
+    memo_entry* e;
+
+    st->depends = m->outer;
+    if (keep && m->key) {
+        e = apr_palloc(pool, sizeof(*e));
+        e->r = copy_range(pool, r);
+        e->shared = shared;
+        set_add(st->results, m->key, e);
+        /* the cache holds plain names */
+        if (shared && !r->quoted) {
+            libcrange* lr = range_request_lr(rr);
+            const char** names = range_get_hostnames(pool, r);
+
+            libcrange_lock(lr);
+            range_cache_put(libcrange_result_cache(lr, MEMO_CACHE),
+                            m->cache_key, names);
+            libcrange_unlock(lr);
+        }
+    }
+    /* the call we're inside only has its own module's generation */
+    if (!shared || m->depends != m->outer)
+        st->unshared++;
+}
+
+void range_memo_unshared(range_request* rr)
+{
+    range_request_memo(rr)->unshared++;
+}
@@ -0,0 +1,40 @@
+/*
+Copyright (c) 2011, Yahoo! Inc.  All rights reserved.
+Copyrights licensed under the New BSD License. See the accompanying LICENSE file for terms
+*/
+
+#ifndef RANGE_MEMO_H
+#define RANGE_MEMO_H
+
+#include "libcrange.h"
+
+struct range;
+
+/* what a request has memoized, from range_request_memo */
+typedef struct range_memo_state range_memo_state;
+range_memo_state* range_memo_state_new(apr_pool_t* pool);
+
+/* one call to a function: begin, get, and end whether or not get found
+ * the result. keep says whether it's worth memoizing (no warnings) */
+typedef struct range_memo {
+    const char* key;        /* name and argument fingerprints; NULL if
+                             * the function isn't pure */
+    const char* cache_key;  /* and data generation, for keeping across
+                             * requests; NULL if it can't be */
+    const char** depends;   /* the module's data */
+    const char** outer;     /* that of the cacheable call we're inside */
+    unsigned unshared;      /* the request's count when we began */
+} range_memo;
+
+void range_memo_begin(range_memo* m, range_request* rr,
+                      const range_function_desc* f, const char* funcname,
+                      const struct range** args);
+/* a copy of the memoized result, or NULL */
+struct range* range_memo_get(range_request* rr, range_memo* m);
+void range_memo_end(range_request* rr, range_memo* m, const struct range* r,
+                    int keep);
+/* for calls that don't go through begin and end (perl functions): none
+ * of the calls they're inside can be kept across requests */
+void range_memo_unshared(range_request* rr);
+
+#endif /* RANGE_MEMO_H */
@@ -23,7 +23,7 @@ node_parts_int* node_to_parts(apr_pool_t* pool, const char* node_name)
     if (count > 0) {
         result->prefix = libcrange_get_pcre_substring(pool, node_name, offsets, 1);
         result->num_str = libcrange_get_pcre_substring(pool, node_name, offsets, 2);
-        result->num = atoi(result->num_str);
+        result->num = apr_strtoi64(result->num_str, NULL, 10);
         result->domain = count > 3 ? libcrange_get_pcre_substring(pool, node_name, offsets, 3) : "";
     }
     else {
@@ -12,7 +12,7 @@ typedef struct node_parts_int
 {
     const char* prefix;
     const char* domain;
-    int num;
+    apr_int64_t num;
     const char* num_str;
     const char* full_name;
 } node_parts_int;
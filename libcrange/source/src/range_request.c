@@ -12,14 +12,18 @@ Copyrights licensed under the New BSD License. See the accompanying LICENSE file
 #include "libcrange.h"
 #include "set.h"
 #include "range_compress.h"
+#include "range_sort.h"
+#include "range_memo.h"
 
 struct range_request {
     apr_pool_t* pool;
     char* warnings;
     set* warn_type;
     int warn_enabled;
+    unsigned nwarnings;     /* issued, enabled or not */
     struct libcrange* lr;
     range* r;
+    struct range_memo_state* memo;
 };
 
 range_request* range_request_new(struct libcrange* lr, apr_pool_t* pool) 
@@ -30,7 +34,9 @@ range_request* range_request_new(struct libcrange* lr, apr_pool_t* pool)
     res->warnings = NULL;
     res->warn_type = NULL;
     res->warn_enabled = 1;
+    res->nwarnings = 0;
     res->r = NULL;
+    res->memo = NULL;
 
     return res;
 }
@@ -50,6 +56,18 @@ void range_request_enable_warns(range_request* rr)
     rr->warn_enabled = 1;
 }
 
+unsigned range_request_warning_count(range_request* rr)
+{
+    return rr->nwarnings;
+}
+
+struct range_memo_state* range_request_memo(range_request* rr)
+{
+    if (!rr->memo)
+        rr->memo = range_memo_state_new(rr->pool);
+    return rr->memo;
+}
+
 const char* range_request_compressed(range_request* rr)
 {
     return do_range_compress(rr, rr->r);
@@ -109,12 +127,62 @@ const char** range_request_nodes(range_request* rr)
     return range_get_hostnames(rr->pool, rr->r);
 }
 
+const char** range_request_nodes_sorted(range_request* rr)
+{
+    assert(rr->r);
+    return do_range_sort(rr, rr->r);
+}
+
+size_t range_request_node_count(range_request* rr)
+{
+    assert(rr->r);
+    return rr->r->nodes->members;
+}
+
+int range_request_is_quoted(range_request* rr)
+{
+    assert(rr->r);
+    return rr->r->quoted;
+}
+
+int range_request_foreach(range_request* rr, range_node_fn fn, void* data)
+{
+    int ret;
+    set_iter it;
+    set_element* e;
+
+    assert(rr->r);
+    set_iter_init(&it, rr->r->nodes);
+    while ((e = set_iter_next(&it)))
+        if ((ret = (*fn)(data, e->name, e->len)))
+            return ret;
+
+    return 0;
+}
+
+void range_request_iter(range_request* rr, range_node_iter* it)
+{
+    assert(rr->r);
+    set_iter_init(it, rr->r->nodes);
+}
+
+int range_node_iter_next(range_node_iter* it, const char** name, size_t* len)
+{
+    set_element* e = set_iter_next(it);
+    if (!e) return 0;
+
+    *name = e->name;
+    *len = e->len;
+    return 1;
+}
+
 void range_request_warn(range_request* rr, const char* fmt, ...)
 {
     va_list ap;
     char* p = rr->warnings;
     char* warn;
 
+    rr->nwarnings++;
     if (!rr->warn_enabled) return;
     
     va_start(ap, fmt);
@@ -131,6 +199,7 @@ void range_request_warn_type(range_request* rr, const char* type, const char* no
 {
     range* nodes;
 
+    rr->nwarnings++;
     if (!rr->warn_enabled) return;
 
     if (!rr->warn_type)
@@ -12,6 +12,7 @@ Copyrights licensed under the New BSD License. See the accompanying LICENSE file
  * internal libcrange functions */
 
 struct range;
+struct range_memo_state;
 
 range_request* range_request_new(libcrange* lr, apr_pool_t* pool);
 void range_request_warn(range_request* rr, const char* fmt, ...);
@@ -19,6 +20,10 @@ void range_request_warn_type(range_request* rr, const char* type, const char* no
 int range_request_warn_enabled(range_request* rr);
 void range_request_disable_warns(range_request* rr);
 void range_request_enable_warns(range_request* rr);
+/* warnings issued so far, counting those that weren't enabled */
+unsigned range_request_warning_count(range_request* rr);
+/* function results memoized for this request: see range_memo.c */
+struct range_memo_state* range_request_memo(range_request* rr);
 
 apr_pool_t* range_request_pool(range_request* rr);
 apr_pool_t* range_request_lr_pool(range_request* rr);
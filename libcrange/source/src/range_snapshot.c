@@ -0,0 +1,350 @@
+/*
+Copyright (c) 2011, Yahoo! Inc.  All rights reserved.
+Copyrights licensed under the New BSD License. See the accompanying LICENSE file for terms
+*/
+
+/* range_snapshot.c: save module caches to disk and map them back.
+ *
+ * A snapshot is a sequence of records, each a 32 bit type followed by
+ * its fields:
+ *
+ *   header   "RNGSNAP\0" version
+ *   MODULE   name                  following entries belong to name
+ *   ENTRY    key                   one cached item
+ *   DEPENDS  path mtime size       a file the entry was built from
+ *   PAIR     name value            the entry's data
+ *   END
+ *
+ * Strings are a 32 bit length (NO_STRING for NULL) followed by the
+ * bytes and a '\0', so the loader can hand out pointers straight into
+ * the mapping. Snapshots are only meant to be read back on the host
+ * that wrote them: numbers are in native byte order. */
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <apr_strings.h>
+
+#include "libcrange.h"
+#include "set.h"
+
+libcrange* get_static_lr(void);
+
+#define SNAPSHOT_MAGIC "RNGSNAP"
+#define SNAPSHOT_VERSION 1
+#define NO_STRING 0xffffffffU
+
+enum { REC_MODULE = 1, REC_ENTRY, REC_DEPENDS, REC_PAIR, REC_END };
+
+struct range_snapshot {
+    libcrange* lr;
+    /* writing */
+    FILE* fp;
+    int failed;
+    /* reading */
+    const char* p;
+    const char* end;
+};
+
+
+static void put_bytes(range_snapshot* s, const void* data, size_t len)
+{
+    if (!s->failed && fwrite(data, 1, len, s->fp) != len)
+        s->failed = 1;
+}
+
+static void put_u32(range_snapshot* s, apr_uint32_t n)
+{
+    put_bytes(s, &n, sizeof n);
+}
+
+static void put_i64(range_snapshot* s, apr_int64_t n)
+{
+    put_bytes(s, &n, sizeof n);
+}
+
+static void put_string(range_snapshot* s, const char* str)
+{
+    if (!str) {
+        put_u32(s, NO_STRING);
+        return;
+    }
+    put_u32(s, strlen(str));
+    put_bytes(s, str, strlen(str) + 1);
+}
+
+void range_snapshot_entry(range_snapshot* s, const char* key)
+{
+    put_u32(s, REC_ENTRY);
+    put_string(s, key);
+}
+
+void range_snapshot_depends(range_snapshot* s, const char* path)
+{
+    struct stat st;
+
+    if (stat(path, &st) < 0) {
+        /* the entry can't be validated: make sure it never is */
+        st.st_mtime = -1;
+        st.st_size = -1;
+    }
+    put_u32(s, REC_DEPENDS);
+    put_string(s, path);
+    put_i64(s, st.st_mtime);
+    put_i64(s, st.st_size);
+}
+
+void range_snapshot_put(range_snapshot* s, const char* name,
+                        const char* value)
+{
+    put_u32(s, REC_PAIR);
+    put_string(s, name);
+    put_string(s, value);
+}
+
+int libcrange_snapshot_save(libcrange* lr, const char* path)
+{
+    range_snapshot s;
+    set_iter it;
+    set_element* module;
+    char* tmp;
+    apr_pool_t* pool;
+    int ret = 0;
+
+    if (lr == NULL) lr = get_static_lr();
+
+    pool = libcrange_pool_new(lr);
+    tmp = apr_psprintf(pool, "%s.%d.tmp", path, (int)getpid());
+    memset(&s, 0, sizeof s);
+    s.lr = lr;
+    if (!(s.fp = fopen(tmp, "w"))) {
+        fprintf(stderr, "%s: %s\n", tmp, strerror(errno));
+        libcrange_pool_destroy(lr, pool);
+        return -1;
+    }
+
+    put_bytes(&s, SNAPSHOT_MAGIC, sizeof SNAPSHOT_MAGIC);
+    put_u32(&s, SNAPSHOT_VERSION);
+
+    /* the caches must not change under us */
+    libcrange_lock(lr);
+    for (set_iter_init(&it, lr->modules); (module = set_iter_next(&it)); ) {
+        const range_module_desc* desc = module->data;
+        if (!desc->snapshot_save)
+            continue;
+        put_u32(&s, REC_MODULE);
+        put_string(&s, module->name);
+        (*desc->snapshot_save)(lr, &s);
+    }
+    libcrange_unlock(lr);
+    put_u32(&s, REC_END);
+
+    if (fflush(s.fp) != 0 || fsync(fileno(s.fp)) != 0)
+        s.failed = 1;
+    if (fclose(s.fp) != 0)
+        s.failed = 1;
+
+    if (s.failed || rename(tmp, path) != 0) {
+        fprintf(stderr, "%s: can't write snapshot: %s\n", path,
+                strerror(errno));
+        unlink(tmp);
+        ret = -1;
+    }
+    libcrange_pool_destroy(lr, pool);
+    return ret;
+}
+
+/* reading: every get_ checks bounds, a short or corrupt file just ends
+ * the load */
+static int get_u32(range_snapshot* s, apr_uint32_t* n)
+{
+    if (s->end - s->p < (long)sizeof *n)
+        return 0;
+    memcpy(n, s->p, sizeof *n);
+    s->p += sizeof *n;
+    return 1;
+}
+
+static int get_i64(range_snapshot* s, apr_int64_t* n)
+{
+    if (s->end - s->p < (long)sizeof *n)
+        return 0;
+    memcpy(n, s->p, sizeof *n);
+    s->p += sizeof *n;
+    return 1;
+}
+
+static int get_string(range_snapshot* s, const char** str)
+{
+    apr_uint32_t len;
+
+    if (!get_u32(s, &len))
+        return 0;
+    if (len == NO_STRING) {
+        *str = NULL;
+        return 1;
+    }
+    if ((apr_uint64_t)(s->end - s->p) < (apr_uint64_t)len + 1 ||
+        s->p[len] != '\0')
+        return 0;
+    *str = s->p;
+    s->p += len + 1;
+    return 1;
+}
+
+static int peek_type(range_snapshot* s)
+{
+    apr_uint32_t type;
+    const char* p = s->p;
+
+    if (!get_u32(s, &type))
+        return REC_END;
+    s->p = p;
+    return type;
+}
+
+static int fresh(const char* path, apr_int64_t mtime, apr_int64_t size)
+{
+    struct stat st;
+    return stat(path, &st) == 0 && st.st_mtime == mtime &&
+        st.st_size == size;
+}
+
+int range_snapshot_get(range_snapshot* s, const char** name,
+                       const char** value)
+{
+    apr_uint32_t type;
+
+    if (peek_type(s) != REC_PAIR)
+        return 0;
+    get_u32(s, &type);
+    if (get_string(s, name) && get_string(s, value))
+        return 1;
+    s->p = s->end;
+    return 0;
+}
+
+int range_snapshot_next_entry(range_snapshot* s, const char** key)
+{
+    for (;;) {
+        apr_uint32_t type;
+        int valid = 1;
+        const char* k;
+
+        /* pairs the module didn't read */
+        while (peek_type(s) == REC_PAIR) {
+            const char* name;
+            const char* value;
+            if (!range_snapshot_get(s, &name, &value))
+                return 0;
+        }
+
+        if (peek_type(s) != REC_ENTRY)
+            return 0;
+        get_u32(s, &type);
+        if (!get_string(s, &k))
+            break;
+
+        while (peek_type(s) == REC_DEPENDS) {
+            const char* path;
+            apr_int64_t mtime, size;
+            get_u32(s, &type);
+            if (!get_string(s, &path) || !get_i64(s, &mtime) ||
+                !get_i64(s, &size)) {
+                s->p = s->end;
+                return 0;
+            }
+            if (valid && !fresh(path, mtime, size))
+                valid = 0;
+        }
+
+        if (valid) {
+            *key = k;
+            return 1;
+        }
+    }
+    s->p = s->end;
+    return 0;
+}
+
+typedef struct mapping {
+    void* addr;
+    size_t len;
+} mapping;
+
+static apr_status_t unmap(void* data)
+{
+    mapping* m = data;
+    munmap(m->addr, m->len);
+    return APR_SUCCESS;
+}
+
+int libcrange_snapshot_load(libcrange* lr, const char* path)
+{
+    range_snapshot s;
+    struct stat st;
+    mapping* m;
+    const char* base;
+    apr_uint32_t version;
+    int fd;
+
+    if (lr == NULL) lr = get_static_lr();
+
+    if ((fd = open(path, O_RDONLY)) < 0)
+        return -1;
+    if (fstat(fd, &st) < 0 ||
+        st.st_size < (off_t)(sizeof SNAPSHOT_MAGIC + sizeof version)) {
+        close(fd);
+        return -1;
+    }
+
+    memset(&s, 0, sizeof s);
+    s.lr = lr;
+    s.p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (s.p == MAP_FAILED)
+        return -1;
+    s.end = s.p + st.st_size;
+    base = s.p;
+
+    s.p += sizeof SNAPSHOT_MAGIC;
+    get_u32(&s, &version);
+    if (memcmp(base, SNAPSHOT_MAGIC, sizeof SNAPSHOT_MAGIC) != 0 ||
+        version != SNAPSHOT_VERSION) {
+        fprintf(stderr, "%s: not a range snapshot\n", path);
+        munmap((void*)base, st.st_size);
+        return -1;
+    }
+
+    /* loaded entries point into the mapping */
+    libcrange_lock(lr);
+    m = apr_palloc(lr->pool, sizeof(*m));
+    m->addr = (void*)base;
+    m->len = st.st_size;
+    apr_pool_cleanup_register(lr->pool, m, unmap, apr_pool_cleanup_null);
+
+    while (peek_type(&s) == REC_MODULE) {
+        apr_uint32_t type;
+        const char* name;
+        const char* key;
+        const range_module_desc* desc;
+
+        get_u32(&s, &type);
+        if (!get_string(&s, &name))
+            break;
+
+        if ((desc = libcrange_get_module(lr, name)) && desc->snapshot_load)
+            (*desc->snapshot_load)(lr, &s);
+        /* skip whatever the module didn't take */
+        while (range_snapshot_next_entry(&s, &key))
+            ;
+    }
+    libcrange_unlock(lr);
+
+    return peek_type(&s) == REC_END ? 0 : -1;
+}
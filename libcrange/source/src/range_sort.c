@@ -14,7 +14,7 @@ Copyrights licensed under the New BSD License. See the accompanying LICENSE file
 
 static int compare_parts(const node_parts_int** ptr_a, const node_parts_int** ptr_b)
 {
-    int pre, domain, num;
+    int pre, domain;
     const node_parts_int* a = *ptr_a;
     const node_parts_int* b = *ptr_b;
 
@@ -24,8 +24,7 @@ static int compare_parts(const node_parts_int** ptr_a, const node_parts_int** pt
     domain = strcmp(a->domain, b->domain);
     if (domain) return domain;
 
-    num = a->num - b->num;
-    if (num) return num;
+    if (a->num != b->num) return a->num < b->num ? -1 : 1;
 
     return strcmp(a->full_name, b->full_name);
 }
@@ -0,0 +1,616 @@
+/*
+Copyright (c) 2011, Yahoo! Inc.  All rights reserved.
+Copyrights licensed under the New BSD License. See the accompanying LICENSE file for terms
+*/
+
+/* range_watch.c: background reload of module data and file freshness.
+ *
+ * Modules call libcrange_watch() for the files and directories they
+ * read. libcrange_watch_start() starts a thread that follows them with
+ * inotify and, once a burst of changes has settled, calls each module's
+ * reload callback. Files are watched through their parent directory so
+ * that replace-by-rename (what editors and rsync do) is seen too.
+ * Directories are watched with all their subdirectories.
+ *
+ * libcrange_file_generation() gives modules a cheap freshness check.
+ * Each file asked about gets a record with a generation counter. Under
+ * a running watcher the record is only stat()ed again after an event
+ * for it; without one it's stat()ed at most every freshness_interval. */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <apr_pools.h>
+#include <apr_strings.h>
+#include <apr_tables.h>
+#include <apr_time.h>
+
+#include "libcrange.h"
+#include "set.h"
+
+#if defined(__linux__) && APR_HAS_THREADS
+#define HAVE_WATCHER 1
+#include <poll.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/inotify.h>
+#include <apr_thread_mutex.h>
+#include <apr_thread_proc.h>
+#endif
+
+libcrange* get_static_lr(void);
+
+/* how long a file has to be quiet before its callbacks run */
+#define WATCH_SETTLE_MS 100
+#define DEFAULT_FRESHNESS_INTERVAL 1
+
+#define DIR_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | \
+                    IN_CREATE | IN_DELETE | IN_ATTRIB)
+
+typedef struct watch_entry {
+    const char* path;
+    const char* base;  /* for files: the name inside the parent dir */
+    int is_dir;
+    libcrange_watch_fn fn;
+    void* data;
+} watch_entry;
+
+/* one inotify watch */
+typedef struct watch_dir {
+    const char* path;
+    apr_array_header_t* trees;  /* watch_entry* registered dirs above us */
+    apr_array_header_t* files;  /* watch_entry* files in this dir */
+} watch_dir;
+
+/* freshness record for one file */
+typedef struct fresh_file {
+    const char* path;
+    long gen;
+    int exists;
+    time_t mtime;
+    off_t size;
+    ino_t ino;
+    apr_time_t checked;
+    int covered;  /* under a registered watch */
+    int dirty;    /* the watcher saw a change nobody has reloaded */
+    int pending;  /* change being dispatched to reload callbacks */
+} fresh_file;
+
+struct range_watch {
+    apr_pool_t* pool;
+    apr_array_header_t* entries;  /* watch_entry* */
+    set* dirs;                    /* wd -> watch_dir */
+    set* files;                   /* path -> fresh_file */
+    apr_interval_time_t interval;
+    int uncovered;                /* files no watch covers */
+    long version;                 /* libcrange_data_version */
+    apr_time_t version_checked;
+    int running;
+    int fd;
+#ifdef HAVE_WATCHER
+    apr_thread_mutex_t* mutex;
+    apr_thread_t* thread;
+#endif
+};
+
+#ifdef HAVE_WATCHER
+#define WATCH_LOCK(w) apr_thread_mutex_lock((w)->mutex)
+#define WATCH_UNLOCK(w) apr_thread_mutex_unlock((w)->mutex)
+#else
+#define WATCH_LOCK(w)
+#define WATCH_UNLOCK(w)
+#endif
+
+static struct range_watch* get_watch(libcrange* lr)
+{
+    struct range_watch* w = lr->watch;
+    apr_pool_t* pool;
+    if (w)
+        return w;
+
+    /* our own pool: the watcher allocates from it while requests
+     * allocate from lr->pool */
+    pool = libcrange_pool_new(lr);
+    w = apr_pcalloc(pool, sizeof(*w));
+    w->pool = pool;
+    w->entries = apr_array_make(w->pool, 8, sizeof(watch_entry*));
+    w->files = set_new(w->pool, 0);
+    w->interval = -1;
+    w->fd = -1;
+#ifdef HAVE_WATCHER
+    apr_thread_mutex_create(&w->mutex, APR_THREAD_MUTEX_DEFAULT, w->pool);
+#endif
+    lr->watch = w;
+    return w;
+}
+
+static int under(const char* path, const char* dir)
+{
+    size_t len = strlen(dir);
+    return strncmp(path, dir, len) == 0 && path[len] == '/';
+}
+
+/* stat f->path; returns true if anything changed. Called with the
+ * watch mutex held */
+static int fresh_stat(fresh_file* f)
+{
+    struct stat st;
+    int exists = stat(f->path, &st) == 0;
+
+    f->checked = apr_time_now();
+    if (!exists) {
+        if (!f->exists)
+            return 0;
+        f->exists = 0;
+        return 1;
+    }
+
+    if (f->exists && f->mtime == st.st_mtime && f->size == st.st_size &&
+        f->ino == st.st_ino)
+        return 0;
+
+    f->exists = 1;
+    f->mtime = st.st_mtime;
+    f->size = st.st_size;
+    f->ino = st.st_ino;
+    return 1;
+}
+
+/* called with the watch mutex held */
+static apr_interval_time_t watch_interval(libcrange* lr,
+                                          struct range_watch* w)
+{
+    if (w->interval < 0) {
+        const char* cfg = libcrange_getcfg(lr, "freshness_interval");
+        w->interval = (apr_interval_time_t)
+            ((cfg ? atof(cfg) : DEFAULT_FRESHNESS_INTERVAL) *
+             APR_USEC_PER_SEC);
+    }
+    return w->interval;
+}
+
+/* called with the watch mutex held */
+static fresh_file* fresh_get(libcrange* lr, struct range_watch* w,
+                             const char* path)
+{
+    fresh_file* f = set_get_data(w->files, path);
+    int i;
+
+    if (f)
+        return f;
+
+    watch_interval(lr, w);
+    f = apr_pcalloc(w->pool, sizeof(*f));
+    f->path = apr_pstrdup(w->pool, path);
+    f->gen = 1;
+    fresh_stat(f);
+    for (i = 0; i < w->entries->nelts; i++) {
+        watch_entry* e = ((watch_entry**)w->entries->elts)[i];
+        if (!strcmp(path, e->path) || (e->is_dir && under(path, e->path)))
+            f->covered = 1;
+    }
+    if (!f->covered)
+        w->uncovered++;
+    set_add(w->files, path, f);
+    return f;
+}
+
+long libcrange_file_generation(libcrange* lr, const char* path)
+{
+    struct range_watch* w;
+    fresh_file* f;
+    long gen;
+
+    if (lr == NULL) lr = get_static_lr();
+    w = get_watch(lr);
+
+    WATCH_LOCK(w);
+    f = fresh_get(lr, w, path);
+    if (f->dirty) {
+        /* the watcher told us it changed */
+        fresh_stat(f);
+        f->gen++;
+        f->dirty = 0;
+        w->version++;
+    }
+    else if (!(w->running && f->covered) &&
+             apr_time_now() - f->checked >= w->interval) {
+        if (fresh_stat(f)) {
+            f->gen++;
+            w->version++;
+        }
+    }
+    gen = f->exists ? f->gen : -1;
+    WATCH_UNLOCK(w);
+
+    return gen;
+}
+
+long libcrange_file_refresh(libcrange* lr, const char* path)
+{
+    struct range_watch* w;
+    fresh_file* f;
+    long gen;
+
+    if (lr == NULL) lr = get_static_lr();
+    w = get_watch(lr);
+
+    WATCH_LOCK(w);
+    f = fresh_get(lr, w, path);
+    fresh_stat(f);
+    f->gen++;
+    f->dirty = f->pending = 0;
+    w->version++;
+    gen = f->exists ? f->gen : -1;
+    WATCH_UNLOCK(w);
+
+    return gen;
+}
+
+long libcrange_data_version(libcrange* lr)
+{
+    struct range_watch* w;
+    long version;
+
+    if (lr == NULL) lr = get_static_lr();
+    w = get_watch(lr);
+
+    WATCH_LOCK(w);
+    /* without events for every file, anything may have changed once
+     * the files are due for another stat */
+    if (!w->running || w->uncovered) {
+        apr_time_t now = apr_time_now();
+        if (now - w->version_checked >= watch_interval(lr, w)) {
+            w->version++;
+            w->version_checked = now;
+        }
+    }
+    version = w->version;
+    WATCH_UNLOCK(w);
+
+    return version;
+}
+
+#ifdef HAVE_WATCHER
+static watch_dir* add_dir_watch(struct range_watch* w, const char* path)
+{
+    char key[16];
+    watch_dir* d;
+    int wd = inotify_add_watch(w->fd, path, DIR_EVENTS | IN_ONLYDIR);
+
+    if (wd < 0) {
+        if (errno != ENOENT)
+            fprintf(stderr, "libcrange: can't watch %s: %s\n", path,
+                    strerror(errno));
+        return NULL;
+    }
+
+    snprintf(key, sizeof key, "%d", wd);
+    if ((d = set_get_data(w->dirs, key)))
+        return d;
+
+    d = apr_palloc(w->pool, sizeof(*d));
+    d->path = apr_pstrdup(w->pool, path);
+    d->trees = apr_array_make(w->pool, 1, sizeof(watch_entry*));
+    d->files = apr_array_make(w->pool, 1, sizeof(watch_entry*));
+    set_add(w->dirs, key, d);
+    return d;
+}
+
+static void add_tree_watch(struct range_watch* w, watch_entry* e,
+                           const char* path)
+{
+    DIR* dir;
+    struct dirent* de;
+    watch_dir* d = add_dir_watch(w, path);
+
+    if (!d)
+        return;
+    *(watch_entry**)apr_array_push(d->trees) = e;
+
+    if (!(dir = opendir(path)))
+        return;
+    while ((de = readdir(dir))) {
+        struct stat st;
+        char* sub;
+        if (de->d_name[0] == '.')
+            continue;
+        sub = apr_pstrcat(w->pool, path, "/", de->d_name, NULL);
+        if (stat(sub, &st) == 0 && S_ISDIR(st.st_mode))
+            add_tree_watch(w, e, sub);
+    }
+    closedir(dir);
+}
+
+/* called with w->mutex held */
+static void add_entry_watch(struct range_watch* w, watch_entry* e)
+{
+    if (e->is_dir)
+        add_tree_watch(w, e, e->path);
+    else {
+        const char* slash = strrchr(e->path, '/');
+        const char* dir = slash ?
+            apr_pstrndup(w->pool, e->path, slash == e->path ? 1 :
+                         slash - e->path) : ".";
+        watch_dir* d = add_dir_watch(w, dir);
+        if (d)
+            *(watch_entry**)apr_array_push(d->files) = e;
+    }
+}
+
+typedef struct pending {
+    watch_entry* entry;
+    const char* path;
+} pending;
+
+/* what the watcher collects until things settle */
+typedef struct batch {
+    apr_pool_t* pool;
+    set* seen;
+    apr_array_header_t* todo;     /* pending: callbacks to run */
+    apr_array_header_t* touched;  /* const char*: changed paths */
+    apr_array_header_t* new_dirs; /* const char*: directories that appeared */
+} batch;
+
+static void batch_reset(batch* b)
+{
+    apr_pool_clear(b->pool);
+    b->seen = set_new(b->pool, 0);
+    b->todo = apr_array_make(b->pool, 16, sizeof(pending));
+    b->touched = apr_array_make(b->pool, 16, sizeof(const char*));
+    b->new_dirs = apr_array_make(b->pool, 1, sizeof(const char*));
+}
+
+static void add_pending(batch* b, watch_entry* e, const char* path)
+{
+    const char* key = apr_psprintf(b->pool, "%p %s", (void*)e, path);
+    pending* p;
+
+    if (set_get(b->seen, key))
+        return;
+    set_add(b->seen, key, NULL);
+
+    p = apr_array_push(b->todo);
+    p->entry = e;
+    p->path = apr_pstrdup(b->pool, path);
+}
+
+static void add_touched(batch* b, const char* path)
+{
+    if (set_get(b->seen, path))
+        return;
+    set_add(b->seen, path, NULL);
+    *(const char**)apr_array_push(b->touched) = apr_pstrdup(b->pool, path);
+}
+
+static void handle_event(struct range_watch* w, batch* b,
+                         const struct inotify_event* ev)
+{
+    char key[16];
+    const char* path;
+    watch_dir* d;
+    int i;
+
+    if (ev->mask & IN_Q_OVERFLOW) {
+        /* lost events: everything may have changed */
+        set_iter it;
+        set_element* elt;
+        for (i = 0; i < w->entries->nelts; i++) {
+            watch_entry* e = ((watch_entry**)w->entries->elts)[i];
+            add_pending(b, e, e->path);
+        }
+        for (set_iter_init(&it, w->files); (elt = set_iter_next(&it)); )
+            add_touched(b, elt->name);
+        return;
+    }
+
+    snprintf(key, sizeof key, "%d", ev->wd);
+    if (!(d = set_get_data(w->dirs, key)))
+        return;
+
+    if (ev->mask & IN_IGNORED) {
+        set_remove(w->dirs, key);
+        return;
+    }
+    if (!ev->len)
+        return;
+
+    path = apr_pstrcat(b->pool, d->path, "/", ev->name, NULL);
+    add_touched(b, path);
+    /* the directory's own listing changed */
+    if (ev->mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO))
+        add_touched(b, d->path);
+
+    if ((ev->mask & IN_ISDIR) && (ev->mask & (IN_CREATE | IN_MOVED_TO)))
+        *(const char**)apr_array_push(b->new_dirs) = path;
+
+    for (i = 0; i < d->trees->nelts; i++) {
+        watch_entry* e = ((watch_entry**)d->trees->elts)[i];
+        if ((ev->mask & IN_ISDIR) && (ev->mask & (IN_CREATE | IN_MOVED_TO)))
+            add_tree_watch(w, e, apr_pstrdup(w->pool, path));
+        add_pending(b, e, path);
+    }
+
+    for (i = 0; i < d->files->nelts; i++) {
+        watch_entry* e = ((watch_entry**)d->files->elts)[i];
+        if (strcmp(e->base, ev->name) == 0)
+            add_pending(b, e, e->path);
+    }
+}
+
+/* run the reload callbacks, then mark whatever they didn't refresh
+ * as dirty so that the next lookup stats it */
+static void dispatch(libcrange* lr, struct range_watch* w, batch* b)
+{
+    set_iter it;
+    set_element* elt;
+    int i;
+
+    apr_thread_mutex_lock(w->mutex);
+    for (i = 0; i < b->touched->nelts; i++) {
+        fresh_file* f = set_get_data(w->files,
+                                     ((const char**)b->touched->elts)[i]);
+        if (f)
+            f->pending = 1;
+    }
+    /* files in a new directory may predate its watch */
+    if (b->new_dirs->nelts) {
+        for (set_iter_init(&it, w->files); (elt = set_iter_next(&it)); ) {
+            fresh_file* f = elt->data;
+            for (i = 0; i < b->new_dirs->nelts; i++)
+                if (under(f->path, ((const char**)b->new_dirs->elts)[i]))
+                    f->pending = 1;
+        }
+    }
+    apr_thread_mutex_unlock(w->mutex);
+
+    for (i = 0; i < b->todo->nelts; i++) {
+        pending* q = &((pending*)b->todo->elts)[i];
+        (*q->entry->fn)(lr, q->path, q->entry->data);
+    }
+
+    apr_thread_mutex_lock(w->mutex);
+    for (set_iter_init(&it, w->files); (elt = set_iter_next(&it)); ) {
+        fresh_file* f = elt->data;
+        if (f->pending) {
+            f->pending = 0;
+            f->dirty = 1;
+        }
+    }
+    /* whatever was built from the dirty files needs another look */
+    w->version++;
+    apr_thread_mutex_unlock(w->mutex);
+}
+
+static void* APR_THREAD_FUNC watch_main(apr_thread_t* thread, void* arg)
+{
+    libcrange* lr = arg;
+    struct range_watch* w = lr->watch;
+    batch b;
+    char buf[64 * 1024];
+
+    b.pool = libcrange_pool_new(lr);
+    batch_reset(&b);
+
+    for (;;) {
+        struct pollfd pfd;
+        int n;
+
+        pfd.fd = w->fd;
+        pfd.events = POLLIN;
+        n = poll(&pfd, 1, b.touched->nelts ? WATCH_SETTLE_MS : -1);
+        if (n < 0 && errno != EINTR)
+            break;
+
+        if (n > 0) {
+            ssize_t len = read(w->fd, buf, sizeof buf);
+            char* p = buf;
+            if (len <= 0)
+                continue;
+
+            apr_thread_mutex_lock(w->mutex);
+            while (p < buf + len) {
+                const struct inotify_event* ev =
+                    (const struct inotify_event*)p;
+                handle_event(w, &b, ev);
+                p += sizeof(struct inotify_event) + ev->len;
+            }
+            apr_thread_mutex_unlock(w->mutex);
+            continue;
+        }
+
+        /* quiet for WATCH_SETTLE_MS: reload */
+        if (b.touched->nelts) {
+            dispatch(lr, w, &b);
+            batch_reset(&b);
+        }
+    }
+
+    fprintf(stderr, "libcrange: watcher stopped: %s\n", strerror(errno));
+    apr_thread_exit(thread, APR_SUCCESS);
+    return NULL;
+}
+#endif
+
+void libcrange_watch(libcrange* lr, const char* path,
+                     libcrange_watch_fn fn, void* data)
+{
+    struct range_watch* w;
+    watch_entry* e;
+    struct stat st;
+
+    assert(path);
+    if (lr == NULL) lr = get_static_lr();
+    w = get_watch(lr);
+
+    WATCH_LOCK(w);
+    e = apr_palloc(w->pool, sizeof(*e));
+    e->path = apr_pstrdup(w->pool, path);
+    e->base = strrchr(e->path, '/') ? strrchr(e->path, '/') + 1 : e->path;
+    e->is_dir = stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+    e->fn = fn;
+    e->data = data;
+    *(watch_entry**)apr_array_push(w->entries) = e;
+#ifdef HAVE_WATCHER
+    if (w->running)
+        add_entry_watch(w, e);
+#endif
+    WATCH_UNLOCK(w);
+}
+
+int libcrange_watch_start(libcrange* lr)
+{
+#ifdef HAVE_WATCHER
+    struct range_watch* w;
+    int i, ret = 0;
+
+    if (lr == NULL) lr = get_static_lr();
+    w = get_watch(lr);
+
+    apr_thread_mutex_lock(w->mutex);
+    if (w->running) {
+        apr_thread_mutex_unlock(w->mutex);
+        return 0;
+    }
+
+    w->fd = inotify_init1(IN_CLOEXEC);
+    if (w->fd < 0) {
+        fprintf(stderr, "libcrange: inotify_init1: %s\n", strerror(errno));
+        ret = -1;
+    }
+    else {
+        set_iter it;
+        set_element* elt;
+
+        w->dirs = set_new(w->pool, 0);
+        for (i = 0; i < w->entries->nelts; i++)
+            add_entry_watch(w, ((watch_entry**)w->entries->elts)[i]);
+
+        if (apr_thread_create(&w->thread, NULL, watch_main, lr,
+                              w->pool) != APR_SUCCESS) {
+            close(w->fd);
+            w->fd = -1;
+            ret = -1;
+        }
+        else {
+            w->running = 1;
+            /* things may have changed before the watches went in */
+            for (set_iter_init(&it, w->files); (elt = set_iter_next(&it)); )
+                ((fresh_file*)elt->data)->dirty = 1;
+        }
+    }
+    apr_thread_mutex_unlock(w->mutex);
+    return ret;
+#else
+    return -1;
+#endif
+}
+
+int libcrange_watching(libcrange* lr)
+{
+    if (lr == NULL) lr = get_static_lr();
+    return lr->watch && lr->watch->running;
+}
@@ -0,0 +1,734 @@
+/*
+Copyright (c) 2011, Yahoo! Inc.  All rights reserved.
+Copyrights licensed under the New BSD License. See the accompanying LICENSE file for terms
+*/
+
+/* rangedd: a standalone range server speaking the mod_ranged protocol.
+ *
+ *   GET|POST /range/list?<range>     one node per line
+ *   GET|POST /range/sorted?<range>   same, in natural order
+ *   GET|POST /range/expand?<range>   compressed range
+ *
+ * POST bodies may come with a Content-Length or chunked; any other
+ * transfer coding gets a 501.
+ *
+ * Warnings are returned in a RangeException header. Connections are
+ * HTTP/1.1 keep-alive and requests may be pipelined. Each worker thread
+ * runs its own epoll loop over the shared listening socket; all of them
+ * share a single libcrange. */
+
+#define _GNU_SOURCE /* memmem */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <apr_pools.h>
+#include <apr_strings.h>
+#include <apr_allocator.h>
+#include <apr_thread_proc.h>
+
+#include "libcrange.h"
+
+#define DEFAULT_PORT "9999"
+#define MAX_EVENTS 256
+#define READ_CHUNK 16384
+/* requests (headers plus body) larger than this are refused */
+#define MAX_REQUEST (16 * 1024 * 1024)
+/* same limit mod_ranged uses for the RangeException header */
+#define MAX_EXCEPTION 2048
+
+typedef struct buffer {
+    char* data;
+    size_t len;
+    size_t size;
+} buffer;
+
+typedef struct connection {
+    int fd;
+    buffer in;
+    buffer out;
+    size_t out_sent;
+    int peer_closed;
+    int closing; /* close once out has been sent */
+} connection;
+
+typedef struct worker {
+    int listen_fd;
+    int epoll_fd;
+    libcrange* lr;
+    apr_pool_t* pool;
+} worker;
+
+static int log_requests = 0;
+
+static void buffer_reserve(buffer* b, size_t extra)
+{
+    if (b->len + extra <= b->size)
+        return;
+    while (b->len + extra > b->size)
+        b->size = b->size ? b->size * 2 : READ_CHUNK;
+    b->data = realloc(b->data, b->size);
+    if (!b->data) {
+        perror("rangedd: realloc");
+        exit(1);
+    }
+}
+
+static void buffer_append(buffer* b, const char* data, size_t len)
+{
+    buffer_reserve(b, len);
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+}
+
+static void buffer_appendf(buffer* b, const char* fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    buffer_reserve(b, 256);
+    va_start(ap, fmt);
+    n = vsnprintf(b->data + b->len, b->size - b->len, fmt, ap);
+    va_end(ap);
+    if (n >= b->size - b->len) {
+        buffer_reserve(b, n + 1);
+        va_start(ap, fmt);
+        vsnprintf(b->data + b->len, b->size - b->len, fmt, ap);
+        va_end(ap);
+    }
+    b->len += n;
+}
+
+/* drop the first n bytes */
+static void buffer_consume(buffer* b, size_t n)
+{
+    memmove(b->data, b->data + n, b->len - n);
+    b->len -= n;
+}
+
+static int set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0)
+        return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static void url_unescape(char* s)
+{
+    char* out = s;
+    while (*s) {
+        if (*s == '%' && isxdigit((unsigned char)s[1]) &&
+            isxdigit((unsigned char)s[2])) {
+            char hex[3] = { s[1], s[2], '\0' };
+            *out++ = (char)strtol(hex, NULL, 16);
+            s += 3;
+        }
+        else if (*s == '+') {
+            *out++ = ' ';
+            s++;
+        }
+        else
+            *out++ = *s++;
+    }
+    *out = '\0';
+}
+
+static void add_response(connection* c, int status, const char* reason,
+                         const char* exception, const char* body,
+                         size_t body_len, int keep_alive)
+{
+    buffer_appendf(&c->out,
+                   "HTTP/1.1 %d %s\r\n"
+                   "Content-Type: text/plain\r\n"
+                   "Content-Length: %lu\r\n", status, reason,
+                   (unsigned long)body_len);
+    if (exception) {
+        buffer_append(&c->out, "RangeException: ", 16);
+        buffer_append(&c->out, exception, strlen(exception));
+        buffer_append(&c->out, "\r\n", 2);
+    }
+    if (!keep_alive)
+        buffer_append(&c->out, "Connection: close\r\n", 19);
+    buffer_append(&c->out, "\r\n", 2);
+    buffer_append(&c->out, body, body_len);
+
+    if (!keep_alive)
+        c->closing = 1;
+}
+
+static void add_error(connection* c, int status, const char* reason)
+{
+    char body[64];
+    int n = snprintf(body, sizeof body, "%d %s\n", status, reason);
+    add_response(c, status, reason, NULL, body, n, 0);
+}
+
+static int append_node(void* data, const char* name, size_t len)
+{
+    buffer* b = data;
+    buffer_reserve(b, len + 1);
+    memcpy(b->data + b->len, name, len);
+    b->data[b->len + len] = '\n';
+    b->len += len + 1;
+    return 0;
+}
+
+/* warnings go in a header: strip anything that could end it early */
+static const char* exception_header(apr_pool_t* pool, const char* warnings)
+{
+    char* header = apr_pstrndup(pool, warnings, MAX_EXCEPTION - 1);
+    char* p;
+    for (p = header; *p; p++)
+        if (iscntrl((unsigned char)*p))
+            *p = ' ';
+    return header;
+}
+
+typedef enum { LIST, SORTED, EXPAND } range_mode;
+
+static void serve_range(worker* w, connection* c, range_mode mode,
+                        const char* text, int keep_alive, apr_pool_t* pool)
+{
+    range_request* rr;
+    const char* exception = NULL;
+    buffer body = { NULL, 0, 0 };
+
+    rr = range_expand(w->lr, pool, text);
+    if (range_request_has_warnings(rr))
+        exception = exception_header(pool, range_request_warnings(rr));
+
+    if (mode == EXPAND) {
+        const char* compressed = range_request_compressed(rr);
+        add_response(c, 200, "OK", exception, compressed,
+                     strlen(compressed), keep_alive);
+        return;
+    }
+
+    if (mode == SORTED) {
+        const char** nodes = range_request_nodes_sorted(rr);
+        while (*nodes) {
+            append_node(&body, *nodes, strlen(*nodes));
+            nodes++;
+        }
+    }
+    else
+        range_request_foreach(rr, append_node, &body);
+
+    add_response(c, 200, "OK", exception, body.data, body.len, keep_alive);
+    free(body.data);
+}
+
+/* decodes the chunked body in data[0..len) into *body, allocated from
+ * pool. Returns the bytes it takes up, trailers and all, 0 if it isn't
+ * all there yet and -1 if it isn't valid chunked encoding */
+static long dechunk(apr_pool_t* pool, const char* data, size_t len,
+                    char** body, size_t* body_len)
+{
+    char* out = apr_palloc(pool, len + 1);
+    size_t pos = 0, n = 0;
+
+    for (;;) {
+        const char* eol = memmem(data + pos, len - pos, "\r\n", 2);
+        char* end;
+        unsigned long size;
+
+        if (!eol)
+            return 0;
+        if (!isxdigit((unsigned char)data[pos]))
+            return -1;
+        size = strtoul(data + pos, &end, 16);
+        /* chunk extensions are ignored */
+        if (size > MAX_REQUEST || (end != eol && *end != ';' &&
+                                   *end != ' ' && *end != '\t'))
+            return -1;
+        pos = eol - data + 2;
+        if (size == 0)
+            break;
+        if (len - pos < size + 2)
+            return 0;
+        if (memcmp(data + pos + size, "\r\n", 2))
+            return -1;
+        memcpy(out + n, data + pos, size);
+        n += size;
+        pos += size + 2;
+    }
+
+    /* trailers, up to an empty line */
+    for (;;) {
+        const char* eol = memmem(data + pos, len - pos, "\r\n", 2);
+        int empty;
+
+        if (!eol)
+            return 0;
+        empty = eol == data + pos;
+        pos = eol - data + 2;
+        if (empty)
+            break;
+    }
+
+    out[n] = '\0';
+    *body = out;
+    *body_len = n;
+    return pos;
+}
+
+/* parse and answer one request from c->in. Returns the number of bytes
+ * consumed, 0 if the request isn't complete yet */
+static size_t handle_request(worker* w, connection* c, apr_pool_t* pool)
+{
+    char* end;
+    char* line;
+    char* next;
+    char* method;
+    char* target;
+    char* version;
+    char* query;
+    char* text;
+    char* body = NULL;
+    size_t header_len;
+    size_t body_len;
+    size_t request_len;
+    long content_length = 0;
+    int chunked = 0;
+    int keep_alive;
+    range_mode mode;
+
+    end = memmem(c->in.data, c->in.len, "\r\n\r\n", 4);
+    if (!end) {
+        if (c->in.len > MAX_REQUEST)
+            add_error(c, 413, "Request Entity Too Large");
+        return c->in.len > MAX_REQUEST ? c->in.len : 0;
+    }
+    header_len = end - c->in.data + 4;
+
+    /* work on a copy so the buffer can keep growing underneath */
+    line = apr_pstrmemdup(pool, c->in.data, header_len - 2);
+
+    next = strstr(line, "\r\n");
+    *next = '\0';
+    next += 2;
+
+    method = line;
+    target = strchr(method, ' ');
+    version = target ? strchr(target + 1, ' ') : NULL;
+    if (!target || !version) {
+        add_error(c, 400, "Bad Request");
+        return c->in.len;
+    }
+    *target++ = '\0';
+    *version++ = '\0';
+
+    keep_alive = strcmp(version, "HTTP/1.1") == 0;
+
+    while (*next) {
+        char* value;
+        char* eol = strstr(next, "\r\n");
+        *eol = '\0';
+        value = strchr(next, ':');
+        if (value) {
+            *value++ = '\0';
+            while (*value == ' ' || *value == '\t')
+                value++;
+            if (!strcasecmp(next, "Content-Length"))
+                content_length = atol(value);
+            else if (!strcasecmp(next, "Transfer-Encoding")) {
+                /* the only coding we can take the body out of */
+                if (strcasecmp(value, "chunked")) {
+                    add_error(c, 501, "Not Implemented");
+                    return c->in.len;
+                }
+                chunked = 1;
+            }
+            else if (!strcasecmp(next, "Connection")) {
+                if (!strcasecmp(value, "close"))
+                    keep_alive = 0;
+                else if (!strcasecmp(value, "keep-alive"))
+                    keep_alive = 1;
+            }
+        }
+        next = eol + 2;
+    }
+
+    if (chunked) {
+        /* chunked framing wins over any Content-Length */
+        long used = dechunk(pool, c->in.data + header_len,
+                            c->in.len - header_len, &body, &body_len);
+        if (used < 0) {
+            add_error(c, 400, "Bad Request");
+            return c->in.len;
+        }
+        if (!used) {
+            if (c->in.len - header_len > MAX_REQUEST) {
+                add_error(c, 413, "Request Entity Too Large");
+                return c->in.len;
+            }
+            return 0;
+        }
+        request_len = header_len + used;
+    }
+    else {
+        if (content_length < 0 || content_length > MAX_REQUEST) {
+            add_error(c, 413, "Request Entity Too Large");
+            return c->in.len;
+        }
+        if (c->in.len < header_len + content_length)
+            return 0;
+        body_len = content_length;
+        request_len = header_len + content_length;
+    }
+
+    query = strchr(target, '?');
+    if (query)
+        *query++ = '\0';
+
+    if (!strcmp(target, "/range/list"))
+        mode = LIST;
+    else if (!strcmp(target, "/range/sorted"))
+        mode = SORTED;
+    else if (!strcmp(target, "/range/expand"))
+        mode = EXPAND;
+    else {
+        add_response(c, 404, "Not Found", NULL, "", 0, keep_alive);
+        return request_len;
+    }
+
+    if (!strcmp(method, "GET"))
+        text = apr_pstrdup(pool, query ? query : "");
+    else if (!strcmp(method, "POST"))
+        text = body ? body : apr_pstrmemdup(pool, c->in.data + header_len,
+                                            body_len);
+    else {
+        add_response(c, 405, "Method Not Allowed", NULL, "", 0, keep_alive);
+        return request_len;
+    }
+    url_unescape(text);
+
+    serve_range(w, c, mode, text, keep_alive, pool);
+    if (log_requests)
+        fprintf(stderr, "%s %s [%s]\n", method, target, text);
+
+    return request_len;
+}
+
+static void close_connection(worker* w, connection* c)
+{
+    epoll_ctl(w->epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    free(c->in.data);
+    free(c->out.data);
+    free(c);
+}
+
+/* returns -1 if the connection is gone */
+static int flush_output(worker* w, connection* c)
+{
+    while (c->out_sent < c->out.len) {
+        ssize_t n = send(c->fd, c->out.data + c->out_sent,
+                         c->out.len - c->out_sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            return -1;
+        }
+        c->out_sent += n;
+    }
+    c->out.len = c->out_sent = 0;
+    return c->closing ? -1 : 0;
+}
+
+static void handle_input(worker* w, connection* c, apr_pool_t* pool)
+{
+    for (;;) {
+        ssize_t n;
+        buffer_reserve(&c->in, READ_CHUNK);
+        n = recv(c->fd, c->in.data + c->in.len, c->in.size - c->in.len, 0);
+        if (n == 0) {
+            /* answer what we have, then go away */
+            c->peer_closed = 1;
+            break;
+        }
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            c->peer_closed = 1;
+            c->in.len = 0;
+            break;
+        }
+        c->in.len += n;
+    }
+
+    /* pipelined requests are answered in order */
+    while (c->in.len && !c->closing) {
+        size_t used = handle_request(w, c, pool);
+        apr_pool_clear(pool);
+        if (!used)
+            break;
+        buffer_consume(&c->in, used);
+    }
+
+    if (c->peer_closed)
+        c->closing = 1;
+}
+
+static void accept_connections(worker* w)
+{
+    for (;;) {
+        struct epoll_event ev;
+        connection* c;
+        int one = 1;
+        int fd = accept(w->listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            return; /* EAGAIN: another worker got it, or we're done */
+        }
+        set_nonblocking(fd);
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+
+        c = calloc(1, sizeof(connection));
+        c->fd = fd;
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = c;
+        if (epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            close(fd);
+            free(c);
+        }
+    }
+}
+
+static void* APR_THREAD_FUNC worker_main(apr_thread_t* thread, void* arg)
+{
+    worker* w = arg;
+    struct epoll_event events[MAX_EVENTS];
+    apr_pool_t* request_pool;
+
+    apr_pool_create(&request_pool, w->pool);
+
+    for (;;) {
+        int i;
+        int n = epoll_wait(w->epoll_fd, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("rangedd: epoll_wait");
+            break;
+        }
+
+        for (i = 0; i < n; i++) {
+            connection* c = events[i].data.ptr;
+
+            if (c == NULL) {
+                accept_connections(w);
+                continue;
+            }
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP |
+                                    EPOLLERR))
+                handle_input(w, c, request_pool);
+            if (flush_output(w, c) < 0)
+                close_connection(w, c);
+        }
+    }
+
+    apr_thread_exit(thread, APR_SUCCESS);
+    return NULL;
+}
+
+static int listen_on(const char* host, const char* port)
+{
+    struct addrinfo hints, *res, *ai;
+    int fd = -1;
+    int err;
+
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    if ((err = getaddrinfo(host, port, &hints, &res)) != 0) {
+        fprintf(stderr, "rangedd: %s:%s: %s\n", host ? host : "*", port,
+                gai_strerror(err));
+        return -1;
+    }
+
+    for (ai = res; ai; ai = ai->ai_next) {
+        int one = 1;
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0)
+            continue;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+        if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 &&
+            listen(fd, SOMAXCONN) == 0)
+            break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+
+    if (fd < 0)
+        fprintf(stderr, "rangedd: can't listen on %s:%s: %s\n",
+                host ? host : "*", port, strerror(errno));
+    else
+        set_nonblocking(fd);
+    return fd;
+}
+
+/* a pool with its own allocator, so workers don't contend on malloc */
+static apr_pool_t* private_pool(void)
+{
+    apr_allocator_t* allocator;
+    apr_pool_t* pool;
+
+    apr_allocator_create(&allocator);
+    apr_pool_create_ex(&pool, NULL, NULL, allocator);
+    apr_allocator_owner_set(allocator, pool);
+    return pool;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: rangedd [-c <configfile>] [-l <address>] "
+            "[-p <port>] [-t <threads>] [-v] [-w] [-s <snapshot>]\n\n"
+            "  -w  reload changed cluster files in the background\n"
+            "  -s  load parsed cluster data from <snapshot> at startup and\n"
+            "      save it there on SIGTERM/SIGINT\n\n");
+}
+
+int main(int argc, char const* const* argv)
+{
+    apr_pool_t* pool;
+    apr_thread_t** threads;
+    worker* workers;
+    libcrange* lr;
+    const char* config_file = LIBCRANGE_CONF;
+    const char* host = NULL;
+    const char* port = DEFAULT_PORT;
+    const char* snapshot_file = NULL;
+    sigset_t stop_signals;
+    int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    int watch = 0;
+    int listen_fd;
+    int c, i, sig;
+
+    apr_app_initialize(&argc, &argv, NULL);
+    atexit(apr_terminate);
+    apr_pool_create(&pool, NULL);
+
+    while ((c = getopt(argc, (char* const*)argv, "c:l:p:s:t:vw")) != -1) {
+        switch (c) {
+            case 'c':
+                config_file = optarg;
+                break;
+            case 'l':
+                host = optarg;
+                break;
+            case 'p':
+                port = optarg;
+                break;
+            case 's':
+                snapshot_file = optarg;
+                break;
+            case 't':
+                nthreads = atoi(optarg);
+                break;
+            case 'v':
+                log_requests = 1;
+                break;
+            case 'w':
+                watch = 1;
+                break;
+            default:
+                usage();
+                return 1;
+        }
+    }
+    if (optind != argc || nthreads < 1) {
+        usage();
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    /* threads inherit the mask: the main thread takes the signal */
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGTERM);
+    sigaddset(&stop_signals, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &stop_signals, NULL);
+
+    lr = libcrange_new(pool, config_file);
+    if (!lr) {
+        fprintf(stderr, "rangedd: can't load %s\n", config_file);
+        return 1;
+    }
+    if (snapshot_file)
+        libcrange_snapshot_load(lr, snapshot_file);
+    if (watch && libcrange_watch_start(lr) != 0)
+        fprintf(stderr, "rangedd: can't watch files, "
+                "checking them on every request\n");
+
+    if ((listen_fd = listen_on(host, port)) < 0)
+        return 1;
+
+    threads = apr_palloc(pool, sizeof(apr_thread_t*) * nthreads);
+    workers = apr_palloc(pool, sizeof(worker) * nthreads);
+    for (i = 0; i < nthreads; i++) {
+        struct epoll_event ev;
+        worker* w = &workers[i];
+
+        w->listen_fd = listen_fd;
+        w->lr = lr;
+        w->pool = private_pool();
+        w->epoll_fd = epoll_create1(0);
+        if (w->epoll_fd < 0) {
+            perror("rangedd: epoll_create1");
+            return 1;
+        }
+
+        /* data.ptr == NULL marks the listener; with EPOLLEXCLUSIVE only
+         * one idle worker is woken per new connection */
+        ev.events = EPOLLIN;
+#ifdef EPOLLEXCLUSIVE
+        ev.events |= EPOLLEXCLUSIVE;
+#endif
+        ev.data.ptr = NULL;
+        if (epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev) < 0) {
+            perror("rangedd: epoll_ctl");
+            return 1;
+        }
+
+        if (apr_thread_create(&threads[i], NULL, worker_main, w,
+                              pool) != APR_SUCCESS) {
+            fprintf(stderr, "rangedd: can't start worker %d\n", i);
+            return 1;
+        }
+    }
+
+    fprintf(stderr, "rangedd: listening on %s:%s with %d threads\n",
+            host ? host : "*", port, nthreads);
+
+    sigwait(&stop_signals, &sig);
+    fprintf(stderr, "rangedd: exiting on signal %d\n", sig);
+    if (snapshot_file)
+        libcrange_snapshot_save(lr, snapshot_file);
+    return 0;
+}
@@ -67,12 +67,42 @@ void set_destroy(set* s)
     apr_pool_destroy(s->pool);
 }
 
+/* every set has a pool of its own, and a pool is at least one block */
+#define SET_POOL_MIN 8192
+
+size_t set_bytes(const set* s)
+{
+    size_t bytes = sizeof(set) + s->hashsize * sizeof(set_element*);
+    size_t i;
+    set_element* n;
+
+    for (i = 0; i < s->hashsize; i++)
+        for (n = s->table[i]; n; n = n->next)
+            bytes += sizeof(set_element) + n->len + 1;
+    return bytes < SET_POOL_MIN ? SET_POOL_MIN : bytes;
+}
+
 static set_element* 
 set_element_new(apr_pool_t* pool, const char* name, void* data)
 {
     set_element* n;
     n = apr_palloc(pool, sizeof(set_element));
-    n->name = apr_pstrdup(pool, name);
+    n->len = strlen(name);
+    n->name = apr_pstrmemdup(pool, name, n->len);
+    n->data = data;
+    n->next = NULL;
+    return n;
+}
+
+/* like set_element_new, but the caller owns name and guarantees it
+ * outlives the set */
+static set_element* 
+set_element_new_nocopy(apr_pool_t* pool, const char* name, void* data)
+{
+    set_element* n;
+    n = apr_palloc(pool, sizeof(set_element));
+    n->name = name;
+    n->len = strlen(name);
     n->data = data;
     n->next = NULL;
     return n;
@@ -81,7 +111,7 @@ set_element_new(apr_pool_t* pool, const char* name, void* data)
 #define HSIEH_HASH 1
 
 #if defined(HSIEH_HASH)
-static uint32_t string_hash(const char* data)
+static uint32_t string_hash_n(const char* data, uint32_t len)
 {
 #undef get16bits
 #if (defined(__GNUC__) && defined(__i386__)) || defined(__WATCOMC__) \
@@ -93,7 +123,6 @@ static uint32_t string_hash(const char* data)
 #define get16bits(d) ((((uint32_t)(((const uint8_t *)(d))[1])) << 8)\
                        +(uint32_t)(((const uint8_t *)(d))[0]) )
 #endif
-	uint32_t len = strlen(data);
 	uint32_t hash = len, tmp;
 	int rem;
 
@@ -138,6 +167,11 @@ static uint32_t string_hash(const char* data)
     return hash;
 }
 
+static uint32_t string_hash(const char* data)
+{
+    return string_hash_n(data, strlen(data));
+}
+
 #elif defined(PJW_HASH)
 /* PJW hash function (optmized for 32bit ints) */
 static unsigned string_hash(const char* str)
@@ -223,7 +257,10 @@ static void resize(set* s, size_t num_elements_hint)
     }
 }
 
-static set_element* set_add_noresize(set* s, const char* name, void* data)
+/* name's element, added if need be; copy says whether the set takes a
+ * copy of name or just the pointer */
+static set_element* set_insert(set* s, const char* name, void* data,
+                               int copy)
 {
     int i;
     set_element* n;
@@ -234,7 +271,8 @@ static set_element* set_add_noresize(set* s, const char* name, void* data)
             return n;
         }
 
-    n = set_element_new(s->pool, name, data);
+    n = copy ? set_element_new(s->pool, name, data) :
+        set_element_new_nocopy(s->pool, name, data);
     n->next = s->table[i];
     s->table[i] = n;
     s->members++;
@@ -242,12 +280,23 @@ static set_element* set_add_noresize(set* s, const char* name, void* data)
     return n;
 }
 
+static set_element* set_add_noresize(set* s, const char* name, void* data)
+{
+    return set_insert(s, name, data, 1);
+}
+
 set_element* set_add(set* s, const char* name, void* data)
 {
     resize(s, s->members + 1);
     return set_add_noresize(s, name, data);
 }
 
+set_element* set_add_nocopy(set* s, const char* name, void* data)
+{
+    resize(s, s->members + 1);
+    return set_insert(s, name, data, 0);
+}
+
 set_element* set_get(const set* s, const char* name)
 {
     int i;
@@ -260,6 +309,19 @@ set_element* set_get(const set* s, const char* name)
 
     return NULL;
 }
+set_element* set_getn(const set* s, const char* name, size_t len)
+{
+    int i;
+    set_element* n;
+    i = string_hash_n(name, len) % s->hashsize;
+
+    for (n = s->table[i]; n; n = n->next)
+        if (n->len == len && !memcmp(n->name, name, len))
+            return n;
+
+    return NULL;
+}
+
 void* set_get_data(const set* s, const char* name)
 {
     set_element* e = set_get(s, name);
@@ -285,6 +347,25 @@ set_element** set_members(const set* s)
     return ret;
 }
 
+void set_iter_init(set_iter* it, const set* s)
+{
+    it->s = s;
+    it->bucket = 0;
+    it->next = NULL;
+}
+
+set_element* set_iter_next(set_iter* it)
+{
+    set_element* n = it->next;
+
+    while (!n && it->bucket < it->s->hashsize)
+        n = it->s->table[it->bucket++];
+
+    if (n)
+        it->next = n->next;
+    return n;
+}
+
 set* set_union(apr_pool_t* pool, const set* s1, const set* s2)
 {
     set* s;
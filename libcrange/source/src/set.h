@@ -12,6 +12,7 @@ Copyrights licensed under the New BSD License. See the accompanying LICENSE file
 typedef struct set_element
 {
     const char* name;
+    size_t len;
     void* data;
     struct set_element* next;
 } set_element;
@@ -24,15 +25,33 @@ typedef struct set
     apr_pool_t* pool;
 } set;
 
+/* walks a set in bucket order without building a member array */
+typedef struct set_iter
+{
+    const set* s;
+    size_t bucket;
+    set_element* next;
+} set_iter;
+
 char* set_dump(const set* s);
 set_element* set_add(set* theset, const char* name, void* data);
+/* add name without copying it: name must live at least as long as the set
+ * (e.g. allocated from theset->pool) */
+set_element* set_add_nocopy(set* theset, const char* name, void* data);
 set_element* set_get(const set* theset, const char* name);
+/* lookup using the first len chars of name, which needn't be terminated */
+set_element* set_getn(const set* theset, const char* name, size_t len);
 void* set_get_data(const set* theset, const char* name);
 
 set_element** set_members(const set* s);
+void set_iter_init(set_iter* it, const set* s);
+set_element* set_iter_next(set_iter* it);
 set* set_remove(set* theset, const char* name);
 set* set_new(apr_pool_t* pool, int hashsize);
 void set_destroy(set* s);
+/* roughly what s takes up: its pool, table and elements, counting names
+ * as copies (not the data) */
+size_t set_bytes(const set* s);
 set* set_union(apr_pool_t* pool, const set* s1, const set* s2);
 void set_union_inplace(set* s, const set* s2);
 set* set_intersect(apr_pool_t* pool, const set* s1, const set* s2);
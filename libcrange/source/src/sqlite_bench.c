@@ -0,0 +1,246 @@
+/*
+Copyright (c) 2011, Yahoo! Inc.  All rights reserved.
+Copyrights licensed under the New BSD License. See the accompanying LICENSE file for terms
+*/
+
+/* sqlite_bench: what the sqlite modules gain by keeping their statements
+ * prepared (sqlite_db.c) rather than preparing one per call.
+ *
+ * Runs the sqlite module's per-cluster key/value lookup against a
+ * database, first preparing and finalizing the statement for every
+ * lookup, then with one persistent statement reset between lookups,
+ * and reports the time per lookup of each. Without a database it builds
+ * one in a temporary file, with the schema and indexes sqlite_db.h
+ * describes:
+ *
+ *   sqlite_bench -c 4000 -n 200000
+ *   sqlite_bench -n 200000 /var/range.sqlite
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sqlite3.h>
+
+/* as in functions/sqlite.c */
+#define KEYVALUE_SQL "select key, value from clusters where cluster=?"
+#define CLUSTERS_SQL "select distinct cluster from clusters"
+
+static double now(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1E6;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: sqlite_bench [-c <clusters>] [-k <keys>] "
+            "[-n <lookups>] [<database>]\n\n");
+}
+
+static int exec(sqlite3* db, const char* sql)
+{
+    char* err;
+
+    if (sqlite3_exec(db, sql, NULL, NULL, &err) == SQLITE_OK)
+        return 0;
+    fprintf(stderr, "sqlite_bench: %s: %s\n", sql, err);
+    sqlite3_free(err);
+    return -1;
+}
+
+/* clusters c0..c<n-1>, each with keys k0..k<keys-1> of a few values */
+static int build(const char* path, int clusters, int keys)
+{
+    sqlite3* db;
+    sqlite3_stmt* stmt;
+    char cluster[32], key[32], value[64];
+    int i, j, v, ret = -1;
+
+    if (sqlite3_open(path, &db) != SQLITE_OK) {
+        fprintf(stderr, "sqlite_bench: %s: %s\n", path, sqlite3_errmsg(db));
+        sqlite3_close(db);
+        return -1;
+    }
+    if (exec(db, "CREATE TABLE clusters (cluster TEXT, key TEXT, "
+             "value TEXT)") ||
+        exec(db, "CREATE INDEX clusters_cluster ON clusters "
+             "(cluster, key, value)") ||
+        exec(db, "BEGIN"))
+        goto out;
+    if (sqlite3_prepare_v2(db, "INSERT INTO clusters VALUES (?, ?, ?)",
+                           -1, &stmt, NULL) != SQLITE_OK)
+        goto out;
+    for (i = 0; i < clusters; i++) {
+        snprintf(cluster, sizeof cluster, "c%d", i);
+        for (j = 0; j < keys; j++) {
+            snprintf(key, sizeof key, "k%d", j);
+            for (v = 0; v < 3; v++) {
+                snprintf(value, sizeof value, "h%d-%d.example.com",
+                         i, j * 3 + v);
+                sqlite3_bind_text(stmt, 1, cluster, -1, SQLITE_STATIC);
+                sqlite3_bind_text(stmt, 2, key, -1, SQLITE_STATIC);
+                sqlite3_bind_text(stmt, 3, value, -1, SQLITE_STATIC);
+                sqlite3_step(stmt);
+                sqlite3_reset(stmt);
+            }
+        }
+    }
+    sqlite3_finalize(stmt);
+    ret = exec(db, "COMMIT");
+  out:
+    sqlite3_close(db);
+    return ret;
+}
+
+/* the clusters to look up, in a fixed pseudo-random order */
+static char** cluster_names(sqlite3* db, int* n)
+{
+    sqlite3_stmt* stmt;
+    char** names = NULL;
+    int size = 0;
+
+    *n = 0;
+    if (sqlite3_prepare_v2(db, CLUSTERS_SQL, -1, &stmt, NULL) != SQLITE_OK)
+        return NULL;
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        if (*n == size) {
+            size = size ? size * 2 : 1024;
+            names = realloc(names, sizeof(char*) * size);
+        }
+        names[(*n)++] = strdup((const char*)sqlite3_column_text(stmt, 0));
+    }
+    sqlite3_finalize(stmt);
+    return names;
+}
+
+/* one lookup's worth of work: every row, as the module reads them */
+static long lookup(sqlite3_stmt* stmt, const char* cluster)
+{
+    long bytes = 0;
+
+    sqlite3_bind_text(stmt, 1, cluster, -1, SQLITE_STATIC);
+    while (sqlite3_step(stmt) == SQLITE_ROW)
+        bytes += sqlite3_column_bytes(stmt, 0) +
+            sqlite3_column_bytes(stmt, 1);
+    return bytes;
+}
+
+static double per_call(sqlite3* db, char** names, int nnames, long n,
+                       long* bytes)
+{
+    double start = now();
+    sqlite3_stmt* stmt;
+    long i;
+
+    for (i = 0; i < n; i++) {
+        sqlite3_prepare_v2(db, KEYVALUE_SQL, -1, &stmt, NULL);
+        *bytes += lookup(stmt, names[(i * 7919) % nnames]);
+        sqlite3_finalize(stmt);
+    }
+    return now() - start;
+}
+
+static double prepared(sqlite3* db, char** names, int nnames, long n,
+                       long* bytes)
+{
+    double start = now();
+    sqlite3_stmt* stmt;
+    long i;
+
+#if SQLITE_VERSION_NUMBER >= 3020000
+    sqlite3_prepare_v3(db, KEYVALUE_SQL, -1, SQLITE_PREPARE_PERSISTENT,
+                       &stmt, NULL);
+#else
+    sqlite3_prepare_v2(db, KEYVALUE_SQL, -1, &stmt, NULL);
+#endif
+    for (i = 0; i < n; i++) {
+        *bytes += lookup(stmt, names[(i * 7919) % nnames]);
+        sqlite3_reset(stmt);
+    }
+    sqlite3_finalize(stmt);
+    return now() - start;
+}
+
+int main(int argc, char* argv[])
+{
+    char tmp[] = "/tmp/sqlite_benchXXXXXX";
+    const char* path;
+    sqlite3* db;
+    char** names;
+    double secs;
+    long n = 200000, bytes_per_call = 0, bytes_prepared = 0;
+    int clusters = 4000, keys = 4, nnames;
+    int c, fd, i;
+
+    while ((c = getopt(argc, argv, "c:k:n:")) != -1) {
+        switch (c) {
+            case 'c':
+                clusters = atoi(optarg);
+                break;
+            case 'k':
+                keys = atoi(optarg);
+                break;
+            case 'n':
+                n = atol(optarg);
+                break;
+            default:
+                usage();
+                return 1;
+        }
+    }
+    if (optind + 1 < argc || clusters < 1 || keys < 1 || n < 1) {
+        usage();
+        return 1;
+    }
+
+    if (optind < argc) {
+        path = argv[optind];
+    }
+    else {
+        if ((fd = mkstemp(tmp)) < 0) {
+            perror("sqlite_bench: mkstemp");
+            return 1;
+        }
+        close(fd);
+        path = tmp;
+        if (build(path, clusters, keys)) {
+            unlink(tmp);
+            return 1;
+        }
+    }
+
+    if (sqlite3_open_v2(path, &db, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK) {
+        fprintf(stderr, "sqlite_bench: %s: %s\n", path, sqlite3_errmsg(db));
+        return 1;
+    }
+    names = cluster_names(db, &nnames);
+    if (!nnames) {
+        fprintf(stderr, "sqlite_bench: %s: no clusters\n", path);
+        return 1;
+    }
+
+    /* warm the page cache, so neither run pays for reading the file */
+    prepared(db, names, nnames, nnames, &bytes_prepared);
+    bytes_prepared = 0;
+
+    printf("%ld lookups over %d clusters\n", n, nnames);
+    secs = per_call(db, names, nnames, n, &bytes_per_call);
+    printf("prepared per call: %.3fs, %.2fus each\n", secs, secs * 1E6 / n);
+    secs = prepared(db, names, nnames, n, &bytes_prepared);
+    printf("prepared once:     %.3fs, %.2fus each\n", secs, secs * 1E6 / n);
+    if (bytes_per_call != bytes_prepared)
+        fprintf(stderr, "sqlite_bench: the runs read different rows\n");
+
+    for (i = 0; i < nnames; i++)
+        free(names[i]);
+    free(names);
+    sqlite3_close(db);
+    if (path == tmp)
+        unlink(tmp);
+    return 0;
+}
@@ -41,6 +41,40 @@ is(
    "foo100..1 # using range.conf",
   );
 
+is(
+   `crange -e n4294967295..4294967298 2>&1`,
+   qq{n4294967295\nn4294967296\nn4294967297\nn4294967298\n},
+   "n4294967295..4294967298 # serials past 32 bits",
+  );
+
+is(
+   `crange n4294967295..4294967298`,
+   qq{n4294967295..8\n},
+   "n4294967295..4294967298 # compresses back",
+  );
+
+is(
+   `printf 'foo1..3\\nbar{1,2}\\nfoo1..3\\n' | crange -b`,
+   qq{foo1..3\nbar1..2\nfoo1..3\n},
+   "crange -b # one result per input line, duplicates kept in order",
+  );
+
+is(
+   `printf 'foo1..2\\nbar1\\n' | crange -e -b`,
+   qq{foo1\nfoo2\n\nbar1\n\n},
+   "crange -e -b # each result's nodes, then an empty line",
+  );
+
+# a line longer than any fixed buffer stays one range
+my ($long_fh, $long_file) = File::Temp::tempfile();
+print $long_fh join(",", map { "host$_" } 1..20000), "\n";
+close $long_fh;
+is(
+   `crange -b < $long_file`,
+   qq{host1..20000\n},
+   "crange -b # a line of some 200K characters",
+  );
+
 is(
   `crange  -c $range_conf -e  'vlan(foo1.example.com)'`,
   qq{"1.2.3.0/24"\n},
@@ -60,6 +94,116 @@ is(
   'has(bar;foo1.example.com) # should work',
   );
 
+is(
+  `crange  -c $range_conf -e  '*foo1.example.com'`,
+  qq{web\n},
+  '*foo1.example.com',
+  );
+
+is(
+  `crange  -c $range_conf -e  'clusters(foo1.example.com,foo2.example.com)'`,
+  qq{web\n},
+  'clusters(foo1.example.com,foo2.example.com)',
+  );
+
+is(
+  `crange  -c $range_conf -e  'has(CLUSTER;foo2.example.com)'`,
+  qq{web\n},
+  'has(CLUSTER;foo2.example.com)',
+  );
+
+is(
+  `crange  -c $range_conf -e  'has(bar;foo3.example.com)'`,
+  qq{},
+  'has(bar;foo3.example.com) # no such value',
+  );
+
+is(
+  `crange  -c $range_conf -e  'mem(GROUPS;foo1.example.com)'`,
+  qq{bar\n},
+  'mem(GROUPS;foo1.example.com)',
+  );
+
+# one batch, many threads, cold indexes: every has() waits for whichever
+# thread is building the index, and gets all of it
+my $yaml_dir = File::Temp::tempdir(CLEANUP => 1);
+for my $n (1..40) {
+  open(my $fh, ">", "$yaml_dir/c$n.yaml") or die "$yaml_dir: $!";
+  print $fh "---\nCLUSTER:\n- h$n.example.com\nbar:\n- b$n.example.com\n";
+  close $fh;
+}
+my ($index_conf_fh, $index_conf) = File::Temp::tempfile();
+print $index_conf_fh qq{
+yaml_path=$yaml_dir
+batch_threads=8
+loadmodule $build_root/usr/lib/libcrange/yamlfile
+};
+close $index_conf_fh;
+my @index_lines = map { ("has(CLUSTER;h$_.example.com)",
+                         "has(bar;b$_.example.com)") } 1..40;
+my $index_input = join("\\n", @index_lines);
+is(
+  `printf '$index_input\\n' | crange -c $index_conf -b`,
+  join("", map { "c$_\nc$_\n" } 1..40),
+  "has() # in parallel, against cold indexes",
+  );
+
+# a cluster file with no keys at all: no KEYS, and nothing to crash on
+my $empty_dir = File::Temp::tempdir(CLEANUP => 1);
+open(my $empty_fh, ">", "$empty_dir/empty.yaml") or die "$empty_dir: $!";
+print $empty_fh "---\n";
+close $empty_fh;
+my ($empty_conf_fh, $empty_conf) = File::Temp::tempfile();
+print $empty_conf_fh qq{
+yaml_path=$empty_dir
+loadmodule $build_root/usr/lib/libcrange/yamlfile
+};
+close $empty_conf_fh;
+my $empty_out = `crange -c $empty_conf -e '%empty:KEYS' 2>&1`;
+is($?, 0, "%empty:KEYS # empty cluster file");
+like($empty_out, qr/NOCLUSTER/, "%empty:KEYS # warns, no keys");
+
+# the memo result cache, through mem(): results and the cache's
+# counters. yamlfile's data is a directory, so its generation is
+# libcrange_data_version, which freshness_interval=0 moves on every
+# lookup
+sub memo_batch {
+  my ($extra, @lines) = @_;
+  my ($fh, $conf) = File::Temp::tempfile();
+  print $fh qq{
+yaml_path=$config_base/rangedata
+batch_threads=1
+memo_cache_ttl=60
+$extra
+loadmodule $build_root/usr/lib/libcrange/yamlfile
+};
+  close $fh;
+  my $input = join("\\n", @lines);
+  my @out = `printf '$input\\n' | crange -d -c $conf -b`;
+  my ($stats) = grep { /^DEBUG: result_cache:memo: / } @out;
+  my %stats = ($stats || "") =~ /(\w+) (\d+)/g;
+  return ([map { chomp; $_ } grep { !/^DEBUG/ } @out], \%stats);
+}
+
+my $mem = "mem(GROUPS;foo1.example.com)";
+my ($memo_out, $memo_stats) = memo_batch("freshness_interval=60",
+                                         "$mem,$mem");
+is_deeply($memo_out, ["bar"], "$mem,$mem");
+is_deeply([@$memo_stats{qw(hits misses inserts)}], [0, 1, 1],
+          "$mem,$mem # the second call memoized in the request");
+
+($memo_out, $memo_stats) = memo_batch("freshness_interval=60",
+                                      $mem, "($mem)");
+is_deeply($memo_out, ["bar", "bar"], "$mem # in two requests");
+is_deeply([@$memo_stats{qw(hits misses inserts)}], [1, 1, 1],
+          "$mem # the second request hits the memo cache");
+
+($memo_out, $memo_stats) = memo_batch("freshness_interval=0",
+                                      $mem, "($mem)");
+is_deeply($memo_out, ["bar", "bar"], "$mem # as the data changes");
+is_deeply([@$memo_stats{qw(hits misses inserts entries)}], [0, 2, 2, 2],
+          "$mem # a new generation never finds the old entry");
+
 my @arg_needing_funcs = qw(
   mem cluster clusters group get_cluster get_groups has 
   vlan dc hosts_v hosts_dc vlans_dc ip group
@@ -0,0 +1,118 @@
+#!/usr/bin/perl -w
+
+use warnings;
+use strict;
+
+use Test::More;
+use File::Temp;
+
+# group-mysql against a local MySQL/MariaDB. Built with --with-mysql;
+# the server comes from the environment and the test database is
+# dropped and loaded again each run
+my $build_root = $ENV{DESTDIR} || "$ENV{HOME}/prefix";
+my $module = "$build_root/usr/lib/libcrange/group-mysql";
+my $host = $ENV{RANGE_TEST_MYSQL_HOST} || "127.0.0.1";
+my $port = $ENV{RANGE_TEST_MYSQL_PORT} || 3306;
+my $user = $ENV{RANGE_TEST_MYSQL_USER} || "root";
+my $passwd = $ENV{RANGE_TEST_MYSQL_PASSWD} || "";
+my $db = $ENV{RANGE_TEST_MYSQL_DB} || "range_test";
+
+plan skip_all => "group-mysql not built (configure --with-mysql)"
+  unless -e "$module.so";
+
+$ENV{DESTDIR} = "$ENV{HOME}/prefix";
+$ENV{PATH} = "$ENV{DESTDIR}/usr/bin:$ENV{PATH}";
+$ENV{LD_LIBRARY_PATH} = "$ENV{DESTDIR}/usr/lib"; #FIXME should be lib64 for a 64bit build
+
+sub range_conf {
+  my ($extra) = @_;
+  my ($fh, $file) = File::Temp::tempfile();
+  print $fh qq{
+mysqlhost=$host
+mysqlport=$port
+mysqluser=$user
+mysqlpasswd=$passwd
+mysqldb=$db
+$extra
+loadmodule $module
+};
+  close $fh;
+  return $file;
+}
+
+# no server needed to see that one that isn't there is reported
+my $nowhere = range_conf("mysqlport=1\nmysqlhost=127.0.0.1");
+like(
+  `crange -c $nowhere -e 'group(web)'`,
+  qr/mysql 127\.0\.0\.1: /,
+  "group(web) # no server: warns, no nodes",
+  );
+
+my $mysql = "mysql -h $host -P $port -u $user" . ($passwd ? " -p$passwd" : "");
+if (system("$mysql -e 'select 1' >/dev/null 2>&1") != 0) {
+  done_testing();
+  exit 0;
+}
+
+open(my $sql, "| $mysql") or die "$mysql: $!";
+print $sql qq{
+drop database if exists $db;
+create database $db;
+use $db;
+create table nodes (name varchar(255));
+create table tags (name varchar(255), `range` text);
+insert into nodes values ('foo1'), ('foo2'), ('foo3'), ('bar1');
+insert into tags values ('web', 'foo1..2'), ('db', 'foo3'),
+                        ('also_web', 'foo1..2'), ('empty', '');
+};
+close($sql) or die "loading $db failed";
+
+my $conf = range_conf("");
+
+is(
+  `crange -c $conf -e 'group(web)'`,
+  qq{foo1\nfoo2\n},
+  "group(web)",
+  );
+
+is(
+  `crange -c $conf 'group(web,db)'`,
+  qq{foo1..3\n},
+  "group(web,db) # one query for both",
+  );
+
+is(
+  `crange -c $conf 'group(web,also_web)'`,
+  qq{foo1..2\n},
+  "group(web,also_web) # same range, expanded once",
+  );
+
+is(
+  `crange -c $conf 'group(ALL)'`,
+  qq{bar1,foo1..3\n},
+  "group(ALL)",
+  );
+
+is(
+  `crange -c $conf 'group(nosuchgroup)'`,
+  qq{\n},
+  "group(nosuchgroup) # empty",
+  );
+
+# nine groups pads the IN list out to sixteen
+is(
+  `crange -c $conf 'group(web,db,g3,g4,g5,g6,g7,g8,g9)'`,
+  qq{foo1..3\n},
+  "group() with a padded IN list",
+  );
+
+# cached groups come back the same
+my $cached = range_conf("mysql_cache_ttl=60");
+is(
+  `printf 'group(web)\\ngroup(web,db)\\n' | crange -c $cached -b`,
+  qq{foo1..2\nfoo1..3\n},
+  "group() through the mysql result cache",
+  );
+
+system("$mysql -e 'drop database $db'");
+done_testing();
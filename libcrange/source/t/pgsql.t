@@ -0,0 +1,117 @@
+#!/usr/bin/perl -w
+
+use warnings;
+use strict;
+
+use Test::More;
+use File::Temp;
+
+# pgsql against a local PostgreSQL. Built with --with-pgsql; the server
+# comes from the environment and the test database is dropped and
+# loaded again each run
+my $build_root = $ENV{DESTDIR} || "$ENV{HOME}/prefix";
+my $module = "$build_root/usr/lib/libcrange/pgsql";
+my $host = $ENV{RANGE_TEST_PGSQL_HOST} || "127.0.0.1";
+my $port = $ENV{RANGE_TEST_PGSQL_PORT} || 5432;
+my $user = $ENV{RANGE_TEST_PGSQL_USER} || "postgres";
+my $passwd = $ENV{RANGE_TEST_PGSQL_PASSWD} || "postgres";
+my $db = $ENV{RANGE_TEST_PGSQL_DB} || "range_test";
+
+plan skip_all => "pgsql not built (configure --with-pgsql)"
+  unless -e "$module.so";
+
+$ENV{DESTDIR} = "$ENV{HOME}/prefix";
+$ENV{PATH} = "$ENV{DESTDIR}/usr/bin:$ENV{PATH}";
+$ENV{LD_LIBRARY_PATH} = "$ENV{DESTDIR}/usr/lib"; #FIXME should be lib64 for a 64bit build
+$ENV{PGPASSWORD} = $passwd;
+
+sub range_conf {
+  my ($extra) = @_;
+  my ($fh, $file) = File::Temp::tempfile();
+  print $fh qq{
+pgsql_host=$host
+pgsql_port=$port
+pgsql_user=$user
+pgsql_passwd=$passwd
+pgsql_db=$db
+$extra
+loadmodule $module
+};
+  close $fh;
+  return $file;
+}
+
+# no server needed to see that one that isn't there is reported
+my $nowhere = range_conf("pgsql_port=1");
+like(
+  `crange -c $nowhere -e 'group(web)'`,
+  qr/pgsql connection: /,
+  "group(web) # no server: warns, no nodes",
+  );
+
+my $psql = "psql -q -h $host -p $port -U $user";
+if (system("$psql -d postgres -c 'select 1' >/dev/null 2>&1") != 0) {
+  done_testing();
+  exit 0;
+}
+
+system("$psql -d postgres -c 'drop database if exists $db' >/dev/null");
+system("$psql -d postgres -c 'create database $db' >/dev/null") == 0
+  or die "creating $db failed";
+open(my $sql, "| $psql -d $db") or die "$psql: $!";
+print $sql qq{
+create table velementgroups (namespace text, groupname text, element text);
+insert into velementgroups values
+  ('yst', 'web', 'foo1'), ('yst', 'web', 'foo2'), ('yst', 'db', 'foo3'),
+  ('yst', 'quote"d', 'bar1'), ('other', 'web', 'baz1');
+};
+close($sql) or die "loading $db failed";
+
+my $conf = range_conf("");
+
+is(
+  `crange -c $conf -e 'group(web)'`,
+  qq{foo1\nfoo2\n},
+  "group(web)",
+  );
+
+is(
+  `crange -c $conf 'group(web,db)'`,
+  qq{foo1..3\n},
+  "group(web,db) # one query for both",
+  );
+
+is(
+  `crange -c $conf 'group(ALL)'`,
+  qq{bar1,foo1..3\n},
+  "group(ALL) # only the default namespace",
+  );
+
+is(
+  `crange -c $conf 'group(web,ALL)'`,
+  qq{bar1,foo1..3\n},
+  "group(web,ALL) # both queries at once",
+  );
+
+my $other = range_conf("default_namespace=other");
+is(
+  `crange -c $other 'group(web)'`,
+  qq{baz1\n},
+  "group(web) # default_namespace",
+  );
+
+is(
+  `crange -c $conf 'group(nosuchgroup)'`,
+  qq{\n},
+  "group(nosuchgroup) # empty",
+  );
+
+my $cached = range_conf("pgsql_cache_ttl=60");
+is(
+  `printf 'group(web)\\ngroup(web,db)\\n' | crange -c $cached -b`,
+  qq{foo1..2\nfoo1..3\n},
+  "group() through the pgsql result cache",
+  );
+
+system("$psql -d postgres -c 'drop database $db' >/dev/null");
+done_testing();
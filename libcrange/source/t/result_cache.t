@@ -0,0 +1,98 @@
+#!/usr/bin/perl -w
+
+use warnings;
+use strict;
+
+use Test::More;
+use File::Temp;
+
+# the result caches (range_cache.c) through group-sqlite's
+# "sqlite_group" cache: one crange -b run is one libcrange, each line a
+# request of its own. Lines are expanded in order on a single thread,
+# and each is distinct (batches expand duplicates once)
+my $build_root = $ENV{DESTDIR} || "$ENV{HOME}/prefix";
+my $module = "$build_root/usr/lib/libcrange/group-sqlite";
+
+plan skip_all => "group-sqlite not built" unless -e "$module.so";
+plan skip_all => "no sqlite3 to load the test database"
+  if system("sqlite3 -version >/dev/null 2>&1") != 0;
+
+$ENV{DESTDIR} = "$ENV{HOME}/prefix";
+$ENV{PATH} = "$ENV{DESTDIR}/usr/bin:$ENV{PATH}";
+$ENV{LD_LIBRARY_PATH} = "$ENV{DESTDIR}/usr/lib"; #FIXME should be lib64 for a 64bit build
+
+# each tag's range is one long name, so that every entry is the same
+# size and that size is mostly the name
+my %name = map { $_ => $_ x 200 } qw(a b c);
+my $dir = File::Temp::tempdir(CLEANUP => 1);
+my $db = "$dir/range.sqlite";
+open(my $sql, "| sqlite3 $db") or die "sqlite3: $!";
+print $sql qq{
+create table nodes (name text);
+create table tags (name text, range text);
+insert into nodes values ('foo1');
+};
+print $sql "insert into tags values ('$_', '$name{$_}');\n" for sort keys %name;
+close($sql) or die "loading $db failed";
+
+sub range_conf {
+  my ($extra) = @_;
+  my ($fh, $file) = File::Temp::tempfile();
+  print $fh qq{
+sqlitedb=$db
+batch_threads=1
+$extra
+loadmodule $module
+};
+  close $fh;
+  return $file;
+}
+
+# results, and the counters of the sqlite_group cache
+sub batch {
+  my ($extra, @lines) = @_;
+  my $conf = range_conf($extra);
+  my $input = join("\\n", @lines);
+  my @out = `printf '$input\\n' | crange -d -c $conf -b`;
+  my ($stats) = grep { /^DEBUG: result_cache:sqlite_group: / } @out;
+  my %stats = ($stats || "") =~ /(\w+) (\d+)/g;
+  return ([map { chomp; $_ } grep { !/^DEBUG/ } @out], \%stats);
+}
+
+my ($out, $stats) = batch("sqlite_group_cache_ttl=60",
+                          "group(a)", "(group(a))");
+is_deeply($out, [$name{a}, $name{a}], "results through the cache");
+is_deeply([@$stats{qw(hits misses inserts entries)}], [1, 1, 1, 1],
+          "sqlite_group_cache_ttl=60 # second lookup hits");
+
+($out, $stats) = batch("", "group(a)", "(group(a))");
+is_deeply($out, [$name{a}, $name{a}], "results without the cache");
+is($stats->{inserts} || 0, 0, "no sqlite_group_cache_ttl # no caching");
+
+($out, $stats) = batch("sqlite_group_cache_ttl=0.000001",
+                       "group(a)", "(group(a))");
+is_deeply($out, [$name{a}, $name{a}], "results from expired entries");
+is_deeply([@$stats{qw(hits expired misses inserts entries)}],
+          [0, 1, 2, 2, 1],
+          "sqlite_group_cache_ttl=0.000001 # expired, fetched again");
+
+($out, $stats) = batch("sqlite_group_cache_ttl=0.000001\n" .
+                       "sqlite_group_cache_stale=60",
+                       "group(a)", "(group(a))");
+is_deeply($out, [$name{a}, $name{a}], "results from stale entries");
+is_deeply([@$stats{qw(hits stale misses inserts)}], [0, 1, 1, 2],
+          "sqlite_group_cache_stale=60 # stale entry handed out to refresh");
+
+# room for two entries, not three. a is used again before c comes in,
+# so the hand spares it and evicts b; b coming back evicts c, the next
+# one along and never used; a is still there at the end
+($out, $stats) = batch("sqlite_group_cache_ttl=60\n" .
+                       "sqlite_group_cache_size=700",
+                       "group(a)", "group(b)", "(group(a))", "group(c)",
+                       "(group(b))", "((group(a)))");
+is_deeply($out, [@name{qw(a b a c b a)}], "results under eviction");
+is_deeply([@$stats{qw(hits misses inserts evictions entries)}],
+          [2, 4, 4, 2, 2],
+          "sqlite_group_cache_size=700 # CLOCK eviction");
+
+done_testing();
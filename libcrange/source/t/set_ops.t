@@ -78,4 +78,24 @@ is( `crange -e '{foo,bar,baz}.example.com - /^b/'`,
     "{foo,bar,baz}.example.com - /^b/",
     );
 
+is( `crange -e 'a1,a2,c1 - {a,b}{1,2}'`,
+    qq{c1\n},
+    "a1,a2,c1 - {a,b}{1,2}",
+    );
+
+is( `crange -e '{a,b}{1..3} & (b2,c2)'`,
+    qq{b2\n},
+    "{a,b}{1..3} & (b2,c2)",
+    );
+
+is( `crange -e 'x{a,b}y & (xy,xay,xby,xcy)' | sort`,
+    qq{xay\nxby\n},
+    "x{a,b}y & (xy,xay,xby,xcy)",
+    );
+
+is( `crange -e '{a,b}{1..1000}{x,y}' | wc -l`,
+    "4000\n",
+    "{a,b}{1..1000}{x,y} expands to the full product",
+    );
+
 done_testing();
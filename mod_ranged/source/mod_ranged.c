@@ -10,6 +10,8 @@ Copyrights licensed under the New BSD License. See the accompanying LICENSE file
 #include <http_protocol.h>
 
 #include <apr_strings.h>
+#include <apr_buckets.h>
+#include <util_filter.h>
 
 #include <ctype.h>
 #include <time.h>
@@ -18,6 +20,9 @@ Copyrights licensed under the New BSD License. See the accompanying LICENSE file
 #include <sys/time.h>
 
 static int log_requests = 0;
+static int compress_output = 0;
+static int watch_files = 0;
+static const char *snapshot_file = NULL;
 static int range_ttl = 3600;
 static int range_rtl = 2000;
 static int log_lwes = 0;
@@ -136,12 +141,27 @@ static char *read_post_data(request_rec * r)
      /* Allocate 1MB initiially*/    
      bufsize = 1024 * 1024;
      range = (char*) malloc(bufsize+1);
+     if (!range)
+         return "";
 
      /*If client has data to send*/
      if( ap_should_client_block(r) ) {
          while(1) {
-              /* read the data */
-              bytes_inserted = ap_get_client_block(r, range, bufsize); 
+              /* keep at least 8K free for the next read */
+              if (bufsize - post_data_size < 8 * 1024) {
+                  char* bigger = (char *) realloc(range, 2 * bufsize + 1);
+                  if (!bigger) {
+                      ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "mod_ranged: out of memory reading the request body.");
+                      free(range);
+                      return "";
+                  }
+                  range = bigger;
+                  bufsize += bufsize;
+              }
+
+              /* read the data after what we have so far */
+              bytes_inserted = ap_get_client_block(r, range + post_data_size,
+                                                   bufsize - post_data_size);
               
               if( bytes_inserted == 0 )
                    break;
@@ -153,15 +173,9 @@ static char *read_post_data(request_rec * r)
               }
                                                                           
               post_data_size += bytes_inserted;
-                                                                                                                                   
-              /*Allocate more if required, on > 7K*/
-              if (post_data_size >= bufsize - (7 * 1024) ){
-                  bufsize += bufsize;
-                  range = (char *) realloc(range,bufsize);
-              }
         } /* end of while(1) */
-        range[post_data_size] = '\0';
     }
+    range[post_data_size] = '\0';
     /*copy range to range_ret*/
     range_ret = apr_pstrdup(r->pool,range);
     /*unescape post params*/
@@ -170,12 +184,187 @@ static char *read_post_data(request_rec * r)
     return range_ret;
 }
 
+static void set_range_exception(request_rec * r, const char *warnings)
+{
+    char *header = (char *)warnings;
+    if (strlen(warnings) > 2048) {
+        header = apr_palloc(r->pool, 2048);
+        memcpy(header, warnings, 2047);
+        header[2047] = '\0';
+    }
+
+    apr_table_add(r->headers_out, "RangeException", header);
+}
+
+/* one expression per line in, one compressed result per line out */
+static int range_batch(request_rec * r, char *body)
+{
+    int i, n = 0;
+    char *line, *end;
+    char *warnings = NULL;
+    const char **texts;
+    range_request **rrs;
+    apr_array_header_t *lines = apr_array_make(r->pool, 64, sizeof(char *));
+
+    /* every line counts, empty or not (an empty range), so that output
+     * line N is always the answer to input line N as with crange -b */
+    for (line = body; *line; line = end + 1) {
+        int len;
+        if ((end = strchr(line, '\n')))
+            *end = '\0';
+        len = strlen(line);
+        if (len && line[len - 1] == '\r')
+            line[len - 1] = '\0';
+        *(char **)apr_array_push(lines) = line;
+        if (!end)
+            break;
+    }
+    n = lines->nelts;
+    texts = (const char **)lines->elts;
+
+    rrs = range_expand_batch(NULL, r->pool, texts, n);
+
+    for (i = 0; i < n; i++) {
+        if (!range_request_has_warnings(rrs[i]))
+            continue;
+        warnings = apr_psprintf(r->pool, "%s%s%d: %s",
+                                warnings ? warnings : "",
+                                warnings ? " ; " : "", i + 1,
+                                range_request_warnings(rrs[i]));
+    }
+    if (warnings)
+        set_range_exception(r, warnings);
+
+    for (i = 0; i < n; i++) {
+        ap_rputs(range_request_compressed(rrs[i]), r);
+        ap_rputc('\n', r);
+    }
+
+    return warnings != NULL;
+}
+
+/* node lists are written in chunks of this size */
+#define RANGE_CHUNK_SIZE (64 * 1024)
+
+typedef struct chunk_writer {
+    request_rec *r;
+    apr_bucket_brigade *bb;
+    char *buf;
+    apr_size_t used;
+    int quoted;
+    apr_status_t rv;
+} chunk_writer;
+
+static void chunk_flush(chunk_writer *w)
+{
+    apr_bucket *b;
+
+    if (!w->used || w->rv != APR_SUCCESS)
+        return;
+
+    b = apr_bucket_transient_create(w->buf, w->used,
+                                    w->r->connection->bucket_alloc);
+    APR_BRIGADE_INSERT_TAIL(w->bb, b);
+    w->rv = ap_pass_brigade(w->r->output_filters, w->bb);
+    apr_brigade_cleanup(w->bb);
+    w->used = 0;
+}
+
+static void chunk_write(chunk_writer *w, const char *data, apr_size_t len)
+{
+    while (len) {
+        apr_size_t n = RANGE_CHUNK_SIZE - w->used;
+        if (n > len)
+            n = len;
+        memcpy(w->buf + w->used, data, n);
+        w->used += n;
+        data += n;
+        len -= n;
+        if (w->used == RANGE_CHUNK_SIZE)
+            chunk_flush(w);
+    }
+}
+
+static int write_node(void *data, const char *name, size_t len)
+{
+    chunk_writer *w = data;
+    if (w->quoted)
+        chunk_write(w, "\"", 1);
+    chunk_write(w, name, len);
+    chunk_write(w, w->quoted ? "\"\n" : "\n", w->quoted ? 2 : 1);
+    return w->rv != APR_SUCCESS;
+}
+
+static int add_node_length(void *data, const char *name, size_t len)
+{
+    *(apr_off_t *)data += len + 1;
+    return 0;
+}
+
+static int accepts_encoding(request_rec * r, const char *coding)
+{
+    const char *accept = apr_table_get(r->headers_in, "Accept-Encoding");
+    return accept && ap_strcasestr(accept, coding) != NULL;
+}
+
+/* compression is left to mod_deflate (gzip) or a ZSTD output filter when
+ * one is loaded; they take care of Vary and Content-Encoding */
+static int add_compression(request_rec * r)
+{
+    if (!compress_output)
+        return 0;
+
+    if (accepts_encoding(r, "zstd") && ap_get_output_filter_handle("ZSTD")) {
+        ap_add_output_filter("ZSTD", NULL, r, r->connection);
+        return 1;
+    }
+    if (accepts_encoding(r, "gzip") &&
+        ap_get_output_filter_handle("DEFLATE")) {
+        ap_add_output_filter("DEFLATE", NULL, r, r->connection);
+        return 1;
+    }
+    return 0;
+}
+
+/* one node per line, natural order if sorted is set */
+static void write_nodes(request_rec * r, range_request * rr, int sorted)
+{
+    chunk_writer w;
+    apr_off_t length = 0;
+
+    w.r = r;
+    w.bb = apr_brigade_create(r->pool, r->connection->bucket_alloc);
+    w.buf = apr_palloc(r->pool, RANGE_CHUNK_SIZE);
+    w.used = 0;
+    w.quoted = range_request_is_quoted(rr);
+    w.rv = APR_SUCCESS;
+
+    if (!add_compression(r)) {
+        range_request_foreach(rr, add_node_length, &length);
+        if (w.quoted)
+            length += 2 * range_request_node_count(rr);
+        ap_set_content_length(r, length);
+    }
+
+    if (sorted) {
+        const char **nodes = range_request_nodes_sorted(rr);
+        while (*nodes && !write_node(&w, *nodes, strlen(*nodes)))
+            nodes++;
+    }
+    else
+        range_request_foreach(rr, write_node, &w);
+
+    chunk_flush(&w);
+}
+
 static int range_handler(request_rec * r)
 {
     range_request *rr;
     char *range;
     int wants_list = 0;
+    int wants_sorted = 0;
     int wants_expand = 0;
+    int wants_batch = 0;
     int warn = 0;
     struct timeval t;
     struct timeval end_t;
@@ -193,10 +382,14 @@ static int range_handler(request_rec * r)
     }
 
     wants_list = strcmp(r->path_info, "/list") == 0;
+    if (!wants_list)
+        wants_list = wants_sorted = strcmp(r->path_info, "/sorted") == 0;
     if (!wants_list)
         wants_expand = strcmp(r->path_info, "/expand") == 0;
-
     if (!wants_list && !wants_expand)
+        wants_batch = strcmp(r->path_info, "/batch") == 0;
+
+    if (!wants_list && !wants_expand && !wants_batch)
         return DECLINED;
 
     if (log_requests /*|| log_lwes*/ || !time_started) {
@@ -218,6 +411,18 @@ static int range_handler(request_rec * r)
     else
         range = read_post_data(r);
 
+    if (wants_batch) {
+        warn = range_batch(r, range);
+        if (log_requests) {
+            gettimeofday(&end_t, NULL);
+            ap_log_rerror(APLOG_MARK, APLOG_NOTICE, 0, r,
+                          "batch of %d bytes -- %0.3fs", (int)strlen(range),
+                          (end_t.tv_sec - t.tv_sec) +
+                          (end_t.tv_usec - t.tv_usec) / 1E6);
+        }
+        return OK;
+    }
+
     rr = range_expand(NULL, r->pool, range);
     gettimeofday(&end_t, NULL);
     timeval_subtract(&diff_t, &end_t, &t);
@@ -234,25 +439,11 @@ static int range_handler(request_rec * r)
 
     if (range_request_has_warnings(rr)) {
         warn = 1;
-        const char *warnings = range_request_warnings(rr);
-        char *header = (char *)warnings;
-        if (strlen(warnings) > 2048) {
-            header = apr_palloc(r->pool, 2048);
-            memcpy(header, warnings, 2047);
-            header[2047] = '\0';
-        }
-
-        apr_table_t *headers = r->headers_out;
-        apr_table_add(headers, "RangeException", header);
+        set_range_exception(r, range_request_warnings(rr));
     }
 
-    if (wants_list) {
-        const char **nodes = range_request_nodes(rr);
-        while (*nodes) {
-            ap_rputs(*nodes++, r);
-            ap_rputc('\n', r);
-        }
-    }
+    if (wants_list)
+        write_nodes(r, rr, wants_sorted);
     else {
         const char *compressed = range_request_compressed(rr);
         ap_rputs(compressed, r);
@@ -275,6 +466,28 @@ static const char *range_log_requests(cmd_parms * cmd, void *dummy, int flag)
     return NULL;
 }
 
+static const char *range_compress_output(cmd_parms * cmd, void *dummy,
+                                         int flag)
+{
+    compress_output = flag;
+    return NULL;
+}
+
+static const char *range_watch_files(cmd_parms * cmd, void *dummy, int flag)
+{
+    watch_files = flag;
+    return NULL;
+}
+
+static const char *range_set_snapshot_file(cmd_parms * cmd, void *dummy,
+                                           const char *arg)
+{
+    snapshot_file = ap_server_root_relative(cmd->pool, arg);
+    if (!snapshot_file)
+        return "RangeSnapshotFile: invalid path";
+    return NULL;
+}
+
 static const char *range_log_lwes(cmd_parms * cmd, void *dummy, int flag)
 {
     log_lwes = flag;
@@ -344,6 +557,15 @@ static const char *range_set_rtl(cmd_parms * cmd, void *dummy, const char *arg)
 static const command_rec config_range_cmds[] = {
     AP_INIT_FLAG("RangeLogRequests", range_log_requests, NULL, RSRC_CONF,
                  "On or Off to enable or disable (default) logging"),
+    AP_INIT_FLAG("RangeCompressOutput", range_compress_output, NULL,
+                 RSRC_CONF, "On to gzip (mod_deflate) or zstd compress "
+                 "/list and /sorted output when the client accepts it"),
+    AP_INIT_FLAG("RangeWatchFiles", range_watch_files, NULL, RSRC_CONF,
+                 "On to reload changed cluster files in the background "
+                 "instead of checking them on every request"),
+    AP_INIT_TAKE1("RangeSnapshotFile", range_set_snapshot_file, NULL,
+                  RSRC_CONF, "file to load parsed cluster data from when a "
+                  "child starts and save it to when it exits"),
 /*    AP_INIT_FLAG("RangeLogLwes", range_log_lwes, NULL, RSRC_CONF,
                  "On or Off to enable or disable (default) "
                  "logging via LWES emission"),
@@ -367,8 +589,31 @@ static const command_rec config_range_cmds[] = {
     {NULL}
 };
 
+static apr_status_t range_save_snapshot(void *data)
+{
+    libcrange_snapshot_save(NULL, snapshot_file);
+    return APR_SUCCESS;
+}
+
+static void range_child_init(apr_pool_t * p, server_rec * s)
+{
+    /* a missing or stale snapshot just means a cold start */
+    if (snapshot_file) {
+        libcrange_snapshot_load(NULL, snapshot_file);
+        apr_pool_cleanup_register(p, NULL, range_save_snapshot,
+                                  apr_pool_cleanup_null);
+    }
+
+    /* loads the modules up front too, so the first request doesn't pay */
+    if (watch_files && libcrange_watch_start(NULL) != 0)
+        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s,
+                     "RangeWatchFiles: can't watch files, "
+                     "checking them on every request");
+}
+
 static void register_hooks(apr_pool_t * p)
 {
+    ap_hook_child_init(range_child_init, NULL, NULL, APR_HOOK_MIDDLE);
     ap_hook_handler(range_handler, NULL, NULL, APR_HOOK_MIDDLE);
 }
 
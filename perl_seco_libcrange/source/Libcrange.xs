@@ -77,15 +77,19 @@ expand(self,range)
         apr_pool_destroy(req_pool);
         croak("%s", range_request_warnings(rr));
     }
-    const char **nodes = range_request_nodes(rr);
-    if (nodes == NULL)
+    /* copy straight out of the result set, no intermediate array */
+    range_node_iter it;
+    const char *name;
+    size_t len;
+    int quoted = range_request_is_quoted(rr);
+    EXTEND(SP, range_request_node_count(rr));
+    range_request_iter(rr, &it);
+    while (range_node_iter_next(&it, &name, &len))
     {
-      apr_pool_destroy(req_pool);
-      XSRETURN_UNDEF;
-    }
-    while (*nodes) 
-    {
-        XPUSHs(sv_2mortal(newSVpv(*nodes++, 0)));
+        if (quoted)
+            PUSHs(sv_2mortal(newSVpvf("\"%s\"", name)));
+        else
+            PUSHs(sv_2mortal(newSVpvn(name, len)));
     }
     apr_pool_destroy(req_pool); 
 